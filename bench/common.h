@@ -0,0 +1,25 @@
+#ifndef BENCH_COMMON_H
+#define BENCH_COMMON_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+
+// mkfs needs an existing image of the final size. Creates or resizes the
+// image at path to bytes, and reports on stderr when it cannot.
+inline bool makeImage(const std::string& path, uint64_t bytes) {
+
+    int image_fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (image_fd < 0 || ftruncate(image_fd, bytes) != 0) {
+        std::fprintf(stderr, "cannot create %s\n", path.c_str());
+        if (image_fd >= 0) close(image_fd);
+        return false;
+    }
+    close(image_fd);
+
+    return true;
+}
+
+#endif
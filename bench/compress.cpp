@@ -0,0 +1,179 @@
+// Compressed against plain files
+//
+// Writes the same data once to a plain file and once to a compressed one,
+// then reads it back from a freshly mounted image (empty block cache):
+//
+//   write   - 1 MB writeFile calls, sync included
+//   read    - sequential 1 MB readFile calls, the data is checked
+//   random  - 4 KB readFile calls at random offsets
+//
+// Three kinds of data are used: JSON log lines, plain text log lines and
+// random bytes (which do not compress, so the compressed file pays for the
+// attempt and stores them plainly). Besides the throughput, every line gives
+// the blocks the file takes and the blocks moved per MB of file data, which
+// is what compression is meant to cut.
+//
+// Usage: ./compress.out [image path]   (default /dev/shm/vfs_bench.img, 512 MB)
+
+#include "../fs/fs.h"
+#include "common.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+static const uint32_t DATA_BYTES = 64 * 1024 * 1024;
+static const uint32_t CHUNK = 1024 * 1024;
+static const uint32_t RANDOM_READS = 5000;
+static const uint32_t RANDOM_SIZE = 4096;
+
+static void fail(const std::string& message) {
+
+    std::fprintf(stderr, "%s\n", message.c_str());
+    std::exit(1);
+
+}
+
+static double seconds(std::chrono::steady_clock::time_point start) {
+
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+}
+
+static std::string makeData(const std::string& kind) {
+
+    static const char* const levels[] = { "INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR" };
+    static const char* const paths[] = { "/v1/items", "/v1/users", "/v1/orders", "/health", "/v2/search" };
+
+    std::mt19937 rng(7);
+    auto next = [&rng](uint32_t bound) { return static_cast<unsigned>(rng() % bound); };    // For %u
+    std::string data;
+    data.reserve(DATA_BYTES + 256);
+
+    while (data.size() < DATA_BYTES) {
+
+        char line[256];
+        uint32_t ts = 1700000000 + data.size() / 4096;
+
+        if (kind == "json") {
+            std::snprintf(line, sizeof(line),
+                          "{\"ts\":%u,\"level\":\"%s\",\"service\":\"api-%u\",\"path\":\"%s/%u\",\"status\":%u,\"ms\":%u,\"user\":\"u%05u\"}\n",
+                          ts, levels[rng() % 6], next(8), paths[rng() % 5], next(100000),
+                          rng() % 10 == 0 ? 404 : 200, next(300), next(20000));
+        } else if (kind == "text") {
+            std::snprintf(line, sizeof(line),
+                          "%u.%03u host-%u sshd[%u]: %s publickey for user%u from 10.0.%u.%u port %u ssh2\n",
+                          ts, next(1000), next(4), 1000 + next(50), rng() % 7 == 0 ? "Failed" : "Accepted",
+                          next(200), next(8), next(256), 40000 + next(20000));
+        } else {
+            uint32_t words[32];
+            for (uint32_t& word : words) {
+                word = rng();
+            }
+            data.append(reinterpret_cast<const char*>(words), sizeof(words));
+            continue;
+        }
+
+        data += line;
+    }
+
+    data.resize(DATA_BYTES);
+    return data;
+}
+
+static void run(const std::string& image, const std::string& kind, const std::string& data, bool compressed) {
+
+    mkfs(image);
+    FileSystem* fs = mount(image);
+    Stats& stats = fs->getStats();
+    double megabytes = DATA_BYTES / (1024.0 * 1024.0);
+
+    // Step 1: Write
+    uint64_t free_before = fs->statfs().free_blocks;
+    uint64_t writes_before = stats.get(Stats::BLOCK_WRITES);
+    auto start = std::chrono::steady_clock::now();
+
+    if (!fs->createFile("/data")) fail("create failed");
+    int fd = fs->openFile("/data");
+    if (fd < 0) fail("open failed");
+    if (compressed && !fs->setCompression(fd, true)) fail("setCompression failed");
+
+    for (uint32_t done = 0; done < DATA_BYTES; done += CHUNK) {
+        if (fs->writeFile(fd, data.data() + done, CHUNK) != static_cast<int>(CHUNK)) fail("write failed");
+    }
+
+    fs->closeFile(fd);
+    fs->sync();
+
+    double write_s = seconds(start);
+    uint64_t write_blocks = stats.get(Stats::BLOCK_WRITES) - writes_before;
+    uint64_t used_blocks = free_before - fs->statfs().free_blocks;
+
+    fs->unmount();
+    delete fs;
+
+    // Step 2: Sequential read, from an empty cache
+    fs = mount(image);
+    Stats& read_stats = fs->getStats();
+    std::vector<char> buffer(CHUNK);
+
+    fd = fs->openFile("/data");
+    if (fd < 0) fail("open failed");
+
+    uint64_t reads_before = read_stats.get(Stats::BLOCK_READS);
+    start = std::chrono::steady_clock::now();
+
+    for (uint32_t done = 0; done < DATA_BYTES; done += CHUNK) {
+        if (fs->readFile(fd, buffer.data(), CHUNK) != static_cast<int>(CHUNK)) fail("read failed");
+        if (std::memcmp(buffer.data(), data.data() + done, CHUNK) != 0) fail("read returned wrong data");
+    }
+
+    double read_s = seconds(start);
+    uint64_t read_blocks = read_stats.get(Stats::BLOCK_READS) - reads_before;
+
+    // Step 3: Random reads
+    std::mt19937 rng(11);
+    start = std::chrono::steady_clock::now();
+
+    for (uint32_t i = 0; i < RANDOM_READS; ++i) {
+        uint64_t offset = rng() % (DATA_BYTES - RANDOM_SIZE);
+        fs->seekFile(fd, offset);
+        if (fs->readFile(fd, buffer.data(), RANDOM_SIZE) != static_cast<int>(RANDOM_SIZE)) fail("read failed");
+    }
+
+    double random_s = seconds(start);
+
+    fs->closeFile(fd);
+    fs->unmount();
+    delete fs;
+
+    std::printf("%s,%s,%.2f,%.1f,%.1f,%.0f,%.1f,%.1f,%llu\n", kind.c_str(), compressed ? "compressed" : "plain",
+                megabytes * 256 / used_blocks, megabytes / write_s, megabytes / read_s, RANDOM_READS / random_s,
+                write_blocks / megabytes, read_blocks / megabytes, static_cast<unsigned long long>(used_blocks));
+    std::fflush(stdout);
+
+}
+
+int main(int argc, char** argv) {
+
+    std::string image = argc > 1 ? argv[1] : "/dev/shm/vfs_bench.img";
+
+    if (!makeImage(image, 512ULL * 1024 * 1024)) {
+        return 1;
+    }
+
+    std::printf("data,mode,ratio,write_mb_s,read_mb_s,random_reads_s,write_blocks_per_mb,read_blocks_per_mb,blocks_used\n");
+
+    for (const std::string kind : { "json", "text", "random" }) {
+
+        std::string data = makeData(kind);
+
+        run(image, kind, data, false);
+        run(image, kind, data, true);
+    }
+
+    return 0;
+}
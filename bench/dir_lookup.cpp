@@ -0,0 +1,78 @@
+// Directory lookup benchmark
+//
+// Fills the root directory with 10, 700 and 100000 entries and measures the
+// cost of a name lookup (hits and misses). All entries point at one inode, so
+// the entry count is not limited by the number of free inodes.
+//
+// Usage: ./dir_lookup.out [image path]   (default /dev/shm/vfs_bench.img, 512 MB)
+
+#include "../fs/fs.h"
+#include "common.h"
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+
+static double lookupNanos(FileSystem* fs, uint32_t entries, bool hit, uint32_t rounds) {
+
+    std::mt19937 rng(42);
+    Inode root = fs->readInode(0);
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (uint32_t i = 0; i < rounds; ++i) {
+
+        uint32_t n = rng() % entries;
+        std::string name = (hit ? "entry_" : "missing_") + std::to_string(n);
+
+        int64_t found = fs->lookupEntry(root, name);
+
+        if ((found >= 0) != hit) {
+            std::fprintf(stderr, "unexpected lookup result for %s\n", name.c_str());
+            std::exit(1);
+        }
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / rounds;
+}
+
+int main(int argc, char** argv) {
+
+    std::string image = argc > 1 ? argv[1] : "/dev/shm/vfs_bench.img";
+
+    if (!makeImage(image, 512ULL * 1024 * 1024)) {
+        return 1;
+    }
+
+    std::printf("entries,dir_blocks,insert_ns,hit_ns,miss_ns\n");
+
+    for (uint32_t entries : { 10u, 700u, 100000u }) {
+
+        mkfs(image);
+        FileSystem* fs = mount(image);
+
+        uint32_t target = fs->allocateInode();
+        Inode root = fs->readInode(0);
+
+        auto start = std::chrono::steady_clock::now();
+
+        for (uint32_t i = 0; i < entries; ++i) {
+            fs->addEntry(0, root, "entry_" + std::to_string(i), target);
+        }
+
+        auto end = std::chrono::steady_clock::now();
+        fs->writeInode(0, root);
+
+        double insert_ns = std::chrono::duration<double, std::nano>(end - start).count() / entries;
+        double hit_ns = lookupNanos(fs, entries, true, 200000);
+        double miss_ns = lookupNanos(fs, entries, false, 200000);
+
+        std::printf("%u,%u,%.0f,%.0f,%.0f\n", entries, static_cast<uint32_t>(root.size / fs->super_cache.block_size), insert_ns, hit_ns, miss_ns);
+
+        fs->unmount();
+        delete fs;
+    }
+
+    return 0;
+}
@@ -0,0 +1,214 @@
+// Microbenchmark of the core operations
+//
+// Every operation is timed on its own, so besides the throughput the run also
+// reports the median and the 99th percentile latency of a single call:
+//
+//   disk_read_block / disk_write_block   - DiskManager on a raw image, random blocks
+//   allocate_inode / allocate_data_block - allocator calls on a mounted filesystem
+//   create_file / open_file / delete_file
+//   write / read                         - sequential calls of 64 B, 4 KB, 64 KB and 1 MB
+//
+// The output is CSV with one line per operation (and size), so runs of two
+// versions can be compared line by line.
+//
+// Usage: ./ops.out [image path]   (default /dev/shm/vfs_bench.img, 512 MB)
+
+#include "../fs/fs.h"
+#include "common.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+static const uint32_t BLOCK_OPS = 20000;
+static const uint32_t ALLOC_OPS = 10000;
+static const uint32_t FILE_OPS = 5000;
+static const uint64_t IO_BYTES = 32ULL * 1024 * 1024;     // Upper bound of the bytes moved per write/read size
+
+static void fail(const std::string& message) {
+
+    std::fprintf(stderr, "%s\n", message.c_str());
+    std::exit(1);
+
+}
+
+// Runs op(i) for i in [0, count) and returns the latency of each call in nanoseconds
+template <typename Op>
+static std::vector<double> measure(uint32_t count, Op op) {
+
+    std::vector<double> samples;
+    samples.reserve(count);
+
+    for (uint32_t i = 0; i < count; ++i) {
+
+        auto start = std::chrono::steady_clock::now();
+        op(i);
+        auto end = std::chrono::steady_clock::now();
+
+        samples.push_back(std::chrono::duration<double, std::nano>(end - start).count());
+    }
+
+    return samples;
+}
+
+static void report(const std::string& op, uint32_t bytes, std::vector<double> samples) {
+
+    std::sort(samples.begin(), samples.end());
+
+    double total = 0;
+    for (double sample : samples) {
+        total += sample;
+    }
+
+    size_t n = samples.size();
+    double ops_s = total > 0 ? n / (total / 1e9) : 0;
+
+    std::printf("%s,%u,%zu,%.0f,%.0f,%.0f\n", op.c_str(), bytes, n, ops_s, samples[(n - 1) * 50 / 100], samples[(n - 1) * 99 / 100]);
+    std::fflush(stdout);
+
+}
+
+static void benchDisk(const std::string& image) {
+
+    DiskManager disk(image);
+    std::mt19937 rng(42);
+    char buffer[4096];
+    std::memset(buffer, 0xAB, sizeof(buffer));
+
+    // Blocks are picked from a range larger than the block cache
+    uint32_t range = 65536;
+
+    report("disk_write_block", 4096, measure(BLOCK_OPS, [&](uint32_t) { disk.writeBlock(rng() % range, buffer); }));
+    report("disk_read_block", 4096, measure(BLOCK_OPS, [&](uint32_t) { disk.readBlock(rng() % range, buffer); }));
+
+    disk.sync();
+
+}
+
+static void benchAllocator(FileSystem* fs) {
+
+    report("allocate_inode", 0, measure(ALLOC_OPS, [fs](uint32_t) { fs->allocateInode(); }));
+    report("allocate_data_block", 0, measure(ALLOC_OPS, [fs](uint32_t) { fs->allocateDataBlock(); }));
+
+    // Nothing references them, a fresh mkfs gives them back
+    fs->sync();
+
+}
+
+static void benchFiles(FileSystem* fs) {
+
+    fs->createDirectory("/b");
+
+    report("create_file", 0, measure(FILE_OPS, [fs](uint32_t i) {
+        if (!fs->createFile("/b/f" + std::to_string(i))) {
+            fail("create failed");
+        }
+    }));
+
+    // Descriptors are limited, so they are opened in rounds and closed again
+    // outside the timing
+    std::vector<double> open_samples;
+
+    for (uint32_t round = 0; round < FILE_OPS; round += 200) {
+
+        std::vector<int> fds(std::min<uint32_t>(200, FILE_OPS - round));
+
+        std::vector<double> samples = measure(fds.size(), [fs, &fds, round](uint32_t i) {
+            fds[i] = fs->openFile("/b/f" + std::to_string(round + i));
+        });
+
+        for (int fd : fds) {
+            if (fd < 0) {
+                fail("open failed");
+            }
+            fs->closeFile(fd);
+        }
+
+        open_samples.insert(open_samples.end(), samples.begin(), samples.end());
+    }
+
+    report("open_file", 0, open_samples);
+
+    report("delete_file", 0, measure(FILE_OPS, [fs](uint32_t i) {
+        if (!fs->deleteFile("/b/f" + std::to_string(i))) {
+            fail("delete failed");
+        }
+    }));
+
+}
+
+static void benchReadWrite(FileSystem* fs, uint32_t size) {
+
+    std::string name = "/io" + std::to_string(size);
+    uint32_t count = std::min<uint64_t>(FILE_OPS, IO_BYTES / size);
+
+    std::vector<char> data(size);
+    for (uint32_t i = 0; i < size; ++i) {
+        data[i] = static_cast<char>(i * 7);
+    }
+
+    fs->createFile(name);
+
+    int fd = fs->openFile(name);
+    report("write", size, measure(count, [fs, fd, &data, size](uint32_t) {
+        if (fs->writeFile(fd, data.data(), size) != static_cast<int>(size)) {
+            fail("write failed");
+        }
+    }));
+    fs->closeFile(fd);
+
+    std::vector<char> buffer(size);
+
+    fd = fs->openFile(name);
+    report("read", size, measure(count, [fs, fd, &buffer, size](uint32_t) {
+        if (fs->readFile(fd, buffer.data(), size) != static_cast<int>(size)) {
+            fail("read failed");
+        }
+    }));
+    fs->closeFile(fd);
+
+    if (buffer != data) {
+        fail("wrong data in " + name);
+    }
+
+    fs->deleteFile(name);
+
+}
+
+int main(int argc, char** argv) {
+
+    std::string image = argc > 1 ? argv[1] : "/dev/shm/vfs_bench.img";
+
+    if (!makeImage(image, 512ULL * 1024 * 1024)) {
+        return 1;
+    }
+
+    std::printf("op,bytes,ops,ops_s,p50_ns,p99_ns\n");
+
+    // The raw block benchmark runs first, mkfs overwrites what it wrote
+    benchDisk(image);
+
+    mkfs(image);
+    FileSystem* fs = mount(image);
+    benchAllocator(fs);
+    fs->unmount();
+    delete fs;
+
+    mkfs(image);
+    fs = mount(image);
+
+    benchFiles(fs);
+
+    for (uint32_t size : { 64u, 4096u, 65536u, 1048576u }) {
+        benchReadWrite(fs, size);
+    }
+
+    fs->unmount();
+    delete fs;
+
+    return 0;
+}
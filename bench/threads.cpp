@@ -0,0 +1,186 @@
+// Thread scaling benchmark
+//
+// Runs the same per-thread workload with 1, 2, 4, 8, 16 and 32 threads on one
+// mounted filesystem and reports the aggregate throughput of each phase:
+//
+//   create  - create, write (8 KB) and close files in the thread's own directory
+//   read    - every thread reads all files of its directory and checks the data
+//   shared  - every thread reads the same file through its own descriptor
+//   delete  - remove the files again
+//
+// Every file holds a pattern derived from its name, so a lost or mixed up
+// write fails the run.
+//
+// Usage: ./threads.out [image path]   (default /dev/shm/vfs_bench.img, 512 MB)
+
+#include "../fs/fs.h"
+#include "common.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+static const uint32_t FILES_PER_THREAD = 400;
+static const uint32_t FILE_SIZE = 8192;
+static const uint32_t SHARED_READS = 400;
+
+static void fill(char* buffer, uint32_t thread, uint32_t file) {
+
+    for (uint32_t i = 0; i < FILE_SIZE; ++i) {
+        buffer[i] = static_cast<char>((thread * 131 + file * 31 + i) & 0xFF);
+    }
+
+}
+
+static void fail(const std::string& message) {
+
+    std::fprintf(stderr, "%s\n", message.c_str());
+    std::exit(1);
+
+}
+
+static std::string fileName(uint32_t thread, uint32_t file) {
+
+    return "/t" + std::to_string(thread) + "/f" + std::to_string(file);
+}
+
+static void createFiles(FileSystem* fs, uint32_t thread) {
+
+    char buffer[FILE_SIZE];
+
+    for (uint32_t file = 0; file < FILES_PER_THREAD; ++file) {
+
+        std::string name = fileName(thread, file);
+        fill(buffer, thread, file);
+
+        if (!fs->createFile(name)) {
+            fail("create failed: " + name);
+        }
+
+        int fd = fs->openFile(name);
+        if (fd < 0 || fs->writeFile(fd, buffer, FILE_SIZE) != static_cast<int>(FILE_SIZE)) {
+            fail("write failed: " + name);
+        }
+        fs->closeFile(fd);
+    }
+
+}
+
+static void readFiles(FileSystem* fs, uint32_t thread) {
+
+    char buffer[FILE_SIZE];
+    char expected[FILE_SIZE];
+
+    for (uint32_t file = 0; file < FILES_PER_THREAD; ++file) {
+
+        std::string name = fileName(thread, file);
+        fill(expected, thread, file);
+
+        int fd = fs->openFile(name);
+        if (fd < 0 || fs->readFile(fd, buffer, FILE_SIZE) != static_cast<int>(FILE_SIZE)) {
+            fail("read failed: " + name);
+        }
+        fs->closeFile(fd);
+
+        if (std::memcmp(buffer, expected, FILE_SIZE) != 0) {
+            fail("wrong data in " + name);
+        }
+    }
+
+}
+
+static void readShared(FileSystem* fs) {
+
+    char buffer[FILE_SIZE];
+    char expected[FILE_SIZE];
+    fill(expected, 0, 0);
+
+    int fd = fs->openFile(fileName(0, 0));
+    if (fd < 0) {
+        fail("open failed: " + fileName(0, 0));
+    }
+
+    for (uint32_t i = 0; i < SHARED_READS; ++i) {
+
+        // Every read starts at offset 0 again on a fresh descriptor
+        fs->closeFile(fd);
+        fd = fs->openFile(fileName(0, 0));
+
+        if (fs->readFile(fd, buffer, FILE_SIZE) != static_cast<int>(FILE_SIZE) || std::memcmp(buffer, expected, FILE_SIZE) != 0) {
+            fail("wrong data in shared file");
+        }
+    }
+
+    fs->closeFile(fd);
+
+}
+
+static void deleteFiles(FileSystem* fs, uint32_t thread) {
+
+    for (uint32_t file = 0; file < FILES_PER_THREAD; ++file) {
+        if (!fs->deleteFile(fileName(thread, file))) {
+            fail("delete failed: " + fileName(thread, file));
+        }
+    }
+
+}
+
+// Runs work on threads threads at once and returns the elapsed seconds
+template <typename Work>
+static double runThreads(uint32_t threads, Work work) {
+
+    std::vector<std::thread> workers;
+    auto start = std::chrono::steady_clock::now();
+
+    for (uint32_t t = 0; t < threads; ++t) {
+        workers.emplace_back(work, t);
+    }
+
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(end - start).count();
+}
+
+int main(int argc, char** argv) {
+
+    std::string image = argc > 1 ? argv[1] : "/dev/shm/vfs_bench.img";
+
+    if (!makeImage(image, 512ULL * 1024 * 1024)) {
+        return 1;
+    }
+
+    std::printf("threads,create_ops_s,read_mb_s,shared_mb_s,delete_ops_s\n");
+
+    for (uint32_t threads : { 1u, 2u, 4u, 8u, 16u, 32u }) {
+
+        mkfs(image);
+        FileSystem* fs = mount(image);
+
+        for (uint32_t t = 0; t < threads; ++t) {
+            fs->createDirectory("/t" + std::to_string(t));
+        }
+
+        double files = static_cast<double>(threads) * FILES_PER_THREAD;
+        double megabytes = files * FILE_SIZE / (1024.0 * 1024.0);
+        double shared_megabytes = static_cast<double>(threads) * SHARED_READS * FILE_SIZE / (1024.0 * 1024.0);
+
+        double create_s = runThreads(threads, [fs](uint32_t t) { createFiles(fs, t); });
+        double read_s = runThreads(threads, [fs](uint32_t t) { readFiles(fs, t); });
+        double shared_s = runThreads(threads, [fs](uint32_t) { readShared(fs); });
+        double delete_s = runThreads(threads, [fs](uint32_t t) { deleteFiles(fs, t); });
+
+        std::printf("%u,%.0f,%.1f,%.1f,%.0f\n", threads, files / create_s, megabytes / read_s, shared_megabytes / shared_s, files / delete_s);
+        std::fflush(stdout);
+
+        fs->unmount();
+        delete fs;
+    }
+
+    return 0;
+}
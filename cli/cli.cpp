@@ -1,6 +1,14 @@
 #include "cli.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <iomanip>
 #include <iostream>
 #include <sstream>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
 
 CLI::CLI() : fs(nullptr), diskPath("vdisk.img") {}
 
@@ -12,6 +20,80 @@ CLI::~CLI() {
     }
 }
 
+bool CLI::importFile(const std::string& hostPath, const std::string& vfsPath, bool compress, uint64_t* bytes) {
+
+    int host_fd = ::open(hostPath.c_str(), O_RDONLY);
+    if (host_fd < 0) {
+        std::cout << "Cannot open " << hostPath << ": " << std::strerror(errno) << "\n";
+        return false;
+    }
+
+    if (!fs->createFile(vfsPath)) {
+        std::cout << "Create failed: " << vfsPath << "\n";
+        ::close(host_fd);
+        return false;
+    }
+
+    int fd = fs->openFile(vfsPath);
+    if (fd < 0) {
+        std::cout << "Open failed: " << vfsPath << "\n";
+        ::close(host_fd);
+        return false;
+    }
+
+    if (compress && !fs->setCompression(fd, true)) {
+        std::cout << "Compression not supported, importing plain: " << vfsPath << "\n";
+    }
+
+    try {
+        *bytes += fs->importFile(host_fd, fd);
+    } catch (...) {
+        fs->closeFile(fd);
+        ::close(host_fd);
+        throw;
+    }
+
+    fs->closeFile(fd);
+    ::close(host_fd);
+    return true;
+}
+
+void CLI::importPath(const std::string& hostPath, const std::string& vfsPath, bool compress, uint64_t* files, uint64_t* bytes) {
+
+    namespace stdfs = std::filesystem;
+
+    if (!stdfs::is_directory(hostPath)) {
+        if (importFile(hostPath, vfsPath, compress, bytes))
+            ++*files;
+        return;
+    }
+
+    if (fs->lookupPath(vfsPath) < 0 && !fs->createDirectory(vfsPath)) {
+        std::cout << "Mkdir failed: " << vfsPath << "\n";
+        return;
+    }
+
+    // Sorted, so an import always creates the same files in the same order
+    std::vector<stdfs::directory_entry> entries;
+    for (const stdfs::directory_entry& entry : stdfs::directory_iterator(hostPath)) {
+        entries.push_back(entry);
+    }
+    std::sort(entries.begin(), entries.end());
+
+    std::string prefix = vfsPath == "/" ? "/" : vfsPath + "/";
+
+    for (const stdfs::directory_entry& entry : entries) {
+
+        // Symlinked directories are skipped, they could lead back up the tree
+        if (entry.is_directory() && !entry.is_symlink()) {
+            importPath(entry.path().string(), prefix + entry.path().filename().string(), compress, files, bytes);
+        } else if (entry.is_regular_file()) {
+            if (importFile(entry.path().string(), prefix + entry.path().filename().string(), compress, bytes))
+                ++*files;
+        }
+    }
+}
+
 void CLI::run() {
 
     std::cout << "Mini VFS CLI\n";
@@ -38,16 +120,33 @@ void CLI::run() {
 
                 std::cout << "Commands:\n";
                 std::cout << "  mkfs\n";
-                std::cout << "  mount\n";
-                std::cout << "  create <filename>\n";
+                std::cout << "  mount [mmap]\n";
+                std::cout << "  create <filename>...\n";
                 std::cout << "  write <filename> <text>\n";
                 std::cout << "  cat <filename>\n";
-                std::cout << "  delete <filename>\n";
-                std::cout << "  ls\n";
+                std::cout << "  truncate <filename> <size>\n";
+                std::cout << "  punch <filename> <offset> <length>\n";
+                std::cout << "  compress <filename>           (empty files only)\n";
+                std::cout << "  import [-z] <hostpath> [vfsname]   (directories recursively, -z compressed)\n";
+                std::cout << "  export <vfsname> <hostpath>\n";
+                std::cout << "  delete <filename>...\n";
+                std::cout << "  mkdir <path>\n";
+                std::cout << "  rmdir <path>\n";
+                std::cout << "  ls [path]\n";
+                std::cout << "  sync\n";
+                std::cout << "  df\n";
+                std::cout << "  stats [json|reset]\n";
                 std::cout << "  exit\n";
 
             } else if (command == "mkfs") {
 
+                // The mounted filesystem caches blocks of the old image, flush and drop it first
+                if (fs) {
+                    fs->unmount();
+                    delete fs;
+                    fs = nullptr;
+                }
+
                 mkfs(diskPath);
                 std::cout << "Disk formatted.\n";
 
@@ -58,25 +157,41 @@ void CLI::run() {
                     continue;
                 }
 
-                fs = mount(diskPath);
+                std::string backend;
+                ss >> backend;
+
+                if (!backend.empty() && backend != "mmap" && backend != "pread") {
+                    std::cout << "Usage: mount [mmap]\n";
+                    continue;
+                }
+
+                fs = mount(diskPath, backend == "mmap" ? DiskBackend::Mmap : DiskBackend::Pread);
                 std::cout << "Filesystem mounted.\n";
 
             } else if (command == "create") {
 
                 if (!fs) { std::cout << "Not mounted.\n"; continue; }
 
+                std::vector<std::string> filenames;
                 std::string filename;
-                ss >> filename;
+                while (ss >> filename)
+                    filenames.push_back(filename);
 
-                if (filename.empty()) {
+                if (filenames.empty()) {
                     std::cout << "Filename required.\n";
                     continue;
                 }
 
-                if (fs->createFile(filename))
-                    std::cout << "File created.\n";
-                else
-                    std::cout << "Create failed.\n";
+                if (filenames.size() == 1) {
+                    if (fs->createFile(filenames[0]))
+                        std::cout << "File created.\n";
+                    else
+                        std::cout << "Create failed.\n";
+                    continue;
+                }
+
+                std::vector<bool> created = fs->createFiles(filenames);
+                std::cout << "Created " << std::count(created.begin(), created.end(), true) << " of " << filenames.size() << " files.\n";
 
             } else if (command == "write") {
 
@@ -141,17 +256,193 @@ void CLI::run() {
                 std::cout << "\n";
                 fs->closeFile(fd);
 
-            } else if (command == "delete") {
+            } else if (command == "truncate" || command == "punch") {
+
+                if (!fs) { std::cout << "Not mounted.\n"; continue; }
+
+                std::string filename;
+                uint64_t first = 0, second = 0;
+                ss >> filename >> first;
+
+                if (command == "punch")
+                    ss >> second;
+
+                if (filename.empty() || ss.fail()) {
+                    std::cout << (command == "punch" ? "Usage: punch <filename> <offset> <length>\n" : "Usage: truncate <filename> <size>\n");
+                    continue;
+                }
+
+                int fd = fs->openFile(filename);
+                if (fd < 0) {
+                    std::cout << "File not found.\n";
+                    continue;
+                }
+
+                bool done = command == "punch" ? fs->punchHole(fd, first, second) : fs->truncateFile(fd, first);
+                fs->closeFile(fd);
+
+                std::cout << (done ? (command == "punch" ? "Hole punched.\n" : "Truncated.\n") : "Failed.\n");
+
+            } else if (command == "compress") {
 
                 if (!fs) { std::cout << "Not mounted.\n"; continue; }
 
                 std::string filename;
                 ss >> filename;
 
-                if (fs->deleteFile(filename))
-                    std::cout << "Deleted.\n";
-                else
-                    std::cout << "Delete failed.\n";
+                if (filename.empty()) {
+                    std::cout << "Usage: compress <filename>\n";
+                    continue;
+                }
+
+                int fd = fs->openFile(filename);
+                if (fd < 0) {
+                    std::cout << "File not found.\n";
+                    continue;
+                }
+
+                bool done = fs->setCompression(fd, true);
+                fs->closeFile(fd);
+
+                std::cout << (done ? "Compression enabled.\n" : "Failed: only an empty file can be compressed.\n");
+
+            } else if (command == "import") {
+
+                if (!fs) { std::cout << "Not mounted.\n"; continue; }
+
+                std::string hostPath, vfsPath;
+                ss >> hostPath;
+
+                bool compress = hostPath == "-z";
+                if (compress)
+                    ss >> hostPath;
+
+                ss >> vfsPath;
+
+                if (hostPath.empty() || hostPath == "-z") {
+                    std::cout << "Usage: import [-z] <hostpath> [vfsname]\n";
+                    continue;
+                }
+
+                if (vfsPath.empty()) {
+                    std::string name = std::filesystem::path(hostPath).lexically_normal().filename().string();
+                    if (name.empty())
+                        name = std::filesystem::path(hostPath).lexically_normal().parent_path().filename().string();
+                    vfsPath = "/" + name;
+                }
+
+                uint64_t files = 0, bytes = 0;
+                auto start = std::chrono::steady_clock::now();
+
+                importPath(hostPath, vfsPath, compress, &files, &bytes);
+
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                std::cout << "Imported " << files << " files, " << bytes << " bytes in " << std::fixed << std::setprecision(2)
+                          << seconds << " s (" << (seconds > 0 ? bytes / seconds / (1024 * 1024) : 0) << " MB/s).\n";
+                std::cout.unsetf(std::ios::floatfield);
+
+            } else if (command == "export") {
+
+                if (!fs) { std::cout << "Not mounted.\n"; continue; }
+
+                std::string vfsPath, hostPath;
+                ss >> vfsPath >> hostPath;
+
+                if (vfsPath.empty() || hostPath.empty()) {
+                    std::cout << "Usage: export <vfsname> <hostpath>\n";
+                    continue;
+                }
+
+                int fd = fs->openFile(vfsPath);
+                if (fd < 0) {
+                    std::cout << "File not found.\n";
+                    continue;
+                }
+
+                int host_fd = ::open(hostPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (host_fd < 0) {
+                    std::cout << "Cannot open " << hostPath << ": " << std::strerror(errno) << "\n";
+                    fs->closeFile(fd);
+                    continue;
+                }
+
+                // The file stays locked for one call, so it goes out in slices
+                const uint64_t SLICE = 64 * 1024 * 1024;
+                uint64_t bytes = 0;
+
+                try {
+                    int64_t sent;
+                    while ((sent = fs->exportFile(fd, host_fd, SLICE)) > 0)
+                        bytes += sent;
+                } catch (...) {
+                    ::close(host_fd);
+                    fs->closeFile(fd);
+                    throw;
+                }
+
+                ::close(host_fd);
+                fs->closeFile(fd);
+                std::cout << "Exported " << bytes << " bytes.\n";
+
+            } else if (command == "delete") {
+
+                if (!fs) { std::cout << "Not mounted.\n"; continue; }
+
+                std::vector<std::string> filenames;
+                std::string filename;
+                while (ss >> filename)
+                    filenames.push_back(filename);
+
+                if (filenames.size() <= 1) {
+                    if (!filenames.empty() && fs->deleteFile(filenames[0]))
+                        std::cout << "Deleted.\n";
+                    else
+                        std::cout << "Delete failed.\n";
+                    continue;
+                }
+
+                std::vector<bool> deleted = fs->deleteFiles(filenames);
+                std::cout << "Deleted " << std::count(deleted.begin(), deleted.end(), true) << " of " << filenames.size() << " files.\n";
+
+            } else if (command == "sync") {
+
+                if (!fs) { std::cout << "Not mounted.\n"; continue; }
+
+                fs->sync();
+                std::cout << "Synced.\n";
+
+            } else if (command == "df") {
+
+                if (!fs) { std::cout << "Not mounted.\n"; continue; }
+
+                FsStat stat = fs->statfs();
+                uint64_t kb_per_block = stat.block_size / 1024;
+
+                std::cout << "          total       used       free\n";
+                std::cout << "KB     " << std::setw(8) << stat.total_blocks * kb_per_block
+                          << "   " << std::setw(8) << (stat.total_blocks - stat.free_blocks) * kb_per_block
+                          << "   " << std::setw(8) << stat.free_blocks * kb_per_block << "\n";
+                std::cout << "Inodes " << std::setw(8) << stat.total_inodes
+                          << "   " << std::setw(8) << stat.total_inodes - stat.free_inodes
+                          << "   " << std::setw(8) << stat.free_inodes << "\n";
+
+            } else if (command == "stats") {
+
+                if (!fs) { std::cout << "Not mounted.\n"; continue; }
+
+                std::string mode;
+                ss >> mode;
+
+                if (mode == "json") {
+                    std::cout << fs->getStats().toJson() << "\n";
+                } else if (mode == "reset") {
+                    fs->getStats().reset();
+                    std::cout << "Stats reset.\n";
+                } else if (mode.empty()) {
+                    std::cout << fs->getStats().toText();
+                } else {
+                    std::cout << "Usage: stats [json|reset]\n";
+                }
 
             } else if (command == "exit") {
 
@@ -160,8 +451,35 @@ void CLI::run() {
 
             } else if (command == "ls") {
                 if (!fs) { std::cout << "Not Mounted.\n"; continue; }
-                
-                fs->listFiles();
+
+                std::string path;
+                ss >> path;
+
+                fs->listFiles(path.empty() ? "/" : path);
+
+            } else if (command == "mkdir") {
+
+                if (!fs) { std::cout << "Not mounted.\n"; continue; }
+
+                std::string path;
+                ss >> path;
+
+                if (fs->createDirectory(path))
+                    std::cout << "Directory created.\n";
+                else
+                    std::cout << "Mkdir failed.\n";
+
+            } else if (command == "rmdir") {
+
+                if (!fs) { std::cout << "Not mounted.\n"; continue; }
+
+                std::string path;
+                ss >> path;
+
+                if (fs->deleteDirectory(path))
+                    std::cout << "Directory removed.\n";
+                else
+                    std::cout << "Rmdir failed.\n";
 
             } else {
 
@@ -1,6 +1,8 @@
 #ifndef CLI_H
 #define CLI_H
 
+#include <cstdint>
+#include <string>
 #include "../fs/fs.h"
 
 class CLI {
@@ -8,6 +10,11 @@ private:
     FileSystem* fs;
     std::string diskPath;
 
+    // Host files and directories into the filesystem (directories recursively),
+    // with compress the files are created compressed
+    bool importFile(const std::string& hostPath, const std::string& vfsPath, bool compress, uint64_t* bytes);
+    void importPath(const std::string& hostPath, const std::string& vfsPath, bool compress, uint64_t* files, uint64_t* bytes);
+
 public:
     CLI();
     ~CLI();
@@ -0,0 +1,228 @@
+#include <algorithm>    // For sort method
+#include <stdexcept>    // For Exception Handling
+#include "cache.h"
+
+BlockCache::BlockCache(uint32_t capacity_, uint16_t blockSize_) : capacity(capacity_), blockSize(blockSize_), dirtyCount(0) {
+
+    if (capacity < 4) {
+        throw std::invalid_argument(std::string("Block cache needs at least 4 frames: ") + std::to_string(capacity));
+    }
+
+    kin = std::max<uint32_t>(1, capacity / 4);
+    kout = std::max<uint32_t>(1, capacity / 2);
+
+    memory.resize(static_cast<size_t>(capacity) * blockSize);
+    frames.resize(capacity);
+    freeFrames.reserve(capacity);
+
+    for (uint32_t i = 0; i < capacity; ++i) {
+        frames[i].blockNum = 0;
+        frames[i].dirty = false;
+        frames[i].pins = 0;
+        frames[i].queue = NONE;
+        frames[i].data = memory.data() + static_cast<size_t>(i) * blockSize;
+        freeFrames.push_back(&frames[capacity - 1 - i]);
+    }
+
+}
+
+void BlockCache::unlink(Frame* frame) {
+
+    if (frame->queue == A1IN) {
+        a1in.erase(frame->pos);
+    } else if (frame->queue == AM) {
+        am.erase(frame->pos);
+    }
+
+    frame->queue = NONE;
+    table.erase(frame->blockNum);
+
+}
+
+BlockCache::Frame* BlockCache::unpinnedTail(std::list<Frame*>& queue, bool allowDirty) {
+
+    for (auto it = queue.rbegin(); it != queue.rend(); ++it) {
+        if ((*it)->pins == 0 && (allowDirty || !(*it)->dirty)) {
+            return *it;
+        }
+    }
+
+    return nullptr;
+}
+
+BlockCache::Frame* BlockCache::lookup(uint32_t blockNum) {
+
+    auto it = table.find(blockNum);
+    if (it == table.end()) {
+        return nullptr;
+    }
+
+    Frame* frame = it->second;
+
+    // Hits in A1in are not promoted, a block has to come back from A1out to be hot
+    if (frame->queue == AM) {
+        am.splice(am.begin(), am, frame->pos);
+    }
+
+    return frame;
+}
+
+BlockCache::Frame* BlockCache::reclaim(bool allowDirty) {
+
+    if (!freeFrames.empty()) {
+        Frame* frame = freeFrames.back();
+        freeFrames.pop_back();
+        return frame;
+    }
+
+    Frame* victim = nullptr;
+
+    if (a1in.size() > kin || am.empty()) {
+        victim = unpinnedTail(a1in, allowDirty);
+    }
+
+    if (victim == nullptr) {
+        victim = unpinnedTail(am, allowDirty);
+    }
+
+    if (victim == nullptr) {
+        victim = unpinnedTail(a1in, allowDirty);
+    }
+
+    if (victim == nullptr) {
+
+        // Nothing can be evicted, grow by one frame
+        overflow.emplace_back(new char[blockSize]);
+
+        frames.emplace_back();
+        Frame* frame = &frames.back();
+        frame->blockNum = 0;
+        frame->dirty = false;
+        frame->pins = 0;
+        frame->queue = NONE;
+        frame->data = overflow.back().get();
+
+        return frame;
+    }
+
+    if (victim->queue == A1IN) {
+
+        // Remember the block so a second reference promotes it to Am
+        a1out.push_front(victim->blockNum);
+        ghosts[victim->blockNum] = a1out.begin();
+
+        if (a1out.size() > kout) {
+            ghosts.erase(a1out.back());
+            a1out.pop_back();
+        }
+    }
+
+    unlink(victim);
+    return victim;
+}
+
+void BlockCache::install(Frame* frame, uint32_t blockNum) {
+
+    markClean(frame);
+    frame->blockNum = blockNum;
+
+    auto ghost = ghosts.find(blockNum);
+
+    if (ghost != ghosts.end()) {
+        a1out.erase(ghost->second);
+        ghosts.erase(ghost);
+
+        am.push_front(frame);
+        frame->pos = am.begin();
+        frame->queue = AM;
+    } else {
+        a1in.push_front(frame);
+        frame->pos = a1in.begin();
+        frame->queue = A1IN;
+    }
+
+    table[blockNum] = frame;
+
+}
+
+void BlockCache::invalidate(uint32_t blockNum) {
+
+    auto it = table.find(blockNum);
+    if (it == table.end()) {
+        return;
+    }
+
+    Frame* frame = it->second;
+
+    if (frame->pins != 0) {
+        throw std::runtime_error(std::string("Cannot invalidate pinned block: ") + std::to_string(blockNum));
+    }
+
+    unlink(frame);
+    markClean(frame);
+    freeFrames.push_back(frame);
+
+}
+
+void BlockCache::clear() {
+
+    for (size_t i = 0; i < frames.size(); ++i) {
+        if (frames[i].pins != 0) {
+            throw std::runtime_error(std::string("Cannot clear block cache while blocks are pinned"));
+        }
+    }
+
+    a1in.clear();
+    am.clear();
+    a1out.clear();
+    table.clear();
+    ghosts.clear();
+    freeFrames.clear();
+
+    // Frames added past capacity are given back
+    frames.resize(capacity);
+    overflow.clear();
+    dirtyCount = 0;
+
+    for (uint32_t i = 0; i < capacity; ++i) {
+        frames[i].queue = NONE;
+        frames[i].dirty = false;
+        freeFrames.push_back(&frames[capacity - 1 - i]);
+    }
+
+}
+
+void BlockCache::markDirty(Frame* frame) {
+
+    if (!frame->dirty) {
+        frame->dirty = true;
+        ++dirtyCount;
+    }
+
+}
+
+void BlockCache::markClean(Frame* frame) {
+
+    if (frame->dirty) {
+        frame->dirty = false;
+        --dirtyCount;
+    }
+
+}
+
+std::vector<BlockCache::Frame*> BlockCache::dirtyFrames() {
+
+    std::vector<Frame*> dirty;
+
+    for (auto& entry : table) {
+        if (entry.second->dirty) {
+            dirty.push_back(entry.second);
+        }
+    }
+
+    std::sort(dirty.begin(), dirty.end(), [](const Frame* a, const Frame* b) {
+        return a->blockNum < b->blockNum;
+    });
+
+    return dirty;
+}
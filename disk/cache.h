@@ -0,0 +1,100 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// Fixed size block cache with 2Q replacement.
+//
+// New blocks enter A1in (a FIFO holding ~25% of the frames). Blocks pushed out
+// of A1in are remembered by number only in A1out (ghost queue). A block which is
+// referenced again while in A1out is hot and goes to Am (an LRU). A long scan
+// therefore only cycles through A1in and never pushes bitmap or inode table
+// blocks out of Am.
+//
+// The cache only manages frames; DiskManager does the actual disk I/O and the
+// write back of dirty frames it gets from reclaim(). When dirty frames may not
+// be written back (they belong to an uncommitted journal transaction) and every
+// clean frame is pinned, the cache grows past its capacity instead.
+//
+// A BlockCache is not thread-safe; DiskManager shards blocks over several
+// caches and guards each with its own mutex.
+class BlockCache {
+public:
+    enum Queue { NONE, A1IN, AM };
+
+    struct Frame {
+        uint32_t blockNum;
+        bool dirty;
+        uint32_t pins;                                  // Frames referenced by a BlockView are never evicted
+        Queue queue;
+        std::list<Frame*>::iterator pos;
+        char* data;
+    };
+
+private:
+    uint32_t capacity;                                  // Number of frames
+    uint32_t kin;                                       // Max frames in A1in
+    uint32_t kout;                                      // Max ghost entries in A1out
+    uint16_t blockSize;
+    std::atomic<uint32_t> dirtyCount;                   // Read without the owner's lock by commitDue()
+
+    std::vector<char> memory;                           // Backing storage of the first capacity frames
+    std::vector<std::unique_ptr<char[]>> overflow;      // Backing storage of frames added past capacity
+    std::deque<Frame> frames;
+    std::vector<Frame*> freeFrames;
+
+    std::list<Frame*> a1in;                             // FIFO, front is newest
+    std::list<Frame*> am;                               // LRU, front is most recent
+    std::list<uint32_t> a1out;                          // Ghost FIFO, front is newest
+
+    std::unordered_map<uint32_t, Frame*> table;
+    std::unordered_map<uint32_t, std::list<uint32_t>::iterator> ghosts;
+
+    void unlink(Frame* frame);
+    Frame* unpinnedTail(std::list<Frame*>& queue, bool allowDirty);
+
+public:
+    BlockCache(uint32_t capacity_, uint16_t blockSize_);
+
+    // Returns the cached frame of blockNum (and records the hit) or nullptr.
+    Frame* lookup(uint32_t blockNum);
+
+    // Whether blockNum is cached, without counting as a reference
+    bool contains(uint32_t blockNum) const { return table.count(blockNum) != 0; }
+
+    // Whether blockNum is cached and differs from the disk
+    bool isDirty(uint32_t blockNum) const {
+        auto it = table.find(blockNum);
+        return it != table.end() && it->second->dirty;
+    }
+
+    // Returns a frame which is not in any queue. If no frame is free an unpinned
+    // victim is taken out of the cache; its old blockNum, data and dirty flag are
+    // left intact so the caller can write it back before reusing it. Without
+    // allowDirty only clean frames are taken.
+    Frame* reclaim(bool allowDirty = true);
+
+    // Puts a frame obtained from reclaim() into the cache as blockNum.
+    void install(Frame* frame, uint32_t blockNum);
+
+    // Drops a block from the cache (its contents are discarded).
+    void invalidate(uint32_t blockNum);
+
+    // Drops every block and ghost entry.
+    void clear();
+
+    void markDirty(Frame* frame);
+    void markClean(Frame* frame);
+    uint32_t getDirtyCount() const { return dirtyCount.load(std::memory_order_relaxed); }
+
+    // All frames which are currently dirty, sorted by block number.
+    std::vector<Frame*> dirtyFrames();
+};
+
+#endif
@@ -1,40 +1,122 @@
 #include <string>
-#include <fstream>      // For File I/O Stream
 #include <stdexcept>    // For Exception Handling
 #include <cstdint>      // For Data types like uint32_t, uint64_t
 #include <algorithm>    // For fill method
+#include <cstring>      // For strerror
+#include <cerrno>
+#include <climits>      // For IOV_MAX
+#include <fcntl.h>      // For open, fallocate
+#include <unistd.h>     // For pread, pwrite, close
+#include <sys/mman.h>   // For mmap, msync
+#include <sys/uio.h>    // For preadv, pwritev
+#include <sys/sendfile.h>   // For sendfile
 #include "disk.h"
 
-DiskManager::DiskManager(std::string diskImagePath_) : diskImagePath(diskImagePath_) {
+BlockView::BlockView(const char* ptr_, BlockCache::Frame* frame_, std::mutex* lock_) : ptr(ptr_), frame(frame_), lock(lock_) {}
 
-    // Open Disk Image as binary
-    disk.open(diskImagePath, std::ios::binary | std::ios::in | std::ios::out);
+BlockView::BlockView(BlockView&& other) noexcept : ptr(other.ptr), frame(other.frame), lock(other.lock) {
 
-    if(!disk.is_open()) {
+    other.ptr = nullptr;
+    other.frame = nullptr;
+    other.lock = nullptr;
+
+}
+
+BlockView& BlockView::operator=(BlockView&& other) noexcept {
+
+    if (this != &other) {
+        if (frame != nullptr) {
+            std::lock_guard<std::mutex> guard(*lock);
+            --frame->pins;
+        }
+
+        ptr = other.ptr;
+        frame = other.frame;
+        lock = other.lock;
+        other.ptr = nullptr;
+        other.frame = nullptr;
+        other.lock = nullptr;
+    }
+
+    return *this;
+}
+
+BlockView::~BlockView() {
+
+    if (frame != nullptr) {
+        std::lock_guard<std::mutex> guard(*lock);
+        --frame->pins;
+    }
+
+}
+
+DiskManager::DiskManager(std::string diskImagePath_, DiskBackend backend_, uint32_t cacheBytes)
+    : diskImagePath(diskImagePath_), backend(backend_), mapping(nullptr),
+      journalStart(0), journalCount(0), journalHead(0), journalSequence(0), opDepth(0), opsSinceCommit(0), lastCommit(0) {
+
+    for (uint32_t i = 0; i < CACHE_SHARDS; ++i) {
+        shards.emplace_back(new CacheShard(std::max<uint32_t>(4, cacheBytes / blockSize / CACHE_SHARDS), blockSize));
+    }
+
+    // Open Disk Image
+    fd = ::open(diskImagePath.c_str(), O_RDWR);
+
+    if(fd < 0) {
         throw std::runtime_error(std::string("Disk Not Found at ") + diskImagePath);
     }
 
     // Find Disk Size
-    disk.seekg(0, std::ios::end);
-    std::streamoff diskSize = disk.tellg();
+    off_t diskSize = ::lseek(fd, 0, SEEK_END);
 
     if (diskSize < 0) {
+        ::close(fd);
         throw std::runtime_error(std::string("Failed to determine disk size ") + diskImagePath);
     }
 
     if (diskSize == 0) {
+        ::close(fd);
         throw std::runtime_error(std::string("Disk is Empty: ") + diskImagePath);
     }
 
     if (diskSize % blockSize != 0) {
+        ::close(fd);
         throw std::runtime_error(std::string("Disk is incompatible with Block Size(") + std::to_string(blockSize) + std::string(" bytes) and Disk ") + diskImagePath);
     } 
 
-    numBlocks = static_cast<std::uint32_t>(diskSize) / blockSize;
+    // Block numbers are 32 bit, anything past the last addressable block is not used
+    numBlocks = static_cast<std::uint32_t>(std::min<uint64_t>(diskSize / blockSize, UINT32_MAX));
+
+    if (backend == DiskBackend::Mmap) {
+
+        void* addr = ::mmap(nullptr, static_cast<size_t>(numBlocks) * blockSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED) {
+            int err = errno;
+            ::close(fd);
+            throw std::runtime_error(std::string("Failed to mmap disk: ") + std::strerror(err));
+        }
+
+        mapping = static_cast<char*>(addr);
+    }
 
 }
 
-void DiskManager::readBlock(uint32_t blockNum, void* buffer) {
+DiskManager::~DiskManager() {
+
+    // Destructors must not throw, a failed final write back is lost
+    try {
+        sync();
+    } catch (const std::exception&) {
+    }
+
+    if (mapping != nullptr) {
+        ::munmap(mapping, static_cast<size_t>(numBlocks) * blockSize);
+    }
+
+    ::close(fd);
+
+}
+
+void DiskManager::checkBlock(uint32_t blockNum, const void* buffer) {
 
     if(buffer == nullptr) {
         throw std::invalid_argument(std::string("buffer is nullptr"));
@@ -44,63 +126,592 @@ void DiskManager::readBlock(uint32_t blockNum, void* buffer) {
         throw std::invalid_argument(std::string("blockNum is >= total number of block: ") + std::to_string(blockNum) + std::string(" > ") + std::to_string(numBlocks));
     }
 
-    char* bufferChar = static_cast<char*>(buffer);
+}
+
+void DiskManager::transfer(bool write, uint32_t firstBlock, struct iovec* iov, int count) {
+
+    uint64_t offset = static_cast<uint64_t>(firstBlock) * blockSize;
+
+    // preadv/pwritev may stop early, keep going until every iovec is done
+    while (count > 0) {
+
+        ssize_t done = write ? ::pwritev(fd, iov, count, offset) : ::preadv(fd, iov, count, offset);
+
+        if (done < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error(std::string(write ? "pwritev() was failed: " : "preadv() was failed: ") + std::strerror(errno));
+        }
+
+        if (done == 0) {
+            throw std::runtime_error(std::string("Only Partial block was transferred at offset ") + std::to_string(offset));
+        }
 
-    disk.clear();
-    disk.seekg(static_cast<std::uint64_t>(blockNum) * blockSize, std::ios::beg);
+        offset += done;
 
-    if(!disk.good()) {
-        throw std::runtime_error(std::string("disk.seekg() was failed."));
+        while (count > 0 && static_cast<size_t>(done) >= iov->iov_len) {
+            done -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+
+        if (count > 0) {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + done;
+            iov->iov_len -= done;
+        }
     }
 
-    disk.read(bufferChar, blockSize);
+}
+
+void DiskManager::readRaw(uint32_t blockNum, char* buffer) {
 
-    if(disk.gcount() < blockSize) {
-        throw std::runtime_error(std::string("Only Partial block was read: ") + std::to_string(disk.gcount()) + std::string(" bytes"));
+    stats.add(Stats::BLOCK_READS);
+
+    if (backend == DiskBackend::Mmap) {
+        std::memcpy(buffer, mapping + static_cast<uint64_t>(blockNum) * blockSize, blockSize);
+        stats.add(Stats::BYTES_COPIED, blockSize);
+        return;
     }
 
+    struct iovec iov = { buffer, blockSize };
+    transfer(false, blockNum, &iov, 1);
+
 }
 
-void DiskManager::writeBlock(uint32_t blockNum, void* buffer) {
+void DiskManager::writeRaw(uint32_t blockNum, const char* buffer) {
 
-    if (buffer == nullptr) {
-        throw std::invalid_argument(std::string("buffer is nullptr"));
+    stats.add(Stats::BLOCK_WRITES);
+
+    if (backend == DiskBackend::Mmap) {
+        std::memcpy(mapping + static_cast<uint64_t>(blockNum) * blockSize, buffer, blockSize);
+        stats.add(Stats::BYTES_COPIED, blockSize);
+        return;
+    }
+
+    struct iovec iov = { const_cast<char*>(buffer), blockSize };
+    transfer(true, blockNum, &iov, 1);
+
+}
+
+BlockCache::Frame* DiskManager::getFrame(CacheShard& shard, uint32_t blockNum, bool load) {
+
+    BlockCache::Frame* frame = shard.cache.lookup(blockNum);
+    if (frame != nullptr) {
+        stats.add(Stats::CACHE_HITS);
+        return frame;
     }
 
+    stats.add(Stats::CACHE_MISSES);
+
+    // Uncommitted blocks must not reach the disk before the journal has them
+    frame = shard.cache.reclaim(!journalEnabled());
+
+    // Victim still holds its old block, write it back before reusing the frame
+    if (frame->dirty) {
+        writeRaw(frame->blockNum, frame->data);
+        shard.cache.markClean(frame);
+    }
+
+    if (load) {
+        try {
+            readRaw(blockNum, frame->data);
+        } catch (...) {
+            shard.cache.install(frame, blockNum);
+            shard.cache.invalidate(blockNum);
+            throw;
+        }
+    }
+
+    shard.cache.install(frame, blockNum);
+    return frame;
+}
+
+void DiskManager::readBlock(uint32_t blockNum, void* buffer) {
+
+    checkBlock(blockNum, buffer);
+
+    CacheShard& shard = shardOf(blockNum);
+    std::lock_guard<std::mutex> guard(shard.lock);
+
+    // The mapping already is the cache for clean blocks, only dirty ones live in frames
+    if (backend == DiskBackend::Mmap) {
+        BlockCache::Frame* frame = shard.cache.lookup(blockNum);
+        if (frame != nullptr) {
+            std::memcpy(buffer, frame->data, blockSize);
+            stats.add(Stats::BYTES_COPIED, blockSize);
+        } else {
+            readRaw(blockNum, static_cast<char*>(buffer));
+        }
+        return;
+    }
+
+    BlockCache::Frame* frame = getFrame(shard, blockNum, true);
+    std::copy(frame->data, frame->data + blockSize, static_cast<char*>(buffer));
+    stats.add(Stats::BYTES_COPIED, blockSize);
+
+}
+
+BlockView DiskManager::viewBlock(uint32_t blockNum) {
+
     if (blockNum >= numBlocks) {
         throw std::invalid_argument(std::string("blockNum is >= total number of block: ") + std::to_string(blockNum) + std::string(" > ") + std::to_string(numBlocks));
     }
 
-    char* bufferChar = static_cast<char*>(buffer);
+    CacheShard& shard = shardOf(blockNum);
+    std::lock_guard<std::mutex> guard(shard.lock);
 
-    disk.clear();
-    disk.seekp(static_cast<uint64_t>(blockNum) * blockSize, std::ios::beg);
+    BlockCache::Frame* frame;
 
-    if(!disk.good()) {
-        throw std::runtime_error(std::string("disk.seekp() was failed."));
+    if (backend == DiskBackend::Mmap) {
+        frame = shard.cache.lookup(blockNum);
+        if (frame == nullptr) {
+            return BlockView(mapping + static_cast<uint64_t>(blockNum) * blockSize, nullptr, nullptr);
+        }
+    } else {
+        frame = getFrame(shard, blockNum, true);
     }
 
-    disk.write(bufferChar, blockSize);
+    // Pinned before the shard lock is released, so the frame cannot be taken away in between
+    ++frame->pins;
+    return BlockView(frame->data, frame, &shard.lock);
+}
+
+void DiskManager::writeBlock(uint32_t blockNum, void* buffer) {
+
+    checkBlock(blockNum, buffer);
+
+    CacheShard& shard = shardOf(blockNum);
+    std::lock_guard<std::mutex> guard(shard.lock);
+
+    // Whole block is overwritten, so there is no need to read it first
+    BlockCache::Frame* frame = getFrame(shard, blockNum, false);
+
+    const char* bufferChar = static_cast<const char*>(buffer);
+    std::copy(bufferChar, bufferChar + blockSize, frame->data);
+    shard.cache.markDirty(frame);
+    stats.add(Stats::BYTES_COPIED, blockSize);
 
-    if(!disk.good()) {
-        throw std::runtime_error(std::string("disk.write() was failed."));
+}
+
+void DiskManager::readBlocks(const std::vector<BlockRead>& requests) {
+
+    std::vector<BlockRead> misses;
+
+    for (const BlockRead& request : requests) {
+
+        checkBlock(request.blockNum, request.buffer);
+
+        CacheShard& shard = shardOf(request.blockNum);
+        std::lock_guard<std::mutex> guard(shard.lock);
+
+        BlockCache::Frame* frame = shard.cache.lookup(request.blockNum);
+
+        if (frame != nullptr) {
+            std::memcpy(request.buffer, frame->data, blockSize);
+            stats.add(Stats::CACHE_HITS);
+            stats.add(Stats::BYTES_COPIED, blockSize);
+        } else if (backend == DiskBackend::Mmap) {
+            readRaw(request.blockNum, static_cast<char*>(request.buffer));
+        } else {
+            stats.add(Stats::CACHE_MISSES);
+            misses.push_back(request);
+        }
     }
 
-    disk.flush();
+    std::sort(misses.begin(), misses.end(), [](const BlockRead& a, const BlockRead& b) {
+        return a.blockNum < b.blockNum;
+    });
+
+    std::vector<struct iovec> iov;
+
+    for (size_t i = 0; i < misses.size();) {
+
+        // Collect a run of physically adjacent blocks, a block asked for twice starts a new run
+        size_t j = i;
+        iov.clear();
+
+        while (j < misses.size() && misses[j].blockNum == misses[i].blockNum + (j - i) && iov.size() < IOV_MAX) {
+            iov.push_back({ misses[j].buffer, blockSize });
+            ++j;
+        }
+
+        transfer(false, misses[i].blockNum, iov.data(), static_cast<int>(iov.size()));
+        stats.add(Stats::BLOCK_READS, iov.size());
+        i = j;
+    }
 
 }
 
-void DiskManager::formatDisk() {
+void DiskManager::prefetchBlocks(const std::vector<uint32_t>& blocks, bool wait) {
+
+    std::vector<uint32_t> missing;
 
-    char* bufferChar = new char[blockSize];
+    for (uint32_t blockNum : blocks) {
 
-    std::fill(bufferChar, bufferChar + blockSize, 0);
-    void* buffer = static_cast<void*>(bufferChar);
+        if (blockNum >= numBlocks) {
+            throw std::invalid_argument(std::string("blockNum is >= total number of block: ") + std::to_string(blockNum) + std::string(" > ") + std::to_string(numBlocks));
+        }
 
-    for(uint32_t i = 0; i < numBlocks; ++i) {
-        writeBlock(i, buffer);
+        CacheShard& shard = shardOf(blockNum);
+        std::lock_guard<std::mutex> guard(shard.lock);
+
+        if (!shard.cache.contains(blockNum)) {
+            missing.push_back(blockNum);
+        }
     }
 
-    delete[] bufferChar;
+    std::sort(missing.begin(), missing.end());
+    missing.erase(std::unique(missing.begin(), missing.end()), missing.end());
+
+    std::vector<char> run_data;
+    std::vector<struct iovec> iov;
+
+    for (size_t i = 0; i < missing.size();) {
+
+        size_t j = i;
+        while (j < missing.size() && missing[j] == missing[i] + (j - i) && j - i < IOV_MAX) {
+            ++j;
+        }
+
+        uint64_t offset = static_cast<uint64_t>(missing[i]) * blockSize;
+        uint64_t length = static_cast<uint64_t>(j - i) * blockSize;
+
+        // Step 1: Hints only, the kernel reads in the background
+        if (!wait || backend == DiskBackend::Mmap) {
+
+            if (backend == DiskBackend::Mmap) {
+                ::madvise(mapping + offset, length, MADV_WILLNEED);
+            } else {
+                ::posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED);
+            }
+
+            i = j;
+            continue;
+        }
+
+        // Step 2: One read for the run, then each block goes into a frame unless
+        // something put it there meanwhile
+        run_data.resize(length);
+        iov.clear();
+
+        for (size_t k = i; k < j; ++k) {
+            iov.push_back({ run_data.data() + (k - i) * blockSize, blockSize });
+        }
+
+        transfer(false, missing[i], iov.data(), static_cast<int>(iov.size()));
+        stats.add(Stats::BLOCK_READS, j - i);
+        stats.add(Stats::READAHEAD_BLOCKS, j - i);
+
+        for (size_t k = i; k < j; ++k) {
+
+            CacheShard& shard = shardOf(missing[k]);
+            std::lock_guard<std::mutex> guard(shard.lock);
+
+            if (shard.cache.contains(missing[k])) {
+                continue;
+            }
+
+            BlockCache::Frame* frame = getFrame(shard, missing[k], false);
+            std::memcpy(frame->data, run_data.data() + (k - i) * blockSize, blockSize);
+            stats.add(Stats::BYTES_COPIED, blockSize);
+        }
+
+        i = j;
+    }
+
+}
+
+void DiskManager::writeBlocks(const std::vector<BlockWrite>& requests) {
+
+    std::vector<BlockWrite> sorted;
+    sorted.reserve(requests.size());
+
+    // Cached frames are pinned until the write is done, a reader which misses
+    // the cache in the meantime would see the old disk contents
+    std::vector<std::pair<CacheShard*, BlockCache::Frame*>> pinned;
+
+    for (const BlockWrite& request : requests) {
+
+        checkBlock(request.blockNum, request.buffer);
+
+        CacheShard& shard = shardOf(request.blockNum);
+        std::lock_guard<std::mutex> guard(shard.lock);
+
+        // Keep a cached copy in step with the disk, it is clean once the write is done
+        BlockCache::Frame* frame = shard.cache.lookup(request.blockNum);
+
+        if (frame != nullptr) {
+            if (frame->data != request.buffer) {
+                std::memcpy(frame->data, request.buffer, blockSize);
+                stats.add(Stats::BYTES_COPIED, blockSize);
+            }
+            shard.cache.markClean(frame);
+            ++frame->pins;
+            pinned.push_back({ &shard, frame });
+        }
+
+        sorted.push_back(request);
+    }
+
+    std::sort(sorted.begin(), sorted.end(), [](const BlockWrite& a, const BlockWrite& b) {
+        return a.blockNum < b.blockNum;
+    });
+
+    std::vector<struct iovec> iov;
+
+    try {
+
+        for (size_t i = 0; i < sorted.size();) {
+
+            if (backend == DiskBackend::Mmap) {
+                writeRaw(sorted[i].blockNum, static_cast<const char*>(sorted[i].buffer));
+                ++i;
+                continue;
+            }
+
+            size_t j = i;
+            iov.clear();
+
+            while (j < sorted.size() && sorted[j].blockNum == sorted[i].blockNum + (j - i) && iov.size() < IOV_MAX) {
+                iov.push_back({ const_cast<void*>(sorted[j].buffer), blockSize });
+                ++j;
+            }
+
+            transfer(true, sorted[i].blockNum, iov.data(), static_cast<int>(iov.size()));
+            stats.add(Stats::BLOCK_WRITES, iov.size());
+            i = j;
+        }
+
+    } catch (...) {
+        for (auto& entry : pinned) {
+            std::lock_guard<std::mutex> guard(entry.first->lock);
+            --entry.second->pins;
+        }
+        throw;
+    }
+
+    for (auto& entry : pinned) {
+        std::lock_guard<std::mutex> guard(entry.first->lock);
+        --entry.second->pins;
+    }
+
+}
+
+std::vector<BlockCache::Frame*> DiskManager::dirtyFrames() {
+
+    std::vector<BlockCache::Frame*> dirty;
+
+    for (auto& shard : shards) {
+        std::lock_guard<std::mutex> guard(shard->lock);
+        std::vector<BlockCache::Frame*> frames = shard->cache.dirtyFrames();
+        dirty.insert(dirty.end(), frames.begin(), frames.end());
+    }
+
+    std::sort(dirty.begin(), dirty.end(), [](const BlockCache::Frame* a, const BlockCache::Frame* b) {
+        return a->blockNum < b->blockNum;
+    });
+
+    return dirty;
+}
+
+uint32_t DiskManager::dirtyCount() const {
+
+    uint32_t count = 0;
+
+    for (const auto& shard : shards) {
+        count += shard->cache.getDirtyCount();
+    }
+
+    return count;
+}
+
+void DiskManager::clearCache() {
+
+    for (auto& shard : shards) {
+        std::lock_guard<std::mutex> guard(shard->lock);
+        shard->cache.clear();
+    }
+
+}
+
+void DiskManager::sync() {
+
+    if (journalEnabled()) {
+        commit();
+        flushImage();
+        return;
+    }
+
+    std::vector<BlockCache::Frame*> dirty = dirtyFrames();
+
+    // Dirty frames come sorted by block number, so runs of adjacent blocks go out as one pwritev
+    std::vector<BlockWrite> requests;
+    requests.reserve(dirty.size());
+
+    for (BlockCache::Frame* frame : dirty) {
+        requests.push_back({ frame->blockNum, frame->data });
+    }
+
+    writeBlocks(requests);
+    flushImage();
+
+}
+
+void DiskManager::flushImage() {
+
+    stats.add(Stats::FLUSHES);
+
+    if (backend == DiskBackend::Mmap) {
+        if (::msync(mapping, static_cast<size_t>(numBlocks) * blockSize, MS_SYNC) != 0) {
+            throw std::runtime_error(std::string("msync() was failed: ") + std::strerror(errno));
+        }
+        return;
+    }
+
+    if (::fdatasync(fd) != 0) {
+        throw std::runtime_error(std::string("fdatasync() was failed: ") + std::strerror(errno));
+    }
+
+}
+
+bool DiskManager::cachedDirty(uint32_t blockNum) {
+
+    CacheShard& shard = shardOf(blockNum);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    return shard.cache.isDirty(blockNum);
+
+}
+
+void DiskManager::sendRange(int outFd, uint64_t offset, uint64_t length) {
+
+    // Step 1: copy_file_range keeps the data in the kernel (and may share
+    // extents when outFd is on the same filesystem). It refuses pipes, sockets,
+    // appending descriptors and other filesystems on older kernels, sendfile
+    // takes those.
+    bool useCopyRange = true;
+
+    while (length > 0) {
+
+        loff_t inOffset = offset;
+        ssize_t done;
+
+        if (useCopyRange) {
+            done = ::copy_file_range(fd, &inOffset, outFd, nullptr, length, 0);
+            if (done < 0 && (errno == EXDEV || errno == EINVAL || errno == EBADF || errno == ENOSYS || errno == EOPNOTSUPP)) {
+                useCopyRange = false;
+                continue;
+            }
+        } else {
+            off_t sendOffset = offset;
+            done = ::sendfile(outFd, fd, &sendOffset, std::min<uint64_t>(length, 0x7ffff000));
+            if (done < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                break;
+            }
+        }
+
+        if (done < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error(std::string(useCopyRange ? "copy_file_range() was failed: " : "sendfile() was failed: ") + std::strerror(errno));
+        }
+
+        if (done == 0) {
+            throw std::runtime_error(std::string("Image ended early at offset ") + std::to_string(offset));
+        }
+
+        offset += done;
+        length -= done;
+    }
+
+    // Step 2: Neither works for outFd, copy through a buffer
+    char buffer[4096];
+
+    while (length > 0) {
+
+        ssize_t got = ::pread(fd, buffer, std::min<uint64_t>(length, sizeof(buffer)), offset);
+
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error(std::string("pread() was failed: ") + std::strerror(errno));
+        }
+
+        if (got == 0) {
+            throw std::runtime_error(std::string("Image ended early at offset ") + std::to_string(offset));
+        }
+
+        for (ssize_t written = 0; written < got;) {
+            ssize_t done = ::write(outFd, buffer + written, got - written);
+            if (done < 0) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error(std::string("write() was failed: ") + std::strerror(errno));
+            }
+            written += done;
+        }
+
+        stats.add(Stats::BYTES_COPIED, got);
+        offset += got;
+        length -= got;
+    }
+
+}
+
+void DiskManager::sendBlocks(int outFd, uint32_t firstBlock, uint32_t skip, uint64_t length) {
+
+    uint64_t offset = static_cast<uint64_t>(firstBlock) * blockSize + skip;
+    uint64_t end = offset + length;
+
+    if (end > static_cast<uint64_t>(numBlocks) * blockSize) {
+        throw std::invalid_argument(std::string("Range ends past the last block: ") + std::to_string(end));
+    }
+
+    while (offset < end) {
+
+        // Step 1: Everything up to the next dirty cached block is current in the image
+        uint64_t runEnd = offset;
+
+        while (runEnd < end && !cachedDirty(runEnd / blockSize)) {
+            runEnd = std::min<uint64_t>(end, (runEnd / blockSize + 1) * blockSize);
+        }
+
+        if (runEnd > offset) {
+            sendRange(outFd, offset, runEnd - offset);
+            stats.add(Stats::BYTES_EXPORTED, runEnd - offset);
+            offset = runEnd;
+            continue;
+        }
+
+        // Step 2: A dirty block goes out of the cache
+        char buffer[4096];
+        uint64_t blockEnd = std::min<uint64_t>(end, (offset / blockSize + 1) * blockSize);
+        uint32_t from = offset % blockSize;
+
+        readBlock(offset / blockSize, buffer);
+
+        for (uint64_t written = 0; written < blockEnd - offset;) {
+            ssize_t done = ::write(outFd, buffer + from + written, blockEnd - offset - written);
+            if (done < 0) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error(std::string("write() was failed: ") + std::strerror(errno));
+            }
+            written += done;
+        }
+
+        stats.add(Stats::BYTES_COPIED, blockEnd - offset);
+        stats.add(Stats::BYTES_EXPORTED, blockEnd - offset);
+        offset = blockEnd;
+    }
+
+}
+
+void DiskManager::formatDisk() {
+
+    // Cached blocks are stale after a format, drop them without writing back
+    clearCache();
+
+    // Punching out the whole image zeroes it in one call and leaves it sparse.
+    // Where the host file system cannot punch holes the old contents stay;
+    // mkfs writes everything it needs and does not rely on zeroed blocks.
+    if (::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(numBlocks) * blockSize) != 0
+        && errno != EOPNOTSUPP) {
+        throw std::runtime_error(std::string("fallocate() was failed: ") + std::strerror(errno));
+    }
 
 }
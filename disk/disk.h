@@ -1,20 +1,158 @@
+#ifndef DISK_H
+#define DISK_H
+
 #include <string>
+#include <atomic>
 #include <cstdint>
-#include <fstream>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "cache.h"
+#include "stats.h"
+
+// How DiskManager reaches the image file
+enum class DiskBackend {
+    Pread,                                              // pread/pwrite system calls, blocks are cached in BlockCache
+    Mmap                                                // Whole image is mmap'ed, reads come straight from the mapping
+};
+
+// One block of a vectored read
+struct BlockRead {
+    uint32_t blockNum;
+    void* buffer;
+};
+
+// One block of a vectored write
+struct BlockWrite {
+    uint32_t blockNum;
+    const void* buffer;
+};
+
+// Read only view of one block. The block cannot be evicted while a view of it
+// is alive, so the pointer stays valid until the view is destroyed.
+class BlockView {
+private:
+    const char* ptr;
+    BlockCache::Frame* frame;                           // Pinned cache frame or nullptr for mmap views
+    std::mutex* lock;                                   // Lock of the cache shard holding frame
+
+public:
+    BlockView() : ptr(nullptr), frame(nullptr), lock(nullptr) {}
+    BlockView(const char* ptr_, BlockCache::Frame* frame_, std::mutex* lock_);   // Takes over a pin of frame
+    BlockView(BlockView&& other) noexcept;
+    BlockView& operator=(BlockView&& other) noexcept;
+    BlockView(const BlockView&) = delete;
+    BlockView& operator=(const BlockView&) = delete;
+    ~BlockView();
+
+    const char* data() const { return ptr; }
+};
 
 class DiskManager {
 private:
     const uint16_t blockSize = 4096;                    // Block Size in bytes
-    uint32_t numBlocks;                                 // Number of Blocks in the Disk Image
+    uint32_t numBlocks;                                 // Number of Blocks in the Disk Image, at most UINT32_MAX
 
     std::string diskImagePath;                          // Store Disk Image Path
-    std::fstream disk;                                  // Store disk fstream
- 
+    int fd;                                             // Store disk file descriptor
+
+    DiskBackend backend;
+    char* mapping;                                      // Whole image mapping (Mmap backend)
+
+    Stats stats;                                        // Shared with the FileSystem on top of this disk
+
+    // Write back cache in front of the disk. Blocks are spread over shards by
+    // block number so threads working on different blocks do not share a lock.
+    struct CacheShard {
+        std::mutex lock;
+        BlockCache cache;
+
+        CacheShard(uint32_t capacity, uint16_t blockSize) : cache(capacity, blockSize) {}
+    };
+
+    static const uint32_t CACHE_SHARDS = 16;
+    std::vector<std::unique_ptr<CacheShard>> shards;
+
+    CacheShard& shardOf(uint32_t blockNum) { return *shards[blockNum % CACHE_SHARDS]; }
+    std::vector<BlockCache::Frame*> dirtyFrames();      // Of every shard, sorted by block number
+    uint32_t dirtyCount() const;
+    void clearCache();
+
+    // Write-ahead journal (disk/journal.cpp). While it is enabled dirty blocks
+    // stay in the cache until commit() has logged them.
+    uint32_t journalStart;
+    uint32_t journalCount;                              // 0 while the journal is disabled
+    uint32_t journalHead;                               // Next free journal block, relative to journalStart
+    uint64_t journalSequence;                           // Sequence number of the next transaction
+    std::atomic<uint32_t> opDepth;
+    std::atomic<uint32_t> opsSinceCommit;
+    std::atomic<std::time_t> lastCommit;
+
+    void flushImage();
+    void writeJournalSuper(uint32_t first);
+    void replayJournal();
+
+    void checkBlock(uint32_t blockNum, const void* buffer);
+    void readRaw(uint32_t blockNum, char* buffer);
+    void writeRaw(uint32_t blockNum, const char* buffer);
+    void transfer(bool write, uint32_t firstBlock, struct iovec* iov, int count);
+    void sendRange(int outFd, uint64_t offset, uint64_t length);
+    bool cachedDirty(uint32_t blockNum);
+    BlockCache::Frame* getFrame(CacheShard& shard, uint32_t blockNum, bool load);   // Called with shard.lock held
+
 public:
+    static const uint32_t DEFAULT_CACHE_BYTES = 8 * 1024 * 1024;
+
     void readBlock(uint32_t blockNum, void* buffer);
     void writeBlock(uint32_t blockNum, void* buffer);
-    void formatDisk();
-    
-    explicit DiskManager(std::string diskImagePath_);
+    BlockView viewBlock(uint32_t blockNum);             // Zero copy read access to a block
+
+    // All block I/O uses pread/pwrite (or the mapping) at explicit offsets, so
+    // any number of threads may call these at the same time.
+    //
+    // Vectored I/O: physically adjacent blocks are merged into single preadv/pwritev
+    // calls. Cached (possibly dirty) copies are honoured, missing blocks are not
+    // brought into the cache.
+    void readBlocks(const std::vector<BlockRead>& requests);
+    void writeBlocks(const std::vector<BlockWrite>& requests);
+    // Readahead. With wait the blocks which are not cached are read into the
+    // cache now, in runs of adjacent blocks; without it the kernel is only told
+    // to start reading them (so is the mmap backend, whose mapping is its cache).
+    // The caller must keep the blocks from being written meanwhile.
+    void prefetchBlocks(const std::vector<uint32_t>& blocks, bool wait);
+    // Copies length bytes of the image, starting skip bytes into firstBlock,
+    // to the host descriptor outFd at its current position. The kernel moves
+    // the data (copy_file_range, else sendfile); blocks whose cached copy is
+    // dirty are written from the cache instead.
+    void sendBlocks(int outFd, uint32_t firstBlock, uint32_t skip, uint64_t length);
+    void formatDisk();                                  // Zeroes the image by punching it out (no block writes)
+    void sync();                                        // Write back every dirty block and flush the image
+
+    // Metadata journal. Blocks written between beginOp() and endOp() reach
+    // their home location only after a commit() has logged them, so a crash
+    // leaves either all or none of a transaction on disk. Many operations are
+    // grouped into one transaction and share its flush. commit() must not run
+    // concurrently with an operation; FileSystem guarantees that with a lock.
+    static const uint32_t COMMIT_OPS = 256;             // Operations per transaction at most
+    static const uint32_t COMMIT_SECONDS = 1;           // Age of a transaction before it is committed
+
+    void formatJournal(uint32_t start, uint32_t count);
+    void enableJournal(uint32_t start, uint32_t count); // Replays committed transactions first
+    bool journalEnabled() const { return journalCount != 0; }
+    void beginOp();
+    void endOp();
+    bool commitDue() const;
+    void commit();
+    void checkpoint();                                  // Home locations are durable, drop the logged transactions
+
+    DiskBackend getBackend() const { return backend; }
+    uint32_t getNumBlocks() const { return numBlocks; }
+    Stats& getStats() { return stats; }
+
+    explicit DiskManager(std::string diskImagePath_, DiskBackend backend_ = DiskBackend::Pread, uint32_t cacheBytes = DEFAULT_CACHE_BYTES);
+    ~DiskManager();
 
 };
+
+#endif
@@ -0,0 +1,333 @@
+#include <string>
+#include <algorithm>    // For min method
+#include <stdexcept>    // For Exception Handling
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <random>
+#include "disk.h"
+
+// Journal layout, block numbers relative to the start of the journal region:
+//
+//   0      -> JournalSuper: where replay starts and the sequence it expects
+//   1..    -> Transactions, one after another. A transaction is one or more
+//             (descriptor, logged blocks...) groups followed by a commit block.
+//
+// A transaction counts only if its commit block carries the same sequence
+// number and a checksum over all its descriptor and logged blocks, so a
+// transaction torn by a crash is ignored. Replay stops at the first block
+// which does not continue the sequence.
+
+#define JOURNAL_SUPER_MAGIC 0x4A535550
+#define JOURNAL_DESCRIPTOR_MAGIC 0x4A444553
+#define JOURNAL_COMMIT_MAGIC 0x4A434F4D
+#define JOURNAL_DESCRIPTOR_SLOTS 1020
+
+struct JournalSuper {
+    uint32_t magic;
+    uint32_t first;                                     // First block to replay
+    uint64_t sequence;                                  // Sequence of the transaction at first
+    uint32_t pad[1020];
+};
+
+struct JournalDescriptor {
+    uint32_t magic;
+    uint32_t count;                                     // Logged blocks following this descriptor
+    uint64_t sequence;
+    uint32_t blocks[JOURNAL_DESCRIPTOR_SLOTS];          // Home location of each logged block
+};
+
+struct JournalCommit {
+    uint32_t magic;
+    uint32_t count;                                     // Logged blocks in the whole transaction
+    uint64_t sequence;
+    uint64_t checksum;
+    uint32_t pad[1018];
+};
+
+// FNV-1a over a block, continued from hash
+static uint64_t checksumBlock(uint64_t hash, const char* data, uint32_t length) {
+
+    for (uint32_t i = 0; i < length; ++i) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+void DiskManager::writeJournalSuper(uint32_t first) {
+
+    JournalSuper super;
+    std::memset(&super, 0, sizeof(super));
+    super.magic = JOURNAL_SUPER_MAGIC;
+    super.sequence = journalSequence;
+    super.first = first;
+
+    writeRaw(journalStart, reinterpret_cast<const char*>(&super));
+
+}
+
+void DiskManager::formatJournal(uint32_t start, uint32_t count) {
+
+    if (count < 3 || start + count > numBlocks) {
+        throw std::invalid_argument(std::string("Invalid journal region: ") + std::to_string(start) + "+" + std::to_string(count));
+    }
+
+    // A new journal starts at a random sequence, so transactions which an
+    // earlier filesystem left in the region can never continue it
+    std::random_device random;
+
+    journalStart = start;
+    journalSequence = (static_cast<uint64_t>(random()) << 32) | random();
+    writeJournalSuper(1);
+
+    journalStart = 0;
+    journalSequence = 0;
+
+}
+
+void DiskManager::enableJournal(uint32_t start, uint32_t count) {
+
+    if (count < 3 || start + count > numBlocks) {
+        throw std::invalid_argument(std::string("Invalid journal region: ") + std::to_string(start) + "+" + std::to_string(count));
+    }
+
+    // Blocks written so far were never logged, they have to be on disk before replay
+    sync();
+
+    journalStart = start;
+    journalCount = count;
+
+    replayJournal();
+
+    opDepth = 0;
+    opsSinceCommit = 0;
+    lastCommit = std::time(nullptr);
+
+}
+
+void DiskManager::replayJournal() {
+
+    JournalSuper super;
+    readRaw(journalStart, reinterpret_cast<char*>(&super));
+
+    if (super.magic != JOURNAL_SUPER_MAGIC || super.first == 0 || super.first > journalCount) {
+        journalCount = 0;
+        throw std::runtime_error(std::string("No valid journal found at block ") + std::to_string(journalStart));
+    }
+
+    uint32_t position = super.first;
+    uint64_t sequence = super.sequence;
+    uint32_t replayed = 0;
+
+    std::vector<char> logged;
+    std::vector<uint32_t> homes;
+    char buffer[4096];
+
+    // Step 1: Walk the transactions in sequence order and apply the complete ones
+    while (true) {
+
+        uint64_t checksum = 14695981039346656037ULL;
+        uint32_t cursor = position;
+        bool complete = false;
+
+        logged.clear();
+        homes.clear();
+
+        while (cursor < journalCount) {
+
+            readRaw(journalStart + cursor, buffer);
+            ++cursor;
+
+            const JournalDescriptor* descriptor = reinterpret_cast<const JournalDescriptor*>(buffer);
+            const JournalCommit* commitBlock = reinterpret_cast<const JournalCommit*>(buffer);
+
+            if (descriptor->magic == JOURNAL_DESCRIPTOR_MAGIC && descriptor->sequence == sequence) {
+
+                if (descriptor->count > JOURNAL_DESCRIPTOR_SLOTS || cursor + descriptor->count > journalCount) {
+                    break;
+                }
+
+                checksum = checksumBlock(checksum, buffer, blockSize);
+                homes.insert(homes.end(), descriptor->blocks, descriptor->blocks + descriptor->count);
+
+                for (uint32_t i = 0; i < descriptor->count; ++i) {
+                    logged.resize(logged.size() + blockSize);
+                    char* copy = logged.data() + logged.size() - blockSize;
+                    readRaw(journalStart + cursor, copy);
+                    checksum = checksumBlock(checksum, copy, blockSize);
+                    ++cursor;
+                }
+                continue;
+            }
+
+            if (commitBlock->magic == JOURNAL_COMMIT_MAGIC && commitBlock->sequence == sequence) {
+                complete = commitBlock->count == homes.size() && commitBlock->checksum == checksum;
+            }
+            break;
+        }
+
+        if (!complete) {
+            break;
+        }
+
+        for (size_t i = 0; i < homes.size(); ++i) {
+            if (homes[i] >= numBlocks) {
+                throw std::runtime_error(std::string("Journal names a block outside the disk: ") + std::to_string(homes[i]));
+            }
+            writeRaw(homes[i], logged.data() + i * blockSize);
+        }
+
+        position = cursor;
+        ++sequence;
+        ++replayed;
+    }
+
+    // Step 2: Once the replayed blocks are durable the journal starts over empty
+    journalSequence = sequence;
+    journalHead = 1;
+
+    if (replayed > 0) {
+        clearCache();
+    }
+
+    flushImage();
+    writeJournalSuper(journalHead);
+    flushImage();
+
+}
+
+void DiskManager::beginOp() {
+
+    ++opDepth;
+
+}
+
+void DiskManager::endOp() {
+
+    --opDepth;
+    ++opsSinceCommit;
+
+}
+
+bool DiskManager::commitDue() const {
+
+    if (!journalEnabled()) {
+        return false;
+    }
+
+    // A quarter of the journal leaves room for the operation about to start
+    return opsSinceCommit >= COMMIT_OPS
+        || dirtyCount() >= journalCount / 4
+        || std::time(nullptr) - lastCommit >= static_cast<std::time_t>(COMMIT_SECONDS);
+
+}
+
+void DiskManager::commit() {
+
+    if (!journalEnabled()) {
+        return;
+    }
+
+    if (opDepth != 0) {
+        throw std::runtime_error(std::string("Cannot commit the journal inside an operation"));
+    }
+
+    std::vector<BlockCache::Frame*> dirty = dirtyFrames();
+
+    opsSinceCommit = 0;
+    lastCommit = std::time(nullptr);
+
+    if (dirty.empty()) {
+        return;
+    }
+
+    Stats::Timer timer(stats, Stats::JOURNAL_COMMIT_NS);
+    stats.add(Stats::JOURNAL_COMMITS);
+
+    uint32_t descriptors = (dirty.size() + JOURNAL_DESCRIPTOR_SLOTS - 1) / JOURNAL_DESCRIPTOR_SLOTS;
+    uint32_t needed = descriptors + dirty.size() + 1;
+
+    if (needed > journalCount - 1) {
+        throw std::runtime_error(std::string("Transaction of ") + std::to_string(dirty.size()) + " blocks does not fit in the journal");
+    }
+
+    // Step 1: Start over at the front when the transaction does not fit behind the head
+    if (journalHead + needed > journalCount) {
+        journalHead = 1;
+        checkpoint();
+    }
+
+    // Step 2: Log descriptors, block copies and the commit block in one vectored write.
+    // The checksum makes a torn transaction detectable, so a single flush is enough.
+    std::vector<JournalDescriptor> descriptorBlocks(descriptors);
+    JournalCommit commitBlock;
+    std::memset(&commitBlock, 0, sizeof(commitBlock));
+
+    std::vector<BlockWrite> writes;
+    writes.reserve(needed);
+
+    uint64_t checksum = 14695981039346656037ULL;
+    uint32_t position = journalHead;
+
+    for (uint32_t d = 0; d < descriptors; ++d) {
+
+        JournalDescriptor& descriptor = descriptorBlocks[d];
+        std::memset(&descriptor, 0, sizeof(descriptor));
+        descriptor.magic = JOURNAL_DESCRIPTOR_MAGIC;
+        descriptor.sequence = journalSequence;
+
+        size_t first = static_cast<size_t>(d) * JOURNAL_DESCRIPTOR_SLOTS;
+        size_t last = std::min<size_t>(first + JOURNAL_DESCRIPTOR_SLOTS, dirty.size());
+
+        for (size_t i = first; i < last; ++i) {
+            descriptor.blocks[descriptor.count++] = dirty[i]->blockNum;
+        }
+
+        checksum = checksumBlock(checksum, reinterpret_cast<const char*>(&descriptor), blockSize);
+        writes.push_back({ journalStart + position++, &descriptor });
+
+        for (size_t i = first; i < last; ++i) {
+            checksum = checksumBlock(checksum, dirty[i]->data, blockSize);
+            writes.push_back({ journalStart + position++, dirty[i]->data });
+        }
+    }
+
+    commitBlock.magic = JOURNAL_COMMIT_MAGIC;
+    commitBlock.count = dirty.size();
+    commitBlock.sequence = journalSequence;
+    commitBlock.checksum = checksum;
+    writes.push_back({ journalStart + position++, &commitBlock });
+
+    writeBlocks(writes);
+    flushImage();
+
+    // Step 3: The transaction is durable, its blocks may go home now. They are
+    // flushed by the next checkpoint, until then replay can redo them.
+    std::vector<BlockWrite> homes;
+    homes.reserve(dirty.size());
+
+    for (BlockCache::Frame* frame : dirty) {
+        homes.push_back({ frame->blockNum, frame->data });
+    }
+
+    writeBlocks(homes);
+
+    journalHead = position;
+    ++journalSequence;
+
+}
+
+void DiskManager::checkpoint() {
+
+    if (!journalEnabled()) {
+        return;
+    }
+
+    // Everything logged before journalHead has to be home before the journal forgets it
+    flushImage();
+    writeJournalSuper(journalHead);
+    flushImage();
+
+}
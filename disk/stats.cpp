@@ -0,0 +1,198 @@
+#include "stats.h"
+#include <cstdio>
+
+static const char* const COUNTER_NAMES[Stats::COUNTER_COUNT] = {
+    "block_reads",
+    "block_writes",
+    "cache_hits",
+    "cache_misses",
+    "flushes",
+    "journal_commits",
+    "bitmap_scans",
+    "bits_scanned",
+    "dir_lookups",
+    "dir_entries_compared",
+    "bytes_copied",
+    "bytes_read",
+    "bytes_written",
+    "readahead_blocks",
+    "bytes_exported",
+    "clusters_compressed",
+    "clusters_decompressed"
+};
+
+static const char* const HISTO_NAMES[Stats::HISTO_COUNT] = {
+    "create_file_ns",
+    "open_file_ns",
+    "close_file_ns",
+    "read_file_ns",
+    "read_view_ns",
+    "write_file_ns",
+    "export_file_ns",
+    "delete_file_ns",
+    "create_files_ns",
+    "delete_files_ns",
+    "create_directory_ns",
+    "delete_directory_ns",
+    "lookup_path_ns",
+    "journal_commit_ns",
+    "bits_per_scan",
+    "entries_per_lookup"
+};
+
+void Histogram::record(uint64_t value) {
+
+    int bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+    if (bucket >= BUCKETS) {
+        bucket = BUCKETS - 1;
+    }
+
+    buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(value, std::memory_order_relaxed);
+
+    uint64_t old = max.load(std::memory_order_relaxed);
+    while (value > old && !max.compare_exchange_weak(old, value, std::memory_order_relaxed)) {
+    }
+
+}
+
+void Histogram::reset() {
+
+    for (int i = 0; i < BUCKETS; ++i) {
+        buckets[i].store(0, std::memory_order_relaxed);
+    }
+
+    count.store(0, std::memory_order_relaxed);
+    sum.store(0, std::memory_order_relaxed);
+    max.store(0, std::memory_order_relaxed);
+
+}
+
+uint64_t Histogram::percentile(double p) const {
+
+    uint64_t total = getCount();
+    if (total == 0) {
+        return 0;
+    }
+
+    // Rank of the wanted value, counted from 1
+    uint64_t rank = static_cast<uint64_t>(p / 100.0 * total + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+
+    for (int i = 0; i < BUCKETS; ++i) {
+
+        seen += buckets[i].load(std::memory_order_relaxed);
+
+        if (seen >= rank) {
+            uint64_t upper = i == 0 ? 0 : (1ULL << i) - 1;
+            return upper < getMax() ? upper : getMax();
+        }
+    }
+
+    return getMax();
+}
+
+std::string Histogram::toJson() const {
+
+    char buffer[256];
+    std::snprintf(buffer, sizeof(buffer), "{\"count\":%llu,\"sum\":%llu,\"max\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"buckets\":[",
+        static_cast<unsigned long long>(getCount()), static_cast<unsigned long long>(getSum()),
+        static_cast<unsigned long long>(getMax()), static_cast<unsigned long long>(percentile(50)),
+        static_cast<unsigned long long>(percentile(90)), static_cast<unsigned long long>(percentile(99)));
+
+    std::string json = buffer;
+
+    // Trailing empty buckets are left out
+    int last = BUCKETS - 1;
+    while (last >= 0 && buckets[last].load(std::memory_order_relaxed) == 0) {
+        --last;
+    }
+
+    for (int i = 0; i <= last; ++i) {
+        if (i > 0) {
+            json += ",";
+        }
+        json += std::to_string(buckets[i].load(std::memory_order_relaxed));
+    }
+
+    json += "]}";
+    return json;
+}
+
+Stats::Timer::~Timer() {
+
+    auto end = std::chrono::steady_clock::now();
+    stats.record(histo, std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+
+}
+
+void Stats::reset() {
+
+    for (int i = 0; i < COUNTER_COUNT; ++i) {
+        counters[i].store(0, std::memory_order_relaxed);
+    }
+
+    for (int i = 0; i < HISTO_COUNT; ++i) {
+        histograms[i].reset();
+    }
+
+}
+
+std::string Stats::toJson() const {
+
+    std::string json = "{\"counters\":{";
+
+    for (int i = 0; i < COUNTER_COUNT; ++i) {
+        if (i > 0) {
+            json += ",";
+        }
+        json += std::string("\"") + COUNTER_NAMES[i] + "\":" + std::to_string(get(static_cast<Counter>(i)));
+    }
+
+    json += "},\"histograms\":{";
+
+    for (int i = 0; i < HISTO_COUNT; ++i) {
+        if (i > 0) {
+            json += ",";
+        }
+        json += std::string("\"") + HISTO_NAMES[i] + "\":" + histograms[i].toJson();
+    }
+
+    json += "}}";
+    return json;
+}
+
+std::string Stats::toText() const {
+
+    std::string text;
+    char line[256];
+
+    for (int i = 0; i < COUNTER_COUNT; ++i) {
+        std::snprintf(line, sizeof(line), "%-22s %llu\n", COUNTER_NAMES[i], static_cast<unsigned long long>(get(static_cast<Counter>(i))));
+        text += line;
+    }
+
+    std::snprintf(line, sizeof(line), "\n%-22s %10s %10s %10s %10s %12s\n", "histogram", "count", "p50", "p99", "max", "mean");
+    text += line;
+
+    for (int i = 0; i < HISTO_COUNT; ++i) {
+
+        const Histogram& h = histograms[i];
+        if (h.getCount() == 0) {
+            continue;
+        }
+
+        std::snprintf(line, sizeof(line), "%-22s %10llu %10llu %10llu %10llu %12.1f\n", HISTO_NAMES[i],
+            static_cast<unsigned long long>(h.getCount()), static_cast<unsigned long long>(h.percentile(50)),
+            static_cast<unsigned long long>(h.percentile(99)), static_cast<unsigned long long>(h.getMax()),
+            static_cast<double>(h.getSum()) / h.getCount());
+        text += line;
+    }
+
+    return text;
+}
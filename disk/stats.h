@@ -0,0 +1,114 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Power of two histogram. Bucket 0 counts the value 0, bucket i > 0 counts
+// values in [2^(i-1), 2^i). Recording is a few relaxed atomic adds.
+class Histogram {
+public:
+    static const int BUCKETS = 48;
+
+private:
+    std::atomic<uint64_t> buckets[BUCKETS];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> max;
+
+public:
+    Histogram() { reset(); }
+
+    void record(uint64_t value);
+    void reset();
+
+    uint64_t getCount() const { return count.load(std::memory_order_relaxed); }
+    uint64_t getSum() const { return sum.load(std::memory_order_relaxed); }
+    uint64_t getMax() const { return max.load(std::memory_order_relaxed); }
+
+    // Upper bound of the bucket holding the p-th percentile (0 < p <= 100)
+    uint64_t percentile(double p) const;
+
+    std::string toJson() const;
+};
+
+// Counters and histograms kept by DiskManager and FileSystem. Every update is
+// a relaxed atomic add, so they are always on. The numbers of a snapshot taken
+// while other threads work are each exact but not from one instant.
+class Stats {
+public:
+    enum Counter {
+        BLOCK_READS,                                    // Blocks read from the image
+        BLOCK_WRITES,                                   // Blocks written to the image
+        CACHE_HITS,
+        CACHE_MISSES,
+        FLUSHES,                                        // fdatasync / msync calls
+        JOURNAL_COMMITS,
+        BITMAP_SCANS,                                   // Searches for free bits
+        BITS_SCANNED,
+        DIR_LOOKUPS,
+        DIR_ENTRIES_COMPARED,
+        BYTES_COPIED,                                   // memcpy between caller buffers, cache frames and the mapping
+        BYTES_READ,                                     // Returned by readFile
+        BYTES_WRITTEN,                                  // Accepted by writeFile
+        READAHEAD_BLOCKS,                               // Read into the cache ahead of a sequential reader
+        BYTES_EXPORTED,                                 // Sent to host descriptors by exportFile
+        CLUSTERS_COMPRESSED,                            // Clusters of compressed files encoded and written
+        CLUSTERS_DECOMPRESSED,                          // Compressed clusters read and decoded
+        COUNTER_COUNT
+    };
+
+    enum Histo {
+        CREATE_FILE_NS,
+        OPEN_FILE_NS,
+        CLOSE_FILE_NS,
+        READ_FILE_NS,
+        READ_VIEW_NS,
+        WRITE_FILE_NS,
+        EXPORT_FILE_NS,
+        DELETE_FILE_NS,
+        CREATE_FILES_NS,                                // One createFiles / deleteFiles batch
+        DELETE_FILES_NS,
+        CREATE_DIRECTORY_NS,
+        DELETE_DIRECTORY_NS,
+        LOOKUP_PATH_NS,
+        JOURNAL_COMMIT_NS,
+        BITS_PER_SCAN,
+        ENTRIES_PER_LOOKUP,
+        HISTO_COUNT
+    };
+
+    // Records the nanoseconds it lived into a histogram
+    class Timer {
+    private:
+        Stats& stats;
+        Histo histo;
+        std::chrono::steady_clock::time_point start;
+
+    public:
+        Timer(Stats& stats_, Histo histo_) : stats(stats_), histo(histo_), start(std::chrono::steady_clock::now()) {}
+        ~Timer();
+    };
+
+private:
+    std::atomic<uint64_t> counters[COUNTER_COUNT];
+    Histogram histograms[HISTO_COUNT];
+
+public:
+    Stats() { reset(); }
+
+    void add(Counter counter, uint64_t n = 1) { counters[counter].fetch_add(n, std::memory_order_relaxed); }
+    void record(Histo histo, uint64_t value) { histograms[histo].record(value); }
+
+    uint64_t get(Counter counter) const { return counters[counter].load(std::memory_order_relaxed); }
+    const Histogram& histogram(Histo histo) const { return histograms[histo]; }
+
+    void reset();
+
+    std::string toJson() const;                         // One JSON object holding every counter and histogram
+    std::string toText() const;                         // Table for the shell, empty histograms are left out
+};
+
+#endif
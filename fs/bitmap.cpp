@@ -0,0 +1,345 @@
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include "bitmap.h"
+
+void Bitmap::load(DiskManager& disk, uint32_t startBlock_, uint32_t blockCount_, uint32_t blockSize_, uint32_t numBits_) {
+
+    if (static_cast<uint64_t>(numBits_) > static_cast<uint64_t>(blockCount_) * blockSize_ * 8) {
+        throw std::invalid_argument(std::string("Bitmap blocks are too small for ") + std::to_string(numBits_) + " bits");
+    }
+
+    startBlock = startBlock_;
+    blockCount = blockCount_;
+    blockSize = blockSize_;
+    numBits = numBits_;
+    cursor = 0;
+    stats = &disk.getStats();
+
+    uint32_t words_per_block = blockSize / sizeof(uint64_t);
+    size_t num_words = static_cast<size_t>(blockCount) * words_per_block;
+
+    std::vector<uint64_t> loaded(num_words, 0);
+
+    std::vector<BlockRead> requests;
+    for (uint32_t i = 0; i < blockCount; ++i) {
+        requests.push_back({ startBlock + i, loaded.data() + static_cast<size_t>(i) * words_per_block });
+    }
+    disk.readBlocks(requests);
+
+    words.reset(new std::atomic<uint64_t>[num_words]);
+    held.reset(new std::atomic<uint64_t>[num_words]);
+    for (size_t w = 0; w < num_words; ++w) {
+        words[w].store(loaded[w], std::memory_order_relaxed);
+        held[w].store(0, std::memory_order_relaxed);
+    }
+
+    blockLocks.reset(new std::mutex[blockCount]);
+
+    // Only the first numBits bits can be handed out
+    uint32_t free_bits = 0;
+    for (uint32_t w = 0; w * 64 < numBits; ++w) {
+        uint64_t valid = (numBits - w * 64 >= 64) ? ~0ULL : ((1ULL << (numBits - w * 64)) - 1);
+        free_bits += __builtin_popcountll(~loaded[w] & valid);
+    }
+    freeCount = free_bits;
+
+}
+
+bool Bitmap::test(uint32_t bit) const {
+
+    if (bit >= numBits) {
+        throw std::invalid_argument(std::string("Bitmap bit out of range: ") + std::to_string(bit));
+    }
+
+    return (word(bit / 64) >> (bit % 64)) & 1;
+}
+
+void Bitmap::set(uint32_t bit) {
+
+    if (bit >= numBits) {
+        throw std::invalid_argument(std::string("Bitmap bit out of range: ") + std::to_string(bit));
+    }
+
+    uint64_t mask = 1ULL << (bit % 64);
+
+    if ((words[bit / 64].fetch_or(mask) & mask) == 0) {
+        --freeCount;
+    }
+
+}
+
+bool Bitmap::clear(uint32_t bit) {
+
+    if (bit >= numBits) {
+        throw std::invalid_argument(std::string("Bitmap bit out of range: ") + std::to_string(bit));
+    }
+
+    uint64_t mask = 1ULL << (bit % 64);
+
+    if ((words[bit / 64].fetch_and(~mask) & mask) != 0) {
+        ++freeCount;
+        return true;
+    }
+
+    return false;
+}
+
+bool Bitmap::hold(uint32_t bit) {
+
+    if (bit >= numBits) {
+        throw std::invalid_argument(std::string("Bitmap bit out of range: ") + std::to_string(bit));
+    }
+
+    uint64_t mask = 1ULL << (bit % 64);
+
+    if ((word(bit / 64) & mask) == 0) {
+        return false;
+    }
+
+    return (held[bit / 64].fetch_or(mask) & mask) == 0;
+}
+
+bool Bitmap::release(uint32_t bit) {
+
+    if (bit >= numBits) {
+        throw std::invalid_argument(std::string("Bitmap bit out of range: ") + std::to_string(bit));
+    }
+
+    uint64_t mask = 1ULL << (bit % 64);
+
+    if ((held[bit / 64].fetch_and(~mask) & mask) == 0) {
+        return false;
+    }
+
+    return clear(bit);
+}
+
+int64_t Bitmap::allocate() {
+
+    if (getFreeCount() == 0) {
+        return -1;
+    }
+
+    uint32_t num_words = (numBits + 63) / 64;
+    uint32_t start = cursor.load(std::memory_order_relaxed);
+
+    for (uint32_t k = 0; k < num_words; ++k) {
+
+        uint32_t w = start + k;
+        if (w >= num_words) {
+            w -= num_words;
+        }
+
+        uint64_t old = word(w);
+
+        // Another thread may take the bit first, then try the next clear bit of the word
+        while (~old != 0) {
+
+            uint32_t bit = w * 64 + __builtin_ctzll(~old);
+
+            // A hit past numBits is padding in the last word
+            if (bit >= numBits) {
+                break;
+            }
+
+            if (words[w].compare_exchange_weak(old, old | (1ULL << (bit % 64)))) {
+                --freeCount;
+                cursor.store(w, std::memory_order_relaxed);
+                countScan((k + 1) * 64);
+                return bit;
+            }
+        }
+    }
+
+    countScan(static_cast<uint64_t>(num_words) * 64);
+    return -1;
+}
+
+void Bitmap::countScan(uint64_t bits) {
+
+    stats->add(Stats::BITMAP_SCANS);
+    stats->add(Stats::BITS_SCANNED, bits);
+    stats->record(Stats::BITS_PER_SCAN, bits);
+
+}
+
+uint32_t Bitmap::nextClear(uint32_t bit, uint32_t end) const {
+
+    while (bit < end) {
+
+        uint64_t free_bits = ~word(bit / 64) >> (bit % 64);
+
+        if (free_bits != 0) {
+            bit += __builtin_ctzll(free_bits);
+            return bit < end ? bit : end;
+        }
+
+        bit = (bit / 64 + 1) * 64;
+    }
+
+    return end;
+}
+
+uint32_t Bitmap::nextSet(uint32_t bit, uint32_t end) const {
+
+    while (bit < end) {
+
+        uint64_t used_bits = word(bit / 64) >> (bit % 64);
+
+        if (used_bits != 0) {
+            bit += __builtin_ctzll(used_bits);
+            return bit < end ? bit : end;
+        }
+
+        bit = (bit / 64 + 1) * 64;
+    }
+
+    return end;
+}
+
+int64_t Bitmap::findFreeRun(uint32_t want, int64_t goal, uint32_t* length) {
+
+    if (getFreeCount() == 0 || want == 0) {
+        return -1;
+    }
+
+    uint32_t start = goal >= 0 && goal < numBits ? static_cast<uint32_t>(goal) : cursor.load(std::memory_order_relaxed) * 64;
+    if (start >= numBits) {
+        start = 0;
+    }
+
+    int64_t best = -1;
+    uint32_t best_length = 0;
+    uint64_t scanned = 0;
+
+    // Two passes: [start, numBits) and then [0, start)
+    for (int pass = 0; pass < 2; ++pass) {
+
+        uint32_t bit = pass == 0 ? start : 0;
+        uint32_t end = pass == 0 ? numBits : start;
+        uint32_t pass_start = bit;
+
+        while (bit < end) {
+
+            bit = nextClear(bit, end);
+            if (bit >= end) {
+                break;
+            }
+
+            uint32_t run_end = nextSet(bit, std::min<uint64_t>(end, static_cast<uint64_t>(bit) + want));
+            uint32_t run_length = run_end - bit;
+
+            if (run_length > best_length) {
+                best = bit;
+                best_length = run_length;
+            }
+
+            if (run_length >= want) {
+                *length = want;
+                cursor.store(bit / 64, std::memory_order_relaxed);
+                countScan(scanned + run_end - pass_start);
+                return bit;
+            }
+
+            bit = run_end;
+        }
+
+        scanned += end - pass_start;
+    }
+
+    countScan(scanned);
+
+    if (best >= 0) {
+        cursor.store(static_cast<uint32_t>(best) / 64, std::memory_order_relaxed);
+    }
+
+    *length = best_length;
+    return best;
+}
+
+bool Bitmap::claimRange(uint32_t bit, uint32_t count) {
+
+    uint32_t end = bit + count;
+    uint32_t claimed = bit;
+
+    while (claimed < end) {
+
+        uint32_t w = claimed / 64;
+        uint32_t lo = claimed % 64;
+        uint32_t hi = std::min<uint32_t>(64, lo + (end - claimed));
+        uint64_t mask = (hi == 64 ? ~0ULL : ((1ULL << hi) - 1)) & ~((1ULL << lo) - 1);
+
+        uint64_t old = word(w);
+        bool taken = false;
+
+        do {
+            if ((old & mask) != 0) {
+                taken = true;
+                break;
+            }
+        } while (!words[w].compare_exchange_weak(old, old | mask));
+
+        // Part of the run went to another thread, give back what was set so far
+        if (taken) {
+
+            for (uint32_t undo = bit; undo < claimed;) {
+                uint32_t uw = undo / 64;
+                uint32_t ulo = undo % 64;
+                uint32_t uhi = std::min<uint32_t>(64, ulo + (claimed - undo));
+                uint64_t umask = (uhi == 64 ? ~0ULL : ((1ULL << uhi) - 1)) & ~((1ULL << ulo) - 1);
+
+                words[uw].fetch_and(~umask);
+                undo += uhi - ulo;
+            }
+
+            return false;
+        }
+
+        claimed += hi - lo;
+    }
+
+    freeCount -= count;
+    return true;
+}
+
+int64_t Bitmap::allocateRun(uint32_t want, int64_t goal, uint32_t* length) {
+
+    while (true) {
+
+        uint32_t run_length = 0;
+        int64_t start = findFreeRun(want, goal, &run_length);
+
+        if (start < 0) {
+            return -1;
+        }
+
+        if (claimRange(static_cast<uint32_t>(start), run_length)) {
+            *length = run_length;
+            return start;
+        }
+
+        // Lost a race for the run, the next search sees the new owner's bits
+    }
+
+}
+
+void Bitmap::writeBack(DiskManager& disk, uint32_t bit) {
+
+    uint32_t index = bit / (blockSize * 8);
+    uint32_t words_per_block = blockSize / sizeof(uint64_t);
+
+    // The snapshot and the write happen under one lock, so a later write back
+    // of the block never carries an older snapshot than an earlier one
+    std::lock_guard<std::mutex> guard(blockLocks[index]);
+
+    // Held bits go to disk clear
+    uint64_t buffer[512];
+    for (uint32_t i = 0; i < words_per_block; ++i) {
+        size_t w = static_cast<size_t>(index) * words_per_block + i;
+        buffer[i] = word(w) & ~held[w].load(std::memory_order_relaxed);
+    }
+
+    disk.writeBlock(startBlock + index, buffer);
+
+}
@@ -0,0 +1,70 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "../disk/disk.h"
+
+// In memory copy of an on-disk allocation bitmap (bit i lives in byte i / 8,
+// bit i % 8 of the bitmap blocks). Searches run 64 bits at a time and start at a
+// next-fit cursor, so the cost of an allocation does not grow as the disk fills.
+//
+// Bits are claimed with compare-and-swap on the 64 bit words, so threads
+// allocate without a common lock. Only writing a bitmap block back takes that
+// block's mutex, which keeps concurrent write backs of one block in order.
+//
+// A bit may also be held: it is written back clear, so the transaction which
+// freed it records the free, but stays set in memory and cannot be allocated
+// until it is released.
+class Bitmap {
+private:
+    uint32_t startBlock;                                // First bitmap block on disk
+    uint32_t blockCount;                                // Number of bitmap blocks
+    uint32_t blockSize;
+    uint32_t numBits;                                   // Bits which may be allocated
+    std::atomic<uint32_t> freeCount;
+
+    std::unique_ptr<std::atomic<uint64_t>[]> words;
+    std::unique_ptr<std::atomic<uint64_t>[]> held;      // Set bits which are free on disk
+    std::atomic<uint32_t> cursor;                       // Word where the next search starts
+    std::unique_ptr<std::mutex[]> blockLocks;           // One per bitmap block, taken by writeBack
+    Stats* stats;                                       // Of the disk the bitmap was loaded from
+
+    uint64_t word(uint32_t w) const { return words[w].load(std::memory_order_relaxed); }
+    uint32_t nextClear(uint32_t bit, uint32_t end) const;
+    uint32_t nextSet(uint32_t bit, uint32_t end) const;
+    int64_t findFreeRun(uint32_t want, int64_t goal, uint32_t* length);
+    bool claimRange(uint32_t bit, uint32_t count);      // Sets all bits or none of them
+    void countScan(uint64_t bits);
+
+public:
+    Bitmap() : startBlock(0), blockCount(0), blockSize(0), numBits(0), freeCount(0), cursor(0), stats(nullptr) {}
+
+    void load(DiskManager& disk, uint32_t startBlock_, uint32_t blockCount_, uint32_t blockSize_, uint32_t numBits_);
+
+    bool test(uint32_t bit) const;
+    void set(uint32_t bit);
+    bool clear(uint32_t bit);                           // Returns whether the bit was set
+    bool hold(uint32_t bit);                            // Returns whether the bit was set and not held yet
+    bool release(uint32_t bit);                         // Clears a held bit, returns whether it was held
+
+    // Sets and returns the first clear bit at or after the cursor (wrapping
+    // around), or -1 when full.
+    int64_t allocate();
+
+    // Sets and returns a run of up to want clear bits, searching from goal (or
+    // the cursor when goal is -1) and wrapping around. The first run which is
+    // long enough wins, otherwise the longest run seen is taken. Returns -1 when full.
+    int64_t allocateRun(uint32_t want, int64_t goal, uint32_t* length);
+
+    uint32_t blockOf(uint32_t bit) const { return startBlock + bit / (blockSize * 8); }
+    uint32_t getFreeCount() const { return freeCount.load(std::memory_order_relaxed); }
+
+    // Writes the bitmap block holding bit back to disk
+    void writeBack(DiskManager& disk, uint32_t bit);
+};
+
+#endif
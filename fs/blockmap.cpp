@@ -0,0 +1,445 @@
+#include "fs.h"
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+
+// Logical block layout of a file (P = block pointers per block):
+//   [0, 12)                    -> direct_blocks
+//   [12, 12 + P)               -> indirect_blocks[0], single indirect
+//   [12 + P, 12 + P + P * P)   -> indirect_blocks[1], double indirect
+//   [12 + P + P * P, ... + P^3) -> indirect_blocks[2], triple indirect
+//
+// With 4 KiB blocks that is a little over 4 TiB per file.
+
+#define DIRECT_BLOCKS 12
+
+namespace {
+
+// One block of block pointers which is being modified
+struct PointerBlock {
+    uint32_t blockNum;
+    bool dirty;
+    uint32_t ptrs[1024];
+};
+
+}
+
+uint32_t FileSystem::pointersPerBlock() const {
+
+    return super_cache.block_size / sizeof(uint32_t);
+
+}
+
+uint64_t FileSystem::maxFileBlocks() const {
+
+    uint64_t p = pointersPerBlock();
+    return DIRECT_BLOCKS + p + p * p + p * p * p;
+
+}
+
+void FileSystem::mapBlocks(const Inode& inode, uint32_t first, uint32_t count, uint32_t* out) {
+
+    // The pointers of an inline file hold its bytes, it has no blocks
+    if (isInline(inode)) {
+        std::fill(out, out + count, 0);
+        return;
+    }
+
+    uint32_t p = pointersPerBlock();
+    uint32_t i = 0;
+
+    while (i < count) {
+
+        uint64_t block_index = static_cast<uint64_t>(first) + i;
+
+        if (block_index < DIRECT_BLOCKS) {
+            out[i++] = inode.direct_blocks[block_index];
+            continue;
+        }
+
+        block_index -= DIRECT_BLOCKS;
+
+        // Every run below comes out of one pointer block, which is viewed once
+        if (block_index < p) {
+
+            uint32_t n = std::min<uint64_t>(count - i, p - block_index);
+
+            if (inode.indirect_blocks[0] == 0) {
+                std::fill(out + i, out + i + n, 0);
+            } else {
+                BlockView single = disk.viewBlock(inode.indirect_blocks[0]);
+                std::memcpy(out + i, reinterpret_cast<const uint32_t*>(single.data()) + block_index, n * sizeof(uint32_t));
+            }
+
+            i += n;
+            continue;
+        }
+
+        block_index -= p;
+
+        if (block_index < static_cast<uint64_t>(p) * p) {
+
+            uint32_t outer = block_index / p;
+            uint32_t inner = block_index % p;
+            uint32_t n = std::min<uint64_t>(count - i, p - inner);
+            uint32_t middle = 0;
+
+            if (inode.indirect_blocks[1] != 0) {
+                BlockView outer_block = disk.viewBlock(inode.indirect_blocks[1]);
+                middle = reinterpret_cast<const uint32_t*>(outer_block.data())[outer];
+            }
+
+            if (middle == 0) {
+                std::fill(out + i, out + i + n, 0);
+            } else {
+                BlockView middle_block = disk.viewBlock(middle);
+                std::memcpy(out + i, reinterpret_cast<const uint32_t*>(middle_block.data()) + inner, n * sizeof(uint32_t));
+            }
+
+            i += n;
+            continue;
+        }
+
+        block_index -= static_cast<uint64_t>(p) * p;
+
+        if (block_index < static_cast<uint64_t>(p) * p * p) {
+
+            uint32_t top = block_index / (static_cast<uint64_t>(p) * p);
+            uint32_t outer = block_index / p % p;
+            uint32_t inner = block_index % p;
+            uint32_t n = std::min<uint64_t>(count - i, p - inner);
+            uint32_t middle = 0;
+
+            if (inode.indirect_blocks[2] != 0) {
+                BlockView top_block = disk.viewBlock(inode.indirect_blocks[2]);
+                middle = reinterpret_cast<const uint32_t*>(top_block.data())[top];
+            }
+
+            if (middle != 0) {
+                BlockView outer_block = disk.viewBlock(middle);
+                middle = reinterpret_cast<const uint32_t*>(outer_block.data())[outer];
+            }
+
+            if (middle == 0) {
+                std::fill(out + i, out + i + n, 0);
+            } else {
+                BlockView middle_block = disk.viewBlock(middle);
+                std::memcpy(out + i, reinterpret_cast<const uint32_t*>(middle_block.data()) + inner, n * sizeof(uint32_t));
+            }
+
+            i += n;
+            continue;
+        }
+
+        throw std::invalid_argument(std::string("Block index beyond maximum file size: ") + std::to_string(first + i));
+    }
+
+}
+
+void FileSystem::assignBlocks(Inode& inode, const std::vector<std::pair<uint32_t, uint32_t>>& mapping) {
+
+    uint32_t p = pointersPerBlock();
+
+    // At most one pointer block per level of each tree is held at a time;
+    // mapping is sorted, so each of them is written back once
+    PointerBlock single = { 0, false, {} };
+    PointerBlock outer = { 0, false, {} };
+    PointerBlock middle = { 0, false, {} };
+    PointerBlock triple = { 0, false, {} };
+    PointerBlock triple_outer = { 0, false, {} };
+    PointerBlock triple_middle = { 0, false, {} };
+
+    auto flush = [this](PointerBlock& block) {
+        if (block.blockNum != 0 && block.dirty) {
+            disk.writeBlock(block.blockNum, block.ptrs);
+        }
+        block.dirty = false;
+    };
+
+    // Makes block hold *slot, allocating a zeroed pointer block near goal when the slot is empty
+    auto load = [this, &flush](PointerBlock& block, uint32_t* slot, bool* slot_dirty, uint32_t goal) {
+
+        if (*slot == 0) {
+            flush(block);
+            *slot = allocateDataBlock(goal);
+            *slot_dirty = true;
+            block.blockNum = *slot;
+            std::memset(block.ptrs, 0, sizeof(block.ptrs));
+            block.dirty = true;
+            return;
+        }
+
+        if (block.blockNum != *slot) {
+            flush(block);
+            block.blockNum = *slot;
+            disk.readBlock(*slot, block.ptrs);
+        }
+    };
+
+    bool inode_dirty = false;                           // Set when an indirect slot of the inode is filled
+
+    for (const auto& entry : mapping) {
+
+        uint64_t block_index = entry.first;
+
+        if (block_index < DIRECT_BLOCKS) {
+            inode.direct_blocks[block_index] = entry.second;
+            continue;
+        }
+
+        block_index -= DIRECT_BLOCKS;
+
+        if (block_index < p) {
+            load(single, &inode.indirect_blocks[0], &inode_dirty, entry.second);
+            single.ptrs[block_index] = entry.second;
+            single.dirty = true;
+            continue;
+        }
+
+        block_index -= p;
+
+        if (block_index < static_cast<uint64_t>(p) * p) {
+            load(outer, &inode.indirect_blocks[1], &inode_dirty, entry.second);
+            load(middle, &outer.ptrs[block_index / p], &outer.dirty, entry.second);
+            middle.ptrs[block_index % p] = entry.second;
+            middle.dirty = true;
+            continue;
+        }
+
+        block_index -= static_cast<uint64_t>(p) * p;
+
+        if (block_index >= static_cast<uint64_t>(p) * p * p) {
+            throw std::invalid_argument(std::string("Block index beyond maximum file size: ") + std::to_string(entry.first));
+        }
+
+        load(triple, &inode.indirect_blocks[2], &inode_dirty, entry.second);
+        load(triple_outer, &triple.ptrs[block_index / (static_cast<uint64_t>(p) * p)], &triple.dirty, entry.second);
+        load(triple_middle, &triple_outer.ptrs[block_index / p % p], &triple_outer.dirty, entry.second);
+        triple_middle.ptrs[block_index % p] = entry.second;
+        triple_middle.dirty = true;
+    }
+
+    flush(single);
+    flush(middle);
+    flush(outer);
+    flush(triple_middle);
+    flush(triple_outer);
+    flush(triple);
+
+}
+
+void FileSystem::freeFileBlocks(Inode& inode) {
+
+    freeBlockRange(inode, 0, maxFileBlocks());
+
+}
+
+void FileSystem::freeBlockRange(Inode& inode, uint64_t first, uint64_t end) {
+
+    if (isInline(inode)) {
+        return;
+    }
+
+    uint32_t p = pointersPerBlock();
+    std::vector<uint32_t> blocks;
+
+    end = std::min<uint64_t>(end, maxFileBlocks());
+
+    for (uint64_t i = first; i < std::min<uint64_t>(end, DIRECT_BLOCKS); ++i) {
+        if (inode.direct_blocks[i] != 0) {
+            blocks.push_back(inode.direct_blocks[i]);
+            inode.direct_blocks[i] = 0;
+        }
+    }
+
+    // The COMPRESSED_CLUSTER marks in the last slot of compressed clusters
+    // are cleared like pointers but own no block
+    auto owns = [](uint32_t ptr) { return ptr != 0 && ptr != COMPRESSED_CLUSTER; };
+
+    // Collects a whole tree of the given depth (1 points at data blocks), its own block included
+    std::function<void(uint32_t, int)> collect = [&](uint32_t block, int depth) {
+
+        std::vector<uint32_t> ptrs(p);
+        {
+            BlockView view = disk.viewBlock(block);
+            std::memcpy(ptrs.data(), view.data(), p * sizeof(uint32_t));
+        }
+
+        for (uint32_t ptr : ptrs) {
+            if (!owns(ptr)) {
+                continue;
+            }
+            if (depth == 1) {
+                blocks.push_back(ptr);
+            } else {
+                collect(ptr, depth - 1);
+            }
+        }
+
+        blocks.push_back(block);
+    };
+
+    // Frees the part of [first, end) which the tree in *slot covers; it starts
+    // at file block base. Pointer blocks left empty are freed too, the others
+    // are written back.
+    std::function<void(uint32_t*, int, uint64_t)> prune = [&](uint32_t* slot, int depth, uint64_t base) {
+
+        uint64_t span = 1;
+        for (int d = 0; d < depth; ++d) {
+            span *= p;
+        }
+
+        if (*slot == 0 || end <= base || first >= base + span) {
+            return;
+        }
+
+        if (first <= base && end >= base + span) {
+            collect(*slot, depth);
+            *slot = 0;
+            return;
+        }
+
+        uint32_t ptrs[1024];
+        disk.readBlock(*slot, ptrs);
+
+        uint64_t child_span = span / p;
+        uint32_t from = first > base ? (first - base) / child_span : 0;
+        uint32_t to = std::min<uint64_t>(p, (end - base + child_span - 1) / child_span);
+
+        for (uint32_t k = from; k < to; ++k) {
+            if (depth == 1) {
+                if (owns(ptrs[k])) {
+                    blocks.push_back(ptrs[k]);
+                }
+                ptrs[k] = 0;
+            } else {
+                prune(&ptrs[k], depth - 1, base + k * child_span);
+            }
+        }
+
+        if (std::all_of(ptrs, ptrs + p, [](uint32_t ptr) { return ptr == 0; })) {
+            blocks.push_back(*slot);
+            *slot = 0;
+        } else {
+            disk.writeBlock(*slot, ptrs);
+        }
+    };
+
+    uint64_t base = DIRECT_BLOCKS;
+    prune(&inode.indirect_blocks[0], 1, base);
+    base += p;
+    prune(&inode.indirect_blocks[1], 2, base);
+    base += static_cast<uint64_t>(p) * p;
+    prune(&inode.indirect_blocks[2], 3, base);
+
+    freeDataBlocks(blocks);
+
+}
+
+const uint32_t* FileSystem::mapForFd(int fd, const Inode& inode, uint32_t first, uint32_t count) {
+
+    std::vector<uint32_t>& block_map = fd_table[fd].block_map;
+    uint64_t needed = static_cast<uint64_t>(first) + count;
+
+    if (needed > block_map.size()) {
+
+        // Translate a whole pointer block worth at once (bounded by the file
+        // size), so a sequential reader does not go back to the indirect blocks
+        // for every call
+        uint64_t file_blocks = (static_cast<uint64_t>(inode.size) + super_cache.block_size - 1) / super_cache.block_size;
+        uint64_t target = std::max<uint64_t>(needed, std::min<uint64_t>(file_blocks, block_map.size() + pointersPerBlock()));
+        target = std::min<uint64_t>(target, maxFileBlocks());
+
+        size_t old_size = block_map.size();
+        block_map.resize(target);
+        mapBlocks(inode, old_size, target - old_size, block_map.data() + old_size);
+    }
+
+    return block_map.data() + first;
+}
+
+void FileSystem::invalidateBlockMaps(uint32_t inode_index, uint32_t from) {
+
+    // The caller holds the inode exclusively, so no other descriptor of it is using its map
+    for (int fd = 0; fd < MAX_OPEN_FILES; ++fd) {
+
+        std::lock_guard<std::mutex> guard(fdShardLock(fd));
+
+        if (!fd_table[fd].in_use || fd_table[fd].inode_index != inode_index) {
+            continue;
+        }
+
+        if (fd_table[fd].block_map.size() > from) {
+            fd_table[fd].block_map.resize(from);
+        }
+
+        if (fd_table[fd].cluster_index != UINT64_MAX && (fd_table[fd].cluster_index + 1) * CLUSTER_BLOCKS > from) {
+            fd_table[fd].cluster_index = UINT64_MAX;
+        }
+    }
+
+}
+
+void FileSystem::readAhead(int fd, const Inode& inode, uint64_t offset, uint32_t count) {
+
+    OpenFile& file = fd_table[fd];
+    uint32_t block_size = super_cache.block_size;
+
+    // Step 1: Grow the window while the reader is sequential, drop it otherwise.
+    // A read from the start of the file counts as sequential.
+    if (offset != file.ra_expected) {
+        file.ra_window = 0;
+        file.ra_end = 0;
+        return;
+    }
+
+    file.ra_window = file.ra_window == 0 ? READAHEAD_MIN : std::min(file.ra_window * 2, READAHEAD_MAX);
+
+    // Step 2: Top the window up once the reader has used half of it, so the
+    // blocks ahead are fetched in a few large reads instead of one at a time
+    uint64_t last_block = (offset + count - 1) / block_size;
+    uint64_t file_blocks = (inode.size + block_size - 1) / block_size;
+    uint64_t start = std::max<uint64_t>(file.ra_end, last_block + 1);
+    uint64_t end = std::min<uint64_t>(last_block + 1 + file.ra_window, file_blocks);
+
+    if (start >= end || start - (last_block + 1) > file.ra_window / 2) {
+        return;
+    }
+
+    // Translated through the descriptor's block map, so the indirect blocks are
+    // read once for the whole window; holes have nothing to read
+    const uint32_t* disk_blocks = mapForFd(fd, inode, last_block, end - last_block);
+    uint32_t previous = disk_blocks[0];
+    bool contiguous = previous != 0;
+    std::vector<uint32_t> blocks;
+
+    for (uint64_t i = 1; i < end - last_block; ++i) {
+
+        if (disk_blocks[i] == 0) {
+            continue;
+        }
+
+        contiguous = contiguous && disk_blocks[i] == previous + 1;
+        previous = disk_blocks[i];
+
+        if (i >= start - last_block) {
+            blocks.push_back(disk_blocks[i]);
+        }
+    }
+
+    file.ra_end = end;
+
+    // Step 3: Readers of less than a block per call come back to the same
+    // block several times, so the window goes into the cache. Larger reads go
+    // straight into the caller's buffer and an extra copy through the cache
+    // costs them more than it saves. The kernel's own readahead follows them
+    // on the image as long as the file is contiguous there; only a window
+    // which jumps elsewhere needs the kernel told about it.
+    if (count < block_size) {
+        disk.prefetchBlocks(blocks, true);
+    } else if (!contiguous) {
+        disk.prefetchBlocks(blocks, false);
+    }
+
+}
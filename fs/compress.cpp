@@ -0,0 +1,198 @@
+#include "compress.h"
+#include <algorithm>
+#include <cstring>
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define HASH_BITS 14
+
+static uint32_t read32(const uint8_t* p) {
+
+    uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+
+}
+
+static uint32_t hashOf(uint32_t value) {
+
+    return (value * 2654435761U) >> (32 - HASH_BITS);
+
+}
+
+// Length of the common prefix of a and b, at most limit bytes
+static uint32_t matchLength(const uint8_t* a, const uint8_t* b, uint32_t limit) {
+
+    uint32_t length = 0;
+
+    while (length + 8 <= limit) {
+
+        uint64_t x, y;
+        std::memcpy(&x, a + length, 8);
+        std::memcpy(&y, b + length, 8);
+
+        if (x != y) {
+            return length + __builtin_ctzll(x ^ y) / 8;
+        }
+
+        length += 8;
+    }
+
+    while (length < limit && a[length] == b[length]) {
+        ++length;
+    }
+
+    return length;
+}
+
+static bool putCount(uint8_t*& op, const uint8_t* end, uint32_t count) {
+
+    while (count >= 255) {
+        if (op >= end) return false;
+        *op++ = 255;
+        count -= 255;
+    }
+
+    if (op >= end) return false;
+    *op++ = count;
+
+    return true;
+}
+
+// Appends one sequence; a match_length of 0 makes it the last one
+static bool putSequence(uint8_t*& op, const uint8_t* end, const uint8_t* literals, uint32_t literal_count, uint32_t offset, uint32_t match_length) {
+
+    if (op >= end) return false;
+
+    uint32_t match_field = match_length > 0 ? match_length - MIN_MATCH : 0;
+    uint8_t* token = op++;
+    *token = std::min<uint32_t>(literal_count, 15) << 4 | std::min<uint32_t>(match_field, 15);
+
+    if (literal_count >= 15 && !putCount(op, end, literal_count - 15)) return false;
+
+    if (static_cast<uint32_t>(end - op) < literal_count) return false;
+    if (literal_count > 0) {
+        std::memcpy(op, literals, literal_count);
+        op += literal_count;
+    }
+
+    if (match_length == 0) return true;
+
+    if (end - op < 2) return false;
+    *op++ = offset & 0xFF;
+    *op++ = offset >> 8;
+
+    if (match_field >= 15 && !putCount(op, end, match_field - 15)) return false;
+
+    return true;
+}
+
+uint32_t lzCompress(const char* in, uint32_t length, char* out, uint32_t capacity) {
+
+    const uint8_t* src = reinterpret_cast<const uint8_t*>(in);
+    uint8_t* op = reinterpret_cast<uint8_t*>(out);
+    const uint8_t* end = op + capacity;
+
+    // Position + 1 of the last place each hashed prefix was seen, 0 for none
+    uint32_t table[1 << HASH_BITS] = {};
+
+    uint32_t pos = 0;
+    uint32_t anchor = 0;                                // Start of the literals not yet written
+    uint32_t misses = 0;
+
+    while (pos + MIN_MATCH <= length) {
+
+        uint32_t prefix = read32(src + pos);
+        uint32_t h = hashOf(prefix);
+        uint32_t candidate = table[h];
+        table[h] = pos + 1;
+
+        if (candidate == 0 || pos - (candidate - 1) > MAX_OFFSET || read32(src + candidate - 1) != prefix) {
+            // Data which does not compress is skipped over faster and faster
+            pos += 1 + (misses++ >> 5);
+            continue;
+        }
+
+        uint32_t match = candidate - 1;
+        uint32_t match_length = MIN_MATCH + matchLength(src + match + MIN_MATCH, src + pos + MIN_MATCH, length - pos - MIN_MATCH);
+
+        if (!putSequence(op, end, src + anchor, pos - anchor, pos - match, match_length)) {
+            return 0;
+        }
+
+        pos += match_length;
+        anchor = pos;
+        misses = 0;
+
+        // The bytes just before the next search are hashed too, so a repeat
+        // that starts inside this match is found
+        if (pos >= 2 && pos + MIN_MATCH - 2 <= length) {
+            table[hashOf(read32(src + pos - 2))] = pos - 2 + 1;
+        }
+    }
+
+    if (!putSequence(op, end, src + anchor, length - anchor, 0, 0)) {
+        return 0;
+    }
+
+    return op - reinterpret_cast<uint8_t*>(out);
+}
+
+bool lzDecompress(const char* in, uint32_t length, char* out, uint32_t raw_length) {
+
+    const uint8_t* ip = reinterpret_cast<const uint8_t*>(in);
+    const uint8_t* ip_end = ip + length;
+    uint8_t* op = reinterpret_cast<uint8_t*>(out);
+    uint8_t* op_end = op + raw_length;
+
+    auto getCount = [&](uint32_t& count) {
+        uint8_t byte;
+        do {
+            if (ip >= ip_end) return false;
+            byte = *ip++;
+            count += byte;
+        } while (byte == 255);
+        return true;
+    };
+
+    while (true) {
+
+        if (ip >= ip_end) return false;
+        uint8_t token = *ip++;
+
+        // Step 1: Literals
+        uint32_t literal_count = token >> 4;
+        if (literal_count == 15 && !getCount(literal_count)) return false;
+
+        if (static_cast<uint32_t>(ip_end - ip) < literal_count || static_cast<uint32_t>(op_end - op) < literal_count) return false;
+        std::memcpy(op, ip, literal_count);
+        ip += literal_count;
+        op += literal_count;
+
+        if (ip == ip_end) {
+            return op == op_end;
+        }
+
+        // Step 2: Match, which may overlap the bytes it produces
+        if (ip_end - ip < 2) return false;
+        uint32_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+
+        if (offset == 0 || offset > static_cast<uint32_t>(op - reinterpret_cast<uint8_t*>(out))) return false;
+
+        uint32_t match_length = token & 15;
+        if (match_length == 15 && !getCount(match_length)) return false;
+        match_length += MIN_MATCH;
+
+        if (static_cast<uint32_t>(op_end - op) < match_length) return false;
+
+        // Copying what is already there doubles the repeated part each round
+        const uint8_t* match = op - offset;
+        while (match_length > 0) {
+            uint32_t n = std::min<uint32_t>(op - match, match_length);
+            std::memcpy(op, match, n);
+            op += n;
+            match_length -= n;
+        }
+    }
+}
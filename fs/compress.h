@@ -0,0 +1,28 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <cstdint>
+
+// Byte oriented LZ77 codec in the style of LZ4, used for the clusters of
+// compressed files. The output is a list of sequences:
+//
+//   token        high 4 bits literal count, low 4 bits match length - 4;
+//                15 means the count goes on in the following bytes
+//   [count]      bytes of 255 ended by one below 255, added to the field
+//   literals
+//   offset       2 bytes little endian, distance back to the match (1 - 65535)
+//   [count]      rest of the match length
+//
+// The last sequence has literals only and ends the input. Matches are found
+// with a hash table of 4 byte prefixes and taken greedily, which is fast on
+// both sides and gets text and JSON down to a fraction of their size.
+
+// Compresses length bytes of in into out and returns the compressed length, or
+// 0 when it does not fit in capacity bytes.
+uint32_t lzCompress(const char* in, uint32_t length, char* out, uint32_t capacity);
+
+// Decompresses length bytes of in, which must give exactly raw_length bytes,
+// into out. Returns false when the input is damaged.
+bool lzDecompress(const char* in, uint32_t length, char* out, uint32_t raw_length);
+
+#endif
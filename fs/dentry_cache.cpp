@@ -0,0 +1,69 @@
+#include <cstring>
+#include "dentry_cache.h"
+
+std::string DentryCache::key(uint32_t dir_index, const std::string& name) {
+
+    std::string result(sizeof(dir_index) + name.size(), '\0');
+    std::memcpy(&result[0], &dir_index, sizeof(dir_index));
+    std::memcpy(&result[sizeof(dir_index)], name.data(), name.size());
+
+    return result;
+}
+
+bool DentryCache::find(uint32_t dir_index, const std::string& name, int64_t* inode) {
+
+    auto it = entries.find(key(dir_index, name));
+    if (it == entries.end()) {
+        return false;
+    }
+
+    lru.splice(lru.begin(), lru, it->second.pos);
+    *inode = it->second.inode;
+
+    return true;
+}
+
+void DentryCache::insert(uint32_t dir_index, const std::string& name, int64_t inode) {
+
+    std::string k = key(dir_index, name);
+    auto it = entries.find(k);
+
+    if (it != entries.end()) {
+        it->second.inode = inode;
+        lru.splice(lru.begin(), lru, it->second.pos);
+        return;
+    }
+
+    lru.push_front(k);
+    entries[k] = { inode, lru.begin() };
+
+    if (entries.size() > capacity) {
+        entries.erase(lru.back());
+        lru.pop_back();
+    }
+
+}
+
+void DentryCache::purgeDirectory(uint32_t dir_index) {
+
+    for (auto it = lru.begin(); it != lru.end();) {
+
+        uint32_t owner;
+        std::memcpy(&owner, it->data(), sizeof(owner));
+
+        if (owner == dir_index) {
+            entries.erase(*it);
+            it = lru.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+}
+
+void DentryCache::clear() {
+
+    entries.clear();
+    lru.clear();
+
+}
@@ -0,0 +1,39 @@
+#ifndef DENTRY_CACHE_H
+#define DENTRY_CACHE_H
+
+#include <cstdint>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+// Name lookup cache: (directory inode, name) -> inode. Misses are cached too
+// (as NEGATIVE), so a failing lookup does not scan the directory again.
+class DentryCache {
+public:
+    static const int64_t NEGATIVE = -1;
+
+private:
+    struct Entry {
+        int64_t inode;
+        std::list<std::string>::iterator pos;
+    };
+
+    uint32_t capacity;
+    std::unordered_map<std::string, Entry> entries;
+    std::list<std::string> lru;                         // Front is most recently used
+
+    static std::string key(uint32_t dir_index, const std::string& name);
+
+public:
+    explicit DentryCache(uint32_t capacity_) : capacity(capacity_) {}
+
+    // Returns true on a hit and stores the inode (or NEGATIVE) in *inode
+    bool find(uint32_t dir_index, const std::string& name, int64_t* inode);
+    void insert(uint32_t dir_index, const std::string& name, int64_t inode);
+
+    // Drops every entry of a directory which is being removed
+    void purgeDirectory(uint32_t dir_index);
+    void clear();
+};
+
+#endif
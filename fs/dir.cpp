@@ -0,0 +1,448 @@
+#include "fs.h"
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+
+// Hashed directory format (extendible hashing).
+//
+// Logical block 0 of a directory is a DirHeader. It names the table blocks,
+// which together hold 2^global_depth slots; slot (hash & (2^global_depth - 1))
+// holds the logical block of the leaf for that hash. Several slots may share a
+// leaf whose local_depth is lower than global_depth. A leaf is a block of
+// DirEntry slots whose slot 0 is a DirLeafHeader.
+//
+// A lookup reads the header, one table block and one leaf, no matter how many
+// entries the directory holds. A full leaf is split in two (doubling the table
+// first when its local depth has reached the global depth).
+
+#define DIR_MAGIC 0x44495248
+#define TABLE_SLOTS 1024                                // Slots per table block
+#define MAX_TABLE_BLOCKS 1016
+
+namespace {
+
+struct DirHeader {
+    uint32_t magic;
+    uint32_t self;                                      // Inode of this directory ('.')
+    uint32_t parent;                                    // Inode of the parent directory ('..')
+    uint32_t global_depth;
+    uint32_t entry_count;
+    uint32_t table_count;                               // Table blocks in use
+    uint32_t pad[2];
+    uint32_t table[MAX_TABLE_BLOCKS];                   // Logical block of each table block
+};
+
+struct DirLeafHeader {
+    uint32_t local_depth;
+    uint32_t count;
+    uint8_t pad[56];
+};
+
+static_assert(sizeof(DirHeader) == 4096, "DirHeader must fill one block");
+static_assert(sizeof(DirLeafHeader) == sizeof(DirEntry), "DirLeafHeader must fill one entry slot");
+
+// FNV-1a with a final avalanche, the low bits pick the table slot
+uint32_t hashName(const char* name, size_t len) {
+
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= static_cast<uint8_t>(name[i]);
+        hash *= 16777619u;
+    }
+
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+
+    return hash;
+}
+
+}
+
+uint32_t FileSystem::dirBlock(const Inode& dir, uint32_t logical) {
+
+    uint32_t disk_block = 0;
+    mapBlocks(dir, logical, 1, &disk_block);
+
+    if (disk_block == 0) {
+        throw std::runtime_error(std::string("Directory block is not mapped: ") + std::to_string(logical));
+    }
+
+    return disk_block;
+}
+
+uint32_t FileSystem::appendDirBlock(uint32_t dir_index, Inode& dir) {
+
+    uint32_t logical = dir.size / super_cache.block_size;
+
+    int64_t goal = dataGoal(dir_index);
+    if (logical > 0) {
+        goal = dirBlock(dir, logical - 1) + 1;
+    }
+
+    uint32_t disk_block = allocateDataBlocks(1, goal)[0].start;
+    assignBlocks(dir, { { logical, disk_block } });
+    invalidateBlockMaps(dir_index, logical);
+
+    char buffer[4096];
+    std::memset(buffer, 0, sizeof(buffer));
+    disk.writeBlock(disk_block, buffer);
+
+    dir.size += super_cache.block_size;
+
+    return logical;
+}
+
+void FileSystem::initDirectory(uint32_t dir_index, Inode& dir, uint32_t parent_index) {
+
+    // Step 1: Header, one table block and one leaf at depth 0
+    uint32_t header_logical = appendDirBlock(dir_index, dir);
+    uint32_t table_logical = appendDirBlock(dir_index, dir);
+    uint32_t leaf_logical = appendDirBlock(dir_index, dir);
+
+    char buffer[4096];
+
+    // Step 2: Header
+    std::memset(buffer, 0, sizeof(buffer));
+    DirHeader* header = reinterpret_cast<DirHeader*>(buffer);
+    header->magic = DIR_MAGIC;
+    header->self = dir_index;
+    header->parent = parent_index;
+    header->global_depth = 0;
+    header->entry_count = 0;
+    header->table_count = 1;
+    header->table[0] = table_logical;
+    disk.writeBlock(dirBlock(dir, header_logical), buffer);
+
+    // Step 3: The single slot points at the leaf
+    std::memset(buffer, 0, sizeof(buffer));
+    reinterpret_cast<uint32_t*>(buffer)[0] = leaf_logical;
+    disk.writeBlock(dirBlock(dir, table_logical), buffer);
+
+    // Leaf block was zeroed by appendDirBlock: local depth 0, no entries
+
+}
+
+uint32_t FileSystem::leafFor(const Inode& dir, uint32_t hash) {
+
+    BlockView header_view = disk.viewBlock(dirBlock(dir, 0));
+    const DirHeader* header = reinterpret_cast<const DirHeader*>(header_view.data());
+
+    if (header->magic != DIR_MAGIC) {
+        throw std::runtime_error(std::string("Directory header is corrupt"));
+    }
+
+    uint32_t slot = hash & ((1u << header->global_depth) - 1);
+
+    BlockView table = disk.viewBlock(dirBlock(dir, header->table[slot / TABLE_SLOTS]));
+    return reinterpret_cast<const uint32_t*>(table.data())[slot % TABLE_SLOTS];
+}
+
+int64_t FileSystem::lookupEntry(const Inode& dir, const std::string& name) {
+
+    uint32_t hash = hashName(name.data(), name.length());
+
+    BlockView leaf = disk.viewBlock(dirBlock(dir, leafFor(dir, hash)));
+    const DirEntry* entries = reinterpret_cast<const DirEntry*>(leaf.data());
+    uint32_t entries_per_block = super_cache.block_size / sizeof(DirEntry);
+
+    Stats& stats = disk.getStats();
+    stats.add(Stats::DIR_LOOKUPS);
+
+    // The stored hash rules out almost every other entry without touching its name
+    uint32_t compared = 0;
+    int64_t found = -1;
+
+    for (uint32_t j = 1; j < entries_per_block; ++j) {
+
+        if (entries[j].inode == 0) {
+            continue;
+        }
+
+        ++compared;
+
+        if (entries[j].hash == hash &&
+            entries[j].name_len == name.length() &&
+            std::memcmp(entries[j].name, name.data(), name.length()) == 0) {
+            found = entries[j].inode;
+            break;
+        }
+    }
+
+    stats.add(Stats::DIR_ENTRIES_COMPARED, compared);
+    stats.record(Stats::ENTRIES_PER_LOOKUP, compared);
+
+    return found;
+}
+
+void FileSystem::doubleDirTable(uint32_t dir_index, Inode& dir) {
+
+    char buffer[4096];
+    char table[4096];
+
+    disk.readBlock(dirBlock(dir, 0), buffer);
+    DirHeader* header = reinterpret_cast<DirHeader*>(buffer);
+
+    uint32_t old_slots = 1u << header->global_depth;
+
+    if (old_slots < TABLE_SLOTS) {
+
+        // Still inside the first table block: the upper half copies the lower half
+        uint32_t table_block = dirBlock(dir, header->table[0]);
+        disk.readBlock(table_block, table);
+
+        uint32_t* slots = reinterpret_cast<uint32_t*>(table);
+        std::memcpy(slots + old_slots, slots, old_slots * sizeof(uint32_t));
+
+        disk.writeBlock(table_block, table);
+
+    } else {
+
+        uint32_t old_count = header->table_count;
+
+        if (old_count * 2 > MAX_TABLE_BLOCKS) {
+            throw std::runtime_error(std::string("Directory is full."));
+        }
+
+        // Whole table blocks are copied into new blocks appended to the directory
+        for (uint32_t i = 0; i < old_count; ++i) {
+            uint32_t logical = appendDirBlock(dir_index, dir);
+            disk.readBlock(dirBlock(dir, header->table[i]), table);
+            disk.writeBlock(dirBlock(dir, logical), table);
+            header->table[old_count + i] = logical;
+        }
+
+        header->table_count = old_count * 2;
+    }
+
+    header->global_depth += 1;
+    disk.writeBlock(dirBlock(dir, 0), buffer);
+
+}
+
+void FileSystem::splitDirLeaf(uint32_t dir_index, Inode& dir, uint32_t hash) {
+
+    uint32_t entries_per_block = super_cache.block_size / sizeof(DirEntry);
+
+    uint32_t old_logical = leafFor(dir, hash);
+    uint32_t new_logical = appendDirBlock(dir_index, dir);
+
+    char old_buffer[4096];
+    char new_buffer[4096];
+
+    uint32_t old_block = dirBlock(dir, old_logical);
+    uint32_t new_block = dirBlock(dir, new_logical);
+
+    disk.readBlock(old_block, old_buffer);
+    std::memset(new_buffer, 0, sizeof(new_buffer));
+
+    DirEntry* old_entries = reinterpret_cast<DirEntry*>(old_buffer);
+    DirEntry* new_entries = reinterpret_cast<DirEntry*>(new_buffer);
+    DirLeafHeader* old_header = reinterpret_cast<DirLeafHeader*>(old_buffer);
+    DirLeafHeader* new_header = reinterpret_cast<DirLeafHeader*>(new_buffer);
+
+    uint32_t depth = old_header->local_depth;
+    uint32_t bit = 1u << depth;
+
+    // Step 1: Entries whose hash has the next bit set move to the new leaf
+    uint32_t next = 1;
+    for (uint32_t j = 1; j < entries_per_block; ++j) {
+
+        if (old_entries[j].inode != 0 && (old_entries[j].hash & bit)) {
+            new_entries[next++] = old_entries[j];
+            std::memset(&old_entries[j], 0, sizeof(DirEntry));
+            old_header->count -= 1;
+            new_header->count += 1;
+        }
+    }
+
+    old_header->local_depth = depth + 1;
+    new_header->local_depth = depth + 1;
+
+    disk.writeBlock(old_block, old_buffer);
+    disk.writeBlock(new_block, new_buffer);
+
+    // Step 2: Slots which pointed at the old leaf and have the bit set now point at the new one
+    char header_buffer[4096];
+    disk.readBlock(dirBlock(dir, 0), header_buffer);
+    DirHeader* header = reinterpret_cast<DirHeader*>(header_buffer);
+
+    uint32_t num_slots = 1u << header->global_depth;
+    char table[4096];
+    uint32_t loaded = UINT32_MAX;
+
+    for (uint32_t slot = (hash & (bit - 1)) | bit; slot < num_slots; slot += bit << 1) {
+
+        uint32_t table_index = slot / TABLE_SLOTS;
+
+        if (table_index != loaded) {
+            if (loaded != UINT32_MAX) {
+                disk.writeBlock(dirBlock(dir, header->table[loaded]), table);
+            }
+            disk.readBlock(dirBlock(dir, header->table[table_index]), table);
+            loaded = table_index;
+        }
+
+        reinterpret_cast<uint32_t*>(table)[slot % TABLE_SLOTS] = new_logical;
+    }
+
+    if (loaded != UINT32_MAX) {
+        disk.writeBlock(dirBlock(dir, header->table[loaded]), table);
+    }
+
+}
+
+bool FileSystem::addEntry(uint32_t dir_index, Inode& dir, const std::string& name, uint32_t inode_index) {
+
+    if (name.empty() || name.length() > MAX_NAME_LEN) {
+        return false;
+    }
+
+    if (lookupEntry(dir, name) >= 0) {
+        return false;
+    }
+
+    uint32_t hash = hashName(name.data(), name.length());
+    uint32_t entries_per_block = super_cache.block_size / sizeof(DirEntry);
+    char buffer[4096];
+
+    while (true) {
+
+        uint32_t leaf_block = dirBlock(dir, leafFor(dir, hash));
+        disk.readBlock(leaf_block, buffer);
+
+        DirLeafHeader* leaf_header = reinterpret_cast<DirLeafHeader*>(buffer);
+        DirEntry* entries = reinterpret_cast<DirEntry*>(buffer);
+
+        if (leaf_header->count < entries_per_block - 1) {
+
+            for (uint32_t j = 1; j < entries_per_block; ++j) {
+
+                if (entries[j].inode == 0) {
+
+                    entries[j].inode = inode_index;
+                    entries[j].name_len = name.length();
+                    std::memset(entries[j].name, 0, MAX_NAME_LEN);
+                    std::memcpy(entries[j].name, name.data(), name.length());
+                    entries[j].hash = hash;
+                    break;
+                }
+            }
+
+            leaf_header->count += 1;
+            disk.writeBlock(leaf_block, buffer);
+            break;
+        }
+
+        // Leaf is full: make room and look the leaf up again
+        char header_buffer[4096];
+        disk.readBlock(dirBlock(dir, 0), header_buffer);
+        uint32_t global_depth = reinterpret_cast<DirHeader*>(header_buffer)->global_depth;
+
+        if (leaf_header->local_depth >= 31) {
+            throw std::runtime_error(std::string("Directory is full."));
+        }
+
+        if (leaf_header->local_depth == global_depth) {
+            doubleDirTable(dir_index, dir);
+        }
+
+        splitDirLeaf(dir_index, dir, hash);
+    }
+
+    disk.readBlock(dirBlock(dir, 0), buffer);
+    reinterpret_cast<DirHeader*>(buffer)->entry_count += 1;
+    disk.writeBlock(dirBlock(dir, 0), buffer);
+
+    return true;
+}
+
+int64_t FileSystem::removeEntry(const Inode& dir, const std::string& name) {
+
+    uint32_t hash = hashName(name.data(), name.length());
+    uint32_t entries_per_block = super_cache.block_size / sizeof(DirEntry);
+    char buffer[4096];
+
+    uint32_t leaf_block = dirBlock(dir, leafFor(dir, hash));
+    disk.readBlock(leaf_block, buffer);
+
+    DirLeafHeader* leaf_header = reinterpret_cast<DirLeafHeader*>(buffer);
+    DirEntry* entries = reinterpret_cast<DirEntry*>(buffer);
+
+    for (uint32_t j = 1; j < entries_per_block; ++j) {
+
+        if (entries[j].inode != 0 && entries[j].hash == hash &&
+            entries[j].name_len == name.length() &&
+            std::memcmp(entries[j].name, name.data(), name.length()) == 0) {
+
+            uint32_t inode_index = entries[j].inode;
+
+            std::memset(&entries[j], 0, sizeof(DirEntry));
+            leaf_header->count -= 1;
+            disk.writeBlock(leaf_block, buffer);
+
+            disk.readBlock(dirBlock(dir, 0), buffer);
+            reinterpret_cast<DirHeader*>(buffer)->entry_count -= 1;
+            disk.writeBlock(dirBlock(dir, 0), buffer);
+
+            return inode_index;
+        }
+    }
+
+    return -1;
+}
+
+std::vector<DirEntry> FileSystem::readDirectory(const Inode& dir) {
+
+    std::vector<DirEntry> result;
+    uint32_t entries_per_block = super_cache.block_size / sizeof(DirEntry);
+    uint32_t num_blocks = dir.size / super_cache.block_size;
+
+    std::vector<bool> is_table(num_blocks, false);
+    is_table[0] = true;
+
+    {
+        BlockView header_view = disk.viewBlock(dirBlock(dir, 0));
+        const DirHeader* header = reinterpret_cast<const DirHeader*>(header_view.data());
+
+        for (uint32_t i = 0; i < header->table_count; ++i) {
+            is_table[header->table[i]] = true;
+        }
+    }
+
+    std::vector<uint32_t> disk_blocks(num_blocks);
+    mapBlocks(dir, 0, num_blocks, disk_blocks.data());
+
+    for (uint32_t logical = 0; logical < num_blocks; ++logical) {
+
+        if (is_table[logical]) {
+            continue;
+        }
+
+        BlockView leaf = disk.viewBlock(disk_blocks[logical]);
+        const DirEntry* entries = reinterpret_cast<const DirEntry*>(leaf.data());
+
+        for (uint32_t j = 1; j < entries_per_block; ++j) {
+            if (entries[j].inode != 0) {
+                result.push_back(entries[j]);
+            }
+        }
+    }
+
+    return result;
+}
+
+uint32_t FileSystem::dirEntryCount(const Inode& dir) {
+
+    BlockView header_view = disk.viewBlock(dirBlock(dir, 0));
+    return reinterpret_cast<const DirHeader*>(header_view.data())->entry_count;
+}
+
+uint32_t FileSystem::dirParent(const Inode& dir) {
+
+    BlockView header_view = disk.viewBlock(dirBlock(dir, 0));
+    return reinterpret_cast<const DirHeader*>(header_view.data())->parent;
+}
@@ -1,43 +1,148 @@
 #include "fs.h"
+#include "compress.h"
 #include <string>
 #include <cstring>
 #include <algorithm>
 #include <iostream>
+#include <vector>
+#include <map>
+#include <thread>
+#include <climits>
+#include <cstddef>
+#include <condition_variable>
+#include <set>
+#include <tuple>
+#include <cerrno>
+#include <fcntl.h>          // For posix_fadvise
+#include <unistd.h>         // For read
 
 #define BLOCK_SIZE 4096
-#define TOTAL_BLOCKS 131072
-#define MAGIC 0x12345678
-#define TOTAL_INODES 65536
+#define MAGIC 0x1234567A
+
+#define BLOCKS_PER_GROUP 32768
+#define INODES_PER_GROUP 16384
 
 #define SUPERBLOCK 0
-#define INODE_BITMAP_START 1
-#define INODE_BITMAP_END 2
-#define DATA_BITMAP_START 3
-#define DATA_BITMAP_END 6
-#define INODE_DATA_START 7
-#define INODE_DATA_END 2054
-#define FIRST_DATA_BLOCK 2055
+#define GROUP_DESC_START 1
+#define JOURNAL_BLOCKS 4096
+
+static_assert(sizeof(Inode) == 128, "Inode must stay 128 bytes");
+static_assert(sizeof(GroupDesc) == 32, "GroupDesc must stay 32 bytes");
+static_assert(offsetof(Inode, indirect_blocks) == offsetof(Inode, direct_blocks) + sizeof(Inode::direct_blocks),
+              "Inline data runs from direct_blocks on through indirect_blocks");
+
+#define INLINE_HEAD (sizeof(Inode::direct_blocks) + sizeof(Inode::indirect_blocks))
+
+// What holes read as
+static const char zero_block[4096] = {};
+
+static void writeAll(int host_fd, const char* data, uint64_t length) {
+
+    while (length > 0) {
+
+        ssize_t done = ::write(host_fd, data, length);
+
+        if (done < 0) {
+            if (errno == EINTR) continue;
+            throw std::runtime_error(std::string("write() was failed: ") + std::strerror(errno));
+        }
+
+        data += done;
+        length -= done;
+    }
+
+}
+
+static void writeZeroes(int host_fd, uint64_t length) {
+
+    while (length > 0) {
+        uint64_t n = std::min<uint64_t>(length, sizeof(zero_block));
+        writeAll(host_fd, zero_block, n);
+        length -= n;
+    }
+
+}
+
 
 #define DISKPATH "vdisk.img"
 
-void mkfs(std::string diskImagePath) {
+// Writes superblock, group descriptors, bitmaps, an empty journal and an empty
+// root inode. Nothing else is written: inode table blocks are cleared when
+// they are first written back and data blocks when they are allocated.
+static void formatMetadata(std::string diskImagePath) {
 
     DiskManager disk(diskImagePath);
     disk.formatDisk();
 
+    uint32_t table_blocks = INODES_PER_GROUP / (BLOCK_SIZE / sizeof(Inode));
+
+    // Geometry follows the image: as many groups as it holds, a short last
+    // group is kept only when it has room for more than its own metadata
+    uint64_t total_blocks = disk.getNumBlocks();
+    uint64_t group_count = (total_blocks + BLOCKS_PER_GROUP - 1) / BLOCKS_PER_GROUP;
+    uint64_t last_group_blocks = total_blocks - (group_count - 1) * BLOCKS_PER_GROUP;
+
+    if (group_count > 1 && last_group_blocks < 4 * (2 + table_blocks)) {
+        --group_count;
+        total_blocks = group_count * BLOCKS_PER_GROUP;
+    }
+
+    uint32_t desc_blocks = (group_count * sizeof(GroupDesc) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint64_t group0_metadata = GROUP_DESC_START + desc_blocks + 2 + table_blocks + JOURNAL_BLOCKS;
+
+    if (std::min<uint64_t>(total_blocks, BLOCKS_PER_GROUP) <= group0_metadata) {
+        throw std::invalid_argument(std::string("Disk image is too small, it needs more than ") + std::to_string(group0_metadata) + " blocks: " + diskImagePath);
+    }
+
     // Making Superblock and writing it onto disk on first block
     Superblock super;
+    std::memset(&super, 0, sizeof(Superblock));
     super.magic = MAGIC;
+    super.version = FS_VERSION;
+    super.features = FS_FEATURE_INLINE_DATA | FS_FEATURE_COMPRESSION;
     super.block_size = BLOCK_SIZE;
-    super.total_blocks = TOTAL_BLOCKS;
-    super.total_inodes = TOTAL_INODES;
-    super.data_bitmap_start = DATA_BITMAP_START;
-    super.data_bitmap_count = DATA_BITMAP_END - DATA_BITMAP_START + 1;
-    super.inode_bitmap_start = INODE_BITMAP_START;
-    super.inode_bitmap_count = INODE_BITMAP_END - INODE_BITMAP_START + 1;
-    super.inode_table_start = INODE_DATA_START;
-    super.inode_table_count = INODE_DATA_END - INODE_DATA_START + 1;
-    super.first_data_block = FIRST_DATA_BLOCK;
+    super.total_blocks = total_blocks;
+    super.total_inodes = group_count * INODES_PER_GROUP;
+    super.blocks_per_group = BLOCKS_PER_GROUP;
+    super.inodes_per_group = INODES_PER_GROUP;
+    super.group_count = group_count;
+    super.group_desc_start = GROUP_DESC_START;
+    super.group_desc_blocks = desc_blocks;
+
+    // Step 1: Lay out the groups, group 0 also holds the superblock, the
+    // descriptor table and the journal
+    std::vector<GroupDesc> groups(group_count);
+    std::memset(groups.data(), 0, group_count * sizeof(GroupDesc));
+
+    for (uint32_t g = 0; g < group_count; ++g) {
+
+        uint32_t next = g * BLOCKS_PER_GROUP;
+        if (g == 0) {
+            next = GROUP_DESC_START + desc_blocks;
+        }
+
+        groups[g].block_bitmap = next++;
+        groups[g].inode_bitmap = next++;
+        groups[g].inode_table = next;
+        next += table_blocks;
+
+        if (g == 0) {
+            super.journal_start = next;
+            super.journal_count = JOURNAL_BLOCKS;
+            next += JOURNAL_BLOCKS;
+        }
+
+        groups[g].first_data_block = next;
+
+        // The root inode is the only one in use
+        groups[g].free_blocks = std::min<uint64_t>(static_cast<uint64_t>(g + 1) * BLOCKS_PER_GROUP, total_blocks) - next;
+        groups[g].free_inodes = g == 0 ? INODES_PER_GROUP - 1 : INODES_PER_GROUP;
+
+        super.free_blocks += groups[g].free_blocks;
+        super.free_inodes += groups[g].free_inodes;
+    }
+
+    super.state = FS_CLEAN;
 
     char buffer[4096];
 
@@ -45,63 +150,67 @@ void mkfs(std::string diskImagePath) {
     std::memcpy(buffer, &super, sizeof(Superblock));
     disk.writeBlock(SUPERBLOCK, buffer);
 
-    // Set Inode bitmap blocks to 0
-    std::memset(buffer, 0, sizeof(buffer));
-    for (int i = INODE_BITMAP_START; i <= INODE_BITMAP_END; ++i) {
-        disk.writeBlock(i, buffer);
+    // The descriptor table is padded with zeroes to whole blocks
+    groups.resize(desc_blocks * (BLOCK_SIZE / sizeof(GroupDesc)));
+    for (uint32_t i = 0; i < desc_blocks; ++i) {
+        disk.writeBlock(GROUP_DESC_START + i, groups.data() + i * (BLOCK_SIZE / sizeof(GroupDesc)));
     }
 
-    // Set Data bitmap blocks to 1 and 0
-    std::memset(buffer, 0, sizeof(buffer));
-    for(uint32_t i = 0; i <= FIRST_DATA_BLOCK; ++i) {
-        buffer[i / 8] |= (1 << (i % 8));
-    }
+    // Step 2: Data bitmaps mark the metadata blocks at the front of each group as used
+    for (uint32_t g = 0; g < group_count; ++g) {
 
-    disk.writeBlock(DATA_BITMAP_START, buffer);
-    std::memset(buffer, 0, sizeof(buffer));
-    for (uint32_t i = DATA_BITMAP_START + 1; i <= DATA_BITMAP_END; ++i) {
-        disk.writeBlock(i, buffer);
-    }
+        std::memset(buffer, 0, sizeof(buffer));
+        for (uint32_t i = 0; i < groups[g].first_data_block - g * BLOCKS_PER_GROUP; ++i) {
+            buffer[i / 8] |= (1 << (i % 8));
+        }
+        disk.writeBlock(groups[g].block_bitmap, buffer);
 
-    // Set inode bitmap first bit to 1 for root Inode
-    std::memset(buffer, 0, sizeof(buffer));
-    buffer[0] |= 1;
-    disk.writeBlock(INODE_BITMAP_START, buffer);
+        // Set inode bitmap first bit to 1 for root Inode
+        std::memset(buffer, 0, sizeof(buffer));
+        if (g == 0) {
+            buffer[0] |= 1;
+        }
+        disk.writeBlock(groups[g].inode_bitmap, buffer);
+    }
 
     // Making rootInode and writing it in first Inode Data block
     Inode rootInode;
     std::memset(&rootInode, 0, sizeof(Inode));
     rootInode.mode = 0; // 0 for Directory, 1 for File
-    rootInode.size = 2 * sizeof(DirEntry);
-    rootInode.direct_blocks[0] = FIRST_DATA_BLOCK;
+    rootInode.size = 0;
     rootInode.ref_count = 2;
 
     std::memset(buffer, 0, sizeof(buffer));
     std::memcpy(buffer, &rootInode, sizeof(rootInode));
-    disk.writeBlock(INODE_DATA_START, buffer);
+    disk.writeBlock(groups[0].inode_table, buffer);
 
-    // Making Directory Entries for root Inode and writing them into Data block
-    std::memset(buffer, 0, sizeof(buffer));
-    DirEntry* dirEntries = reinterpret_cast<DirEntry*>(buffer);
+    disk.formatJournal(super.journal_start, super.journal_count);
+
+    disk.sync();
+
+}
+
+
+void mkfs(std::string diskImagePath) {
 
-    dirEntries[0].inode = 0;
-    dirEntries[0].name_len = 1;
-    std::memcpy(dirEntries[0].name, ".", 1);
-    dirEntries[0].pad = 0;
+    formatMetadata(diskImagePath);
 
-    dirEntries[1].inode = 0;
-    dirEntries[1].name_len = 2;
-    std::memcpy(dirEntries[1].name, "..", 2);
-    dirEntries[1].pad = 0;
+    // Root directory blocks are laid out by the directory code, which needs a mounted filesystem
+    FileSystem* file_system = mount(diskImagePath);
 
-    disk.writeBlock(FIRST_DATA_BLOCK, buffer);
+    Inode root = file_system->readInode(0);
+    file_system->initDirectory(0, root, 0);
+    file_system->writeInode(0, root);
+
+    file_system->unmount();
+    delete file_system;
 
 }
 
 
-FileSystem* mount(std::string diskImagePath) {
+FileSystem* mount(std::string diskImagePath, DiskBackend backend) {
 
-    FileSystem* file_system = new FileSystem(diskImagePath);
+    FileSystem* file_system = new FileSystem(diskImagePath, backend);
 
     char buffer[4096];
     file_system->disk.readBlock(SUPERBLOCK, buffer);
@@ -112,6 +221,40 @@ FileSystem* mount(std::string diskImagePath) {
         throw std::invalid_argument(std::string("Invalid magic number of disk: ") + diskImagePath);
     }
 
+    if (file_system->super_cache.version != FS_VERSION) {
+        uint32_t version = file_system->super_cache.version;
+        delete file_system;
+        throw std::invalid_argument(std::string("Unsupported filesystem version ") + std::to_string(version) + ", run mkfs again: " + diskImagePath);
+    }
+
+    if ((file_system->super_cache.features & ~FS_FEATURES_SUPPORTED) != 0) {
+        delete file_system;
+        throw std::invalid_argument(std::string("Disk uses unsupported features: ") + diskImagePath);
+    }
+
+    if (file_system->super_cache.journal_count == 0) {
+        delete file_system;
+        throw std::invalid_argument(std::string("Disk has no journal, run mkfs again: ") + diskImagePath);
+    }
+
+    // Replay may rewrite any metadata block, the superblock included
+    try {
+        file_system->disk.enableJournal(file_system->super_cache.journal_start, file_system->super_cache.journal_count);
+    } catch (...) {
+        delete file_system;
+        throw;
+    }
+
+    file_system->disk.readBlock(SUPERBLOCK, buffer);
+    std::memcpy(&file_system->super_cache, buffer, sizeof(Superblock));
+
+    try {
+        file_system->loadBitmaps();
+    } catch (...) {
+        delete file_system;
+        throw;
+    }
+
     file_system->isMounted = true;
     return file_system;
 
@@ -128,335 +271,2266 @@ Inode FileSystem::readInode(uint32_t inode_index) {
         throw std::invalid_argument(std::string("Invalid inode index: ") + std::to_string(inode_index));
     }
 
-    uint32_t inode_bitmap_block = super_cache.inode_bitmap_start + (inode_index  / (super_cache.block_size * 8));
-    uint32_t inode_bitmap_bit = inode_index % (super_cache.block_size * 8);
-
-    char buffer[4096];
+    if (!inodeAllocated(inode_index)) {
+        throw std::runtime_error(std::string("Invalid Inode index: Inode is unallocated - ") + std::to_string(inode_index));
+    }
 
-    disk.readBlock(inode_bitmap_block, buffer);
+    InodeShard& shard = inodeShard(inode_index);
 
-    if((buffer[inode_bitmap_bit / 8] & (1 << (inode_bitmap_bit % 8))) == 0) {
-        throw std::runtime_error(std::string("Invalid Inode index: Inode is unallocated - ") + std::to_string(inode_index));
+    {
+        std::lock_guard<std::mutex> guard(shard.lock);
+        Inode* cached = shard.cache.get(inode_index);
+        if (cached != nullptr) {
+            return *cached;
+        }
     }
 
     uint32_t inode_per_block = super_cache.block_size / sizeof(Inode);
-    uint32_t inode_block = super_cache.inode_table_start + (inode_index / inode_per_block);
+    uint32_t inode_block = inodeBlock(inode_index);
     uint32_t inode_offset = sizeof(Inode) * (inode_index % inode_per_block);
 
-    disk.readBlock(inode_block, buffer);
+    // Only the 128 bytes of this inode are copied out of the table block
+    BlockView table = disk.viewBlock(inode_block);
     Inode inode;
-    std::memcpy(&inode, buffer + inode_offset, sizeof(Inode));
+    std::memcpy(&inode, table.data() + inode_offset, sizeof(Inode));
+
+    {
+        // Another thread may have cached (and changed) the inode meanwhile, its copy wins
+        std::lock_guard<std::mutex> guard(shard.lock);
+        Inode* cached = shard.cache.get(inode_index);
+        if (cached != nullptr) {
+            inode = *cached;
+        } else {
+            shard.cache.put(inode_index, inode);
+        }
+    }
+
+    evictInodes(shard);
 
     return inode;
 }
 
 
-void FileSystem::writeInode(uint32_t inode_index, Inode inode) {
+void FileSystem::writeInode(uint32_t inode_index, Inode inode) {
+
+    if (!isMounted) {
+        throw std::runtime_error(std::string("disk is not mounted yet. Invalid writeInode call"));
+    }
+
+    if (inode_index >= super_cache.total_inodes) {
+        throw std::invalid_argument(std::string("Invalid inode index: ") + std::to_string(inode_index));
+    }
+
+    if (!inodeAllocated(inode_index)) {
+        throw std::runtime_error(std::string("Invalid Inode index: Inode is unallocated - ") + std::to_string(inode_index));
+    }
+
+    // The inode table block is only touched when the inode is written back
+    InodeShard& shard = inodeShard(inode_index);
+
+    {
+        std::lock_guard<std::mutex> guard(shard.lock);
+        shard.cache.put(inode_index, inode);
+        shard.cache.markDirty(inode_index);
+    }
+
+    evictInodes(shard);
+
+}
+
+
+void FileSystem::flushInodes() {
+
+    std::lock_guard<std::mutex> guard(flush_lock);
+    flushInodesLocked();
+
+}
+
+
+void FileSystem::flushInodesLocked() {
+
+    std::vector<uint32_t> dirty;
+
+    for (auto& shard : inode_shards) {
+        std::lock_guard<std::mutex> guard(shard->lock);
+        std::vector<uint32_t> shard_dirty = shard->cache.dirtyInodes();
+        dirty.insert(dirty.end(), shard_dirty.begin(), shard_dirty.end());
+    }
+
+    std::sort(dirty.begin(), dirty.end());
+
+    uint32_t inode_per_block = super_cache.block_size / sizeof(Inode);
+    char buffer[4096];
+
+    // Dirty inodes are sorted, so all inodes sharing a table block are patched
+    // into it together and the block is written once
+    for (size_t i = 0; i < dirty.size();) {
+
+        uint32_t inode_block = inodeBlock(dirty[i]);
+        disk.readBlock(inode_block, buffer);
+
+        // mkfs does not zero the inode tables, the slots of free inodes are
+        // cleared whenever their block is written
+        uint32_t first_in_block = dirty[i] - dirty[i] % inode_per_block;
+        for (uint32_t slot = 0; slot < inode_per_block; ++slot) {
+            if (!inodeAllocated(first_in_block + slot)) {
+                std::memset(buffer + slot * sizeof(Inode), 0, sizeof(Inode));
+            }
+        }
+
+        size_t j = i;
+        while (j < dirty.size() && inodeBlock(dirty[j]) == inode_block) {
+
+            // The inode may have been written back by an eviction or deleted since it was listed
+            InodeShard& shard = inodeShard(dirty[j]);
+            std::lock_guard<std::mutex> guard(shard.lock);
+
+            Inode* cached = shard.cache.get(dirty[j]);
+            if (cached != nullptr && shard.cache.isDirty(dirty[j])) {
+                uint32_t inode_offset = sizeof(Inode) * (dirty[j] % inode_per_block);
+                std::memcpy(buffer + inode_offset, cached, sizeof(Inode));
+                shard.cache.markClean(dirty[j]);
+            }
+            ++j;
+        }
+
+        disk.writeBlock(inode_block, buffer);
+        i = j;
+    }
+
+}
+
+
+void FileSystem::evictInodes(InodeShard& shard) {
+
+    while (true) {
+
+        {
+            std::lock_guard<std::mutex> guard(shard.lock);
+
+            if (!shard.cache.overCapacity()) {
+                return;
+            }
+
+            int64_t victim = shard.cache.victim();
+            if (victim < 0) {
+                return;     // Everything is pinned by open files
+            }
+
+            if (!shard.cache.isDirty(victim)) {
+                shard.cache.erase(victim);
+                continue;
+            }
+        }
+
+        // Writing back in batches keeps table block writes rare
+        flushInodes();
+    }
+
+}
+
+
+void FileSystem::pinInode(uint32_t inode_index, const Inode& inode) {
+
+    InodeShard& shard = inodeShard(inode_index);
+    std::lock_guard<std::mutex> guard(shard.lock);
+
+    if (shard.cache.get(inode_index) == nullptr) {
+        shard.cache.put(inode_index, inode);
+    }
+
+    shard.cache.pin(inode_index);
+
+}
+
+
+void FileSystem::unpinInode(uint32_t inode_index) {
+
+    InodeShard& shard = inodeShard(inode_index);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    shard.cache.unpin(inode_index);
+
+}
+
+
+void FileSystem::dropInode(uint32_t inode_index) {
+
+    InodeShard& shard = inodeShard(inode_index);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    shard.cache.erase(inode_index);
+
+}
+
+void FileSystem::loadBitmaps() {
+
+    uint32_t desc_per_block = super_cache.block_size / sizeof(GroupDesc);
+
+    if (super_cache.group_count == 0 || super_cache.group_count > static_cast<uint64_t>(super_cache.group_desc_blocks) * desc_per_block
+        || super_cache.total_blocks > disk.getNumBlocks()) {
+        throw std::invalid_argument(std::string("Invalid group count: ") + std::to_string(super_cache.group_count));
+    }
+
+    // Step 1: Read the descriptor table, the padding after the last group included
+    groups.resize(static_cast<size_t>(super_cache.group_desc_blocks) * desc_per_block);
+    for (uint32_t i = 0; i < super_cache.group_desc_blocks; ++i) {
+        disk.readBlock(super_cache.group_desc_start + i, groups.data() + i * desc_per_block);
+    }
+
+    inode_locks.reset(new std::atomic<std::shared_mutex*>[super_cache.group_count]());
+
+    inode_bitmaps.reset(new Bitmap[super_cache.group_count]);
+    data_bitmaps.reset(new Bitmap[super_cache.group_count]);
+    group_loaded.reset(new std::atomic<bool>[super_cache.group_count]);
+
+    for (uint32_t g = 0; g < super_cache.group_count; ++g) {
+        group_loaded[g] = false;
+    }
+
+    // Step 2: After a clean unmount the summary is exact and no bitmap is read.
+    // Otherwise every bitmap is loaded and counted.
+    if (super_cache.state == FS_CLEAN) {
+        free_blocks = super_cache.free_blocks;
+        free_inodes = super_cache.free_inodes;
+    } else {
+
+        uint64_t blocks = 0;
+        uint64_t inodes = 0;
+
+        for (uint32_t g = 0; g < super_cache.group_count; ++g) {
+            loadGroup(g);
+            blocks += data_bitmaps[g].getFreeCount();
+            inodes += inode_bitmaps[g].getFreeCount();
+        }
+
+        free_blocks = blocks;
+        free_inodes = inodes;
+    }
+
+    // Step 3: Until the next clean unmount the summary on disk is not trusted
+    writeSummary(FS_DIRTY);
+
+}
+
+void FileSystem::loadGroup(uint32_t group) {
+
+    if (group_loaded[group].load(std::memory_order_acquire)) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(group_load_lock);
+
+    if (group_loaded[group].load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    uint32_t bits_per_block = super_cache.block_size * 8;
+    uint32_t group_start = group * super_cache.blocks_per_group;
+    uint32_t group_blocks = std::min<uint64_t>(super_cache.blocks_per_group, super_cache.total_blocks - group_start);
+
+    inode_bitmaps[group].load(disk, groups[group].inode_bitmap, (super_cache.inodes_per_group + bits_per_block - 1) / bits_per_block, super_cache.block_size, super_cache.inodes_per_group);
+    data_bitmaps[group].load(disk, groups[group].block_bitmap, (group_blocks + bits_per_block - 1) / bits_per_block, super_cache.block_size, group_blocks);
+
+    group_loaded[group].store(true, std::memory_order_release);
+
+}
+
+uint32_t FileSystem::groupFreeBlocks(uint32_t group) const {
+
+    // The descriptor's count is exact while the group is not loaded, nothing changes it then
+    if (group_loaded[group].load(std::memory_order_acquire)) {
+        return data_bitmaps[group].getFreeCount();
+    }
+
+    return groups[group].free_blocks;
+}
+
+uint32_t FileSystem::groupFreeInodes(uint32_t group) const {
+
+    if (group_loaded[group].load(std::memory_order_acquire)) {
+        return inode_bitmaps[group].getFreeCount();
+    }
+
+    return groups[group].free_inodes;
+}
+
+void FileSystem::writeSummary(uint32_t state) {
+
+    // Step 1: Descriptor blocks whose counts changed. groups keeps what was
+    // last written; the counts of groups which were never loaded cannot change.
+    uint32_t desc_per_block = super_cache.block_size / sizeof(GroupDesc);
+
+    for (uint32_t first = 0; first < super_cache.group_count; first += desc_per_block) {
+
+        bool changed = false;
+
+        for (uint32_t g = first; g < std::min(first + desc_per_block, super_cache.group_count); ++g) {
+
+            if (!group_loaded[g].load(std::memory_order_acquire)) {
+                continue;
+            }
+
+            uint32_t blocks = data_bitmaps[g].getFreeCount();
+            uint32_t inodes = inode_bitmaps[g].getFreeCount();
+
+            if (groups[g].free_blocks != blocks || groups[g].free_inodes != inodes) {
+                groups[g].free_blocks = blocks;
+                groups[g].free_inodes = inodes;
+                changed = true;
+            }
+        }
+
+        if (changed) {
+            disk.writeBlock(super_cache.group_desc_start + first / desc_per_block, groups.data() + first);
+        }
+    }
+
+    // Step 2: Superblock
+    super_cache.free_blocks = free_blocks;
+    super_cache.free_inodes = free_inodes;
+    super_cache.state = state;
+
+    char buffer[4096];
+    std::memset(buffer, 0, sizeof(buffer));
+    std::memcpy(buffer, &super_cache, sizeof(Superblock));
+    disk.writeBlock(SUPERBLOCK, buffer);
+
+}
+
+std::shared_mutex& FileSystem::inodeLock(uint32_t inode_index) {
+
+    if (inode_index >= super_cache.total_inodes) {
+        throw std::invalid_argument(std::string("Invalid inode index: ") + std::to_string(inode_index));
+    }
+
+    uint32_t g = groupOfInode(inode_index);
+    std::shared_mutex* locks = inode_locks[g].load(std::memory_order_acquire);
+
+    // The first thread to install the group's locks wins, the others drop theirs
+    if (locks == nullptr) {
+        std::shared_mutex* fresh = new std::shared_mutex[super_cache.inodes_per_group];
+        if (inode_locks[g].compare_exchange_strong(locks, fresh, std::memory_order_acq_rel)) {
+            locks = fresh;
+        } else {
+            delete[] fresh;
+        }
+    }
+
+    return locks[inode_index % super_cache.inodes_per_group];
+}
+
+FileSystem::~FileSystem() {
+
+    if (inode_locks) {
+        for (uint32_t g = 0; g < super_cache.group_count; ++g) {
+            delete[] inode_locks[g].load();
+        }
+    }
+
+}
+
+FsStat FileSystem::statfs() const {
+
+    FsStat stat;
+    stat.block_size = super_cache.block_size;
+    stat.total_blocks = super_cache.total_blocks;
+    stat.free_blocks = free_blocks.load(std::memory_order_relaxed) + pending_blocks.load(std::memory_order_relaxed);
+    stat.total_inodes = super_cache.total_inodes;
+    stat.free_inodes = free_inodes.load(std::memory_order_relaxed);
+
+    return stat;
+}
+
+bool FileSystem::inodeAllocated(uint32_t inode_index) {
+
+    loadGroup(groupOfInode(inode_index));
+    return inode_bitmaps[groupOfInode(inode_index)].test(inode_index % super_cache.inodes_per_group);
+
+}
+
+uint32_t FileSystem::inodeBlock(uint32_t inode_index) const {
+
+    uint32_t inode_per_block = super_cache.block_size / sizeof(Inode);
+    return groups[groupOfInode(inode_index)].inode_table + (inode_index % super_cache.inodes_per_group) / inode_per_block;
+
+}
+
+uint32_t FileSystem::homeGroup() const {
+
+    // Threads are spread over the groups, so concurrent allocations mostly
+    // work on different bitmap words and blocks
+    return std::hash<std::thread::id>()(std::this_thread::get_id()) % super_cache.group_count;
+
+}
+
+uint32_t FileSystem::pickDirectoryGroup() {
+
+    // New directories (and with them the files created in them) are spread
+    // over the groups: starting at a rotating group, take the first one with a
+    // free inode and at least the average number of free blocks
+    uint64_t average = free_blocks / super_cache.group_count;
+    uint32_t first = next_dir_group++ % super_cache.group_count;
+
+    for (uint32_t k = 0; k < super_cache.group_count; ++k) {
+
+        uint32_t g = (first + k) % super_cache.group_count;
+
+        if (groupFreeInodes(g) > 0 && groupFreeBlocks(g) >= average) {
+            return g;
+        }
+    }
+
+    return first;
+}
+
+int64_t FileSystem::dataGoal(uint32_t inode_index) const {
+
+    // The data area of the inode's group is cut into 16 stripes and each
+    // thread starts its files in its own stripe, so files written at the same
+    // time do not interleave their blocks
+    uint32_t g = groupOfInode(inode_index);
+    uint32_t group_end = std::min<uint64_t>(static_cast<uint64_t>(g + 1) * super_cache.blocks_per_group, super_cache.total_blocks);
+    uint32_t data_blocks = group_end - groups[g].first_data_block;
+    uint32_t stripe = std::hash<std::thread::id>()(std::this_thread::get_id()) % 16;
+
+    return groups[g].first_data_block + stripe * (data_blocks / 16);
+}
+
+uint32_t FileSystem::allocateInode(int64_t group) {
+
+    if (!isMounted) {
+        throw std::runtime_error(std::string("disk is not mounted yet. Invalid allocateInode call"));
+    }
+
+    uint32_t first = group >= 0 && group < super_cache.group_count ? static_cast<uint32_t>(group) : homeGroup();
+
+    // Groups are tried in order, starting with the wanted one
+    for (uint32_t k = 0; k < super_cache.group_count; ++k) {
+
+        uint32_t g = (first + k) % super_cache.group_count;
+
+        // Full groups are passed over without reading their bitmap
+        if (groupFreeInodes(g) == 0) {
+            continue;
+        }
+
+        loadGroup(g);
+        int64_t free_bit = inode_bitmaps[g].allocate();
+
+        if (free_bit < 0) {
+            continue;
+        }
+
+        inode_bitmaps[g].writeBack(disk, free_bit);
+        --free_inodes;
+
+        uint32_t inode_index = g * super_cache.inodes_per_group + static_cast<uint32_t>(free_bit);
+
+        Inode inode;
+        std::memset(&inode, 0, sizeof(Inode));
+
+        inode.ref_count = 1;
+
+        writeInode(inode_index, inode);
+
+        return inode_index;
+    }
+
+    throw std::runtime_error(std::string("No Free Inode in disk"));
+}
+
+void FileSystem::freeInode(uint32_t inode_index) {
+
+    uint32_t g = groupOfInode(inode_index);
+    uint32_t bit = inode_index % super_cache.inodes_per_group;
+
+    loadGroup(g);
+
+    if (inode_bitmaps[g].clear(bit)) {
+        ++free_inodes;
+    }
+    inode_bitmaps[g].writeBack(disk, bit);
+
+}
+
+std::vector<uint32_t> FileSystem::allocateInodes(uint32_t count, int64_t group) {
+
+    if (count > free_inodes) {
+        throw std::runtime_error(std::string("No Free Inode in disk"));
+    }
+
+    uint32_t first = group >= 0 && group < super_cache.group_count ? static_cast<uint32_t>(group) : homeGroup();
+    std::vector<uint32_t> inode_indexes;
+
+    // Runs of free inodes, so the new inodes share inode table blocks
+    for (uint32_t k = 0; k < super_cache.group_count && count > 0; ++k) {
+
+        uint32_t g = (first + k) % super_cache.group_count;
+
+        if (groupFreeInodes(g) == 0) {
+            continue;
+        }
+
+        loadGroup(g);
+        std::map<uint32_t, uint32_t> touched_bitmap_blocks;    // Bitmap block -> a bit set in it
+
+        while (count > 0) {
+
+            uint32_t length = 0;
+            int64_t start = inode_bitmaps[g].allocateRun(count, -1, &length);
+
+            if (start < 0) {
+                break;
+            }
+
+            for (uint32_t bit = start; bit < start + length; ++bit) {
+                inode_indexes.push_back(g * super_cache.inodes_per_group + bit);
+                touched_bitmap_blocks[inode_bitmaps[g].blockOf(bit)] = bit;
+            }
+
+            free_inodes -= length;
+            count -= length;
+        }
+
+        for (const auto& touched : touched_bitmap_blocks) {
+            inode_bitmaps[g].writeBack(disk, touched.second);
+        }
+    }
+
+    // Other threads took the inodes counted as free above, the ones claimed
+    // so far are given back before failing
+    if (count > 0) {
+        freeInodes(inode_indexes);
+        throw std::runtime_error(std::string("No Free Inode in disk"));
+    }
+
+    return inode_indexes;
+}
+
+void FileSystem::freeInodes(const std::vector<uint32_t>& inode_indexes) {
+
+    std::map<uint32_t, uint32_t> touched_bitmap_blocks;        // Bitmap block -> an inode in it
+
+    for (uint32_t inode_index : inode_indexes) {
+
+        uint32_t g = groupOfInode(inode_index);
+        uint32_t bit = inode_index % super_cache.inodes_per_group;
+
+        loadGroup(g);
+
+        if (inode_bitmaps[g].clear(bit)) {
+            ++free_inodes;
+        }
+        touched_bitmap_blocks[inode_bitmaps[g].blockOf(bit)] = inode_index;
+    }
+
+    for (const auto& touched : touched_bitmap_blocks) {
+        uint32_t g = groupOfInode(touched.second);
+        inode_bitmaps[g].writeBack(disk, touched.second % super_cache.inodes_per_group);
+    }
+
+}
+
+uint32_t FileSystem::allocateDataBlock(int64_t goal) {
+
+    if (!isMounted) {
+        throw std::runtime_error(std::string("disk is not mounted yet. Invalid allocateDataBlock call"));
+    }
+
+    return allocateDataBlocks(1, goal)[0].start;
+
+}
+
+std::vector<Extent> FileSystem::allocateDataBlocks(uint32_t count, int64_t goal) {
+
+    if (!isMounted) {
+        throw std::runtime_error(std::string("disk is not mounted yet. Invalid allocateDataBlocks call"));
+    }
+
+    if (count > free_blocks) {
+        throw std::runtime_error(std::string("No Free Data Block in disk"));
+    }
+
+    if (goal < 0 || static_cast<uint64_t>(goal) >= super_cache.total_blocks) {
+        goal = groups[homeGroup()].first_data_block;
+    }
+
+    std::vector<Extent> extents;
+    std::map<uint32_t, uint32_t> touched_bitmap_blocks;     // Bitmap block -> a block set in it
+
+    uint32_t group = groupOfBlock(goal);
+    uint32_t full_groups = 0;
+
+    // Take the longest runs the goal's group offers until count blocks are
+    // covered, each run continues where the previous one ended when possible.
+    // Runs never cross a group, a full group passes on to the next one.
+    while (count > 0) {
+
+        // Other threads took the blocks counted as free above. The runs
+        // claimed so far are given back before failing.
+        if (full_groups == super_cache.group_count) {
+
+            for (const Extent& extent : extents) {
+                uint32_t g = groupOfBlock(extent.start);
+
+                for (uint32_t i = 0; i < extent.length; ++i) {
+                    if (data_bitmaps[g].clear(extent.start + i - g * super_cache.blocks_per_group)) {
+                        ++free_blocks;
+                    }
+                }
+            }
+
+            for (const auto& touched : touched_bitmap_blocks) {
+                uint32_t g = groupOfBlock(touched.second);
+                data_bitmaps[g].writeBack(disk, touched.second - g * super_cache.blocks_per_group);
+            }
+
+            throw std::runtime_error(std::string("No Free Data Block in disk"));
+        }
+
+        uint32_t group_start = group * super_cache.blocks_per_group;
+        uint32_t length = 0;
+        int64_t start = -1;
+
+        // Full groups are passed over without reading their bitmap
+        if (groupFreeBlocks(group) > 0) {
+            loadGroup(group);
+            start = data_bitmaps[group].allocateRun(count, goal - group_start, &length);
+        }
+
+        if (start < 0) {
+            group = (group + 1) % super_cache.group_count;
+            goal = groups[group].first_data_block;
+            ++full_groups;
+            continue;
+        }
+
+        for (uint32_t bit = static_cast<uint32_t>(start); bit < start + length; bit += super_cache.block_size * 8) {
+            touched_bitmap_blocks[data_bitmaps[group].blockOf(bit)] = group_start + bit;
+        }
+        touched_bitmap_blocks[data_bitmaps[group].blockOf(start + length - 1)] = group_start + start + length - 1;
+
+        extents.push_back({ group_start + static_cast<uint32_t>(start), length });
+        free_blocks -= length;
+
+        count -= length;
+        goal = group_start + start + length;
+    }
+
+    for (const auto& touched : touched_bitmap_blocks) {
+        uint32_t g = groupOfBlock(touched.second);
+        data_bitmaps[g].writeBack(disk, touched.second - g * super_cache.blocks_per_group);
+    }
+
+    return extents;
+}
+
+void FileSystem::freeDataBlocks(const std::vector<uint32_t>& blocks) {
+
+    std::map<uint32_t, uint32_t> touched_bitmap_blocks;     // Bitmap block -> a block freed in it
+    uint64_t held = 0;
+
+    // The bits go to disk clear in this transaction, so the free commits with
+    // the change which dropped the blocks. They stay taken in memory until the
+    // transaction commits.
+    for (uint32_t disk_block : blocks) {
+        uint32_t g = groupOfBlock(disk_block);
+        uint32_t bit = disk_block - g * super_cache.blocks_per_group;
+
+        loadGroup(g);
+
+        if (data_bitmaps[g].hold(bit)) {
+            ++held;
+        }
+        touched_bitmap_blocks[data_bitmaps[g].blockOf(bit)] = disk_block;
+    }
+
+    for (const auto& touched : touched_bitmap_blocks) {
+        uint32_t g = groupOfBlock(touched.second);
+        data_bitmaps[g].writeBack(disk, touched.second - g * super_cache.blocks_per_group);
+    }
+
+    std::lock_guard<std::mutex> guard(pending_lock);
+    pending_frees.insert(pending_frees.end(), blocks.begin(), blocks.end());
+    pending_blocks += held;
+
+}
+
+void FileSystem::releaseFrees() {
+
+    std::lock_guard<std::mutex> guard(pending_lock);
+
+    // The bitmap on disk has them free already
+    for (uint32_t disk_block : pending_frees) {
+        uint32_t g = groupOfBlock(disk_block);
+
+        if (data_bitmaps[g].release(disk_block - g * super_cache.blocks_per_group)) {
+            ++free_blocks;
+            --pending_blocks;
+        }
+    }
+
+    pending_frees.clear();
+
+}
+
+void FileSystem::commitJournal() {
+
+    // Readers evicting inodes must not dirty blocks while the commit copies them
+    std::lock_guard<std::mutex> guard(flush_lock);
+
+    flushInodesLocked();
+    disk.commit();
+
+    // Old transactions may still name the freed blocks, replay must not write
+    // them over the data of their next owner
+    if (!pending_frees.empty()) {
+        disk.checkpoint();
+        releaseFrees();
+    }
+
+}
+
+FileSystem::Operation::Operation(FileSystem& fs_, uint64_t blocks) : fs(fs_) {
+
+    // Group commit: operations join the running transaction until it is due.
+    // The commit waits for the running operations, and every operation which
+    // starts meanwhile queues behind it, so all of them share its flush.
+    // It is also due when space runs short while freed blocks wait for it.
+    if (fs.disk.commitDue() || fs.spaceShort(blocks)) {
+        ExclusiveLock commit(fs.commit_lock);
+        if (fs.disk.commitDue() || fs.spaceShort(blocks)) {
+            fs.commitJournal();
+        }
+    }
+
+    lock = SharedLock(fs.commit_lock);
+    fs.disk.beginOp();
+
+}
+
+FileSystem::Operation::~Operation() {
+
+    fs.disk.endOp();
+
+}
+
+bool FileSystem::spaceShort(uint64_t blocks) const {
+
+    uint64_t pending = pending_blocks.load(std::memory_order_relaxed);
+    uint64_t free = free_blocks.load(std::memory_order_relaxed);
+
+    // The caller's count is a guess, freed blocks outnumbering the free ones
+    // catch what it misses
+    return pending > 0 && (blocks > free || pending > free);
+}
+
+void FileSystem::sync() {
+
+    if (!isMounted) {
+        throw std::runtime_error(std::string("Disk is not mounted yet. Invalid sync call"));
+    }
+
+    flushAllTails();
+
+    ExclusiveLock commit(commit_lock);
+    syncLocked(FS_DIRTY);
+
+}
+
+void FileSystem::syncLocked(uint32_t state) {
+
+    commitJournal();
+
+    // The summary is written after the released blocks are counted as free
+    writeSummary(state);
+
+    std::lock_guard<std::mutex> guard(flush_lock);
+    flushInodesLocked();
+    disk.sync();
+
+}
+
+void FileSystem::unmount() {
+
+    if (!isMounted) {
+        throw std::runtime_error(std::string("Disk is not mounted yet. Invalid unmount call"));
+    }
+
+    flushAllTails();
+
+    {
+        ExclusiveLock commit(commit_lock);
+        syncLocked(FS_CLEAN);
+    }
+
+    for (uint32_t i = 0; i < CACHE_SHARDS; ++i) {
+        std::lock_guard<std::mutex> inode_guard(inode_shards[i]->lock);
+        inode_shards[i]->cache.clear();
+
+        std::lock_guard<std::mutex> dentry_guard(dentry_shards[i]->lock);
+        dentry_shards[i]->cache.clear();
+    }
+
+    isMounted = false;
+
+}
+
+
+bool FileSystem::createFile(const std::string& fileName) {
+
+    if (!isMounted) {
+        throw std::runtime_error("Disk is not mounted.");
+    }
+
+    Stats::Timer timer(disk.getStats(), Stats::CREATE_FILE_NS);
+
+    Operation operation(*this);
+
+    // Step 1: Find the parent directory, it stays locked until the entry is added
+    uint32_t parent_index;
+    std::string name;
+    ExclusiveLock parent_lock;
+
+    if (!resolveParent(fileName, &parent_index, &name, &parent_lock, nullptr)) {
+        return false;
+    }
+
+    Inode parent = readInode(parent_index);
+
+    // Step 2: Check for duplicate filenames
+    if (lookupChild(parent_index, parent, name) >= 0) {
+        return false;  // Duplicate found
+    }
+
+    // Step 3: Allocate new inode, in the group of its directory
+    uint32_t new_inode_index = allocateInode(groupOfInode(parent_index));
+
+    Inode new_inode;
+    std::memset(&new_inode, 0, sizeof(Inode));
+    new_inode.mode = 1;  // file
+    new_inode.flags = (super_cache.features & FS_FEATURE_INLINE_DATA) ? INODE_INLINE : 0;
+    new_inode.size = 0;
+    new_inode.ref_count = 1;
+
+    writeInode(new_inode_index, new_inode);
+
+    // Step 4: Add directory entry to the parent and write the parent inode
+    addEntry(parent_index, parent, name, new_inode_index);
+    writeInode(parent_index, parent);
+
+    cacheDentry(parent_index, name, new_inode_index);
+
+    return true;
+}
+
+
+std::map<std::string, std::vector<size_t>> FileSystem::groupByParent(const std::vector<std::string>& paths) {
+
+    std::map<std::string, std::vector<size_t>> batches;
+
+    for (size_t i = 0; i < paths.size(); ++i) {
+
+        std::vector<std::string> components = splitPath(paths[i]);
+        std::string parent;
+
+        for (size_t c = 0; c + 1 < components.size(); ++c) {
+            parent += "/" + components[c];
+        }
+
+        batches[parent].push_back(i);
+    }
+
+    return batches;
+}
+
+std::vector<bool> FileSystem::createFiles(const std::vector<std::string>& fileNames) {
+
+    if (!isMounted) {
+        throw std::runtime_error("Disk is not mounted.");
+    }
+
+    Stats::Timer timer(disk.getStats(), Stats::CREATE_FILES_NS);
+
+    std::vector<bool> created(fileNames.size(), false);
+
+    for (const auto& batch : groupByParent(fileNames)) {
+
+        std::vector<std::string> parent_components = splitPath(batch.first);
+
+        for (size_t chunk = 0; chunk < batch.second.size(); chunk += BATCH_FILES) {
+
+            size_t chunk_end = std::min<size_t>(batch.second.size(), chunk + BATCH_FILES);
+
+            Operation operation(*this);
+
+            // Step 1: Find and lock the parent directory once for the chunk
+            ExclusiveLock parent_lock;
+            int64_t parent_index = walkPath(parent_components, parent_components.size(), &parent_lock, nullptr);
+
+            if (parent_index < 0) {
+                continue;
+            }
+
+            Inode parent = readInode(parent_index);
+
+            if (parent.mode != 0) {
+                continue;
+            }
+
+            // Step 2: Check the names, against the directory and each other
+            std::vector<std::pair<size_t, std::string>> wanted;
+            std::set<std::string> seen;
+
+            for (size_t k = chunk; k < chunk_end; ++k) {
+
+                std::vector<std::string> components = splitPath(fileNames[batch.second[k]]);
+                if (components.empty()) {
+                    continue;
+                }
+
+                const std::string& name = components.back();
+
+                if (name.length() > MAX_NAME_LEN || name == "." || name == ".." || !seen.insert(name).second) {
+                    continue;
+                }
+
+                if (lookupChild(parent_index, parent, name) >= 0) {
+                    continue;  // Duplicate found
+                }
+
+                wanted.push_back({ batch.second[k], name });
+            }
+
+            if (wanted.empty()) {
+                continue;
+            }
+
+            // Step 3: Allocate the inodes together, in the group of the directory
+            std::vector<uint32_t> new_inodes = allocateInodes(wanted.size(), groupOfInode(parent_index));
+
+            Inode new_inode;
+            std::memset(&new_inode, 0, sizeof(Inode));
+            new_inode.mode = 1;  // file
+            new_inode.flags = (super_cache.features & FS_FEATURE_INLINE_DATA) ? INODE_INLINE : 0;
+            new_inode.size = 0;
+            new_inode.ref_count = 1;
+
+            // Step 4: Add the entries, the parent inode is written once
+            size_t linked = 0;
+
+            try {
+
+                for (; linked < wanted.size(); ++linked) {
+
+                    writeInode(new_inodes[linked], new_inode);
+                    addEntry(parent_index, parent, wanted[linked].second, new_inodes[linked]);
+                    cacheDentry(parent_index, wanted[linked].second, new_inodes[linked]);
+
+                    created[wanted[linked].first] = true;
+                }
+
+            } catch (...) {
+                // The directory could not grow, the inodes without an entry are given back
+                freeInodes(std::vector<uint32_t>(new_inodes.begin() + linked, new_inodes.end()));
+                writeInode(parent_index, parent);
+                throw;
+            }
+
+            writeInode(parent_index, parent);
+        }
+    }
+
+    return created;
+}
+
+
+int FileSystem::openFile(const std::string& fileName) {
+
+    if (!isMounted) {
+        throw std::runtime_error("Disk is not mounted.");
+    }
+
+    Stats::Timer timer(disk.getStats(), Stats::OPEN_FILE_NS);
+
+    if (fileName.empty()) {
+        return -1;
+    }
+
+    // Step 1: Resolve the path, only regular files can be opened. The file is
+    // locked before its directory is released, so it cannot be deleted in between.
+    uint32_t parent_index;
+    std::string name;
+    SharedLock parent_lock;
+
+    if (!resolveParent(fileName, &parent_index, &name, nullptr, &parent_lock)) {
+        return -1;
+    }
+
+    int64_t found_inode = lookupChild(parent_index, readInode(parent_index), name);
+
+    if (found_inode < 0) {
+        return -1;  // File not found
+    }
+
+    SharedLock file_lock(inodeLock(found_inode));
+    parent_lock.unlock();
+
+    Inode inode = readInode(found_inode);
+
+    if (inode.mode != 1) {
+        return -1;  // Not a regular file
+    }
+
+    // Step 2: Find free file descriptor slot, starting in this thread's shard
+    int slots_per_shard = MAX_OPEN_FILES / FD_SHARDS;
+    int first_shard = std::hash<std::thread::id>()(std::this_thread::get_id()) % FD_SHARDS;
+
+    for (int k = 0; k < FD_SHARDS; ++k) {
+
+        int shard = (first_shard + k) % FD_SHARDS;
+        std::lock_guard<std::mutex> guard(fd_shard_locks[shard]);
+
+        for (int fd = shard * slots_per_shard; fd < (shard + 1) * slots_per_shard; ++fd) {
+
+            if (!fd_table[fd].in_use) {
+
+                fd_table[fd].inode_index = found_inode;
+                fd_table[fd].offset = 0;
+                fd_table[fd].block_map.clear();
+                fd_table[fd].cluster_index = UINT64_MAX;
+                fd_table[fd].ra_expected = 0;
+                fd_table[fd].ra_window = 0;
+                fd_table[fd].ra_end = 0;
+                fd_table[fd].in_use = true;
+
+                // The inode of an open file stays in the inode cache until it is closed
+                pinInode(found_inode, inode);
+
+                return fd;
+            }
+        }
+    }
+
+    return -1;  // No free file descriptor
+}
+
+
+bool FileSystem::closeFile(int fd) {
+
+    if (!isMounted) {
+        throw std::runtime_error("Disk is not mounted.");
+    }
+
+    Stats::Timer timer(disk.getStats(), Stats::CLOSE_FILE_NS);
+
+    if (fd < 0 || fd >= MAX_OPEN_FILES) {
+        return false;
+    }
+
+    // Buffered appends of the descriptor are written out, which needs an operation
+    Operation operation(*this);
+
+    // Wait for calls still using the descriptor
+    std::lock_guard<std::mutex> file_guard(fd_table[fd].lock);
+    uint32_t inode_index;
+
+    {
+        std::lock_guard<std::mutex> guard(fdShardLock(fd));
+
+        if (!fd_table[fd].in_use) {
+            return false;
+        }
+
+        inode_index = fd_table[fd].inode_index;
+    }
+
+    // Another descriptor may flush the buffer meanwhile, it is checked again under the inode lock
+    if (fd_table[fd].has_tail) {
+        ExclusiveLock inode_lock(inodeLock(inode_index));
+        Inode inode = readInode(inode_index);
+        if (fd_table[fd].has_tail) {
+            flushTail(fd, fd, inode, false);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(fdShardLock(fd));
+
+        fd_table[fd].in_use = false;
+        fd_table[fd].offset = 0;
+        fd_table[fd].inode_index = 0;
+        std::vector<uint32_t>().swap(fd_table[fd].block_map);
+        std::vector<char>().swap(fd_table[fd].tail);
+        std::vector<char>().swap(fd_table[fd].cluster);
+        fd_table[fd].cluster_index = UINT64_MAX;
+    }
+
+    unpinInode(inode_index);
+
+    return true;
+}
+
+
+int FileSystem::readFile(int fd, char* buffer, uint32_t count) {
+
+    if (!isMounted) {
+        throw std::runtime_error("Disk is not mounted.");
+    }
+
+    Stats::Timer timer(disk.getStats(), Stats::READ_FILE_NS);
+
+    if (fd < 0 || fd >= MAX_OPEN_FILES) {
+        return -1;
+    }
+
+    // Buffered appends are written out before the file is read, which needs
+    // an operation; it has to be started before the descriptor is locked
+    std::unique_ptr<Operation> operation;
+    if (tails_pending.load() > 0) {
+        operation.reset(new Operation(*this));
+    }
+
+    std::lock_guard<std::mutex> file_guard(fd_table[fd].lock);
+
+    if (!fd_table[fd].in_use) {
+        return -1;
+    }
+
+    uint32_t inode_index = fd_table[fd].inode_index;
+
+    if (operation && hasTails(inode_index)) {
+        ExclusiveLock exclusive(inodeLock(inode_index));
+        Inode inode = readInode(inode_index);
+        flushTails(inode_index, inode, fd);
+    }
+
+    SharedLock inode_lock(inodeLock(inode_index));
+    Inode inode = readInode(inode_index);
+
+    if (inode.mode != 1) {
+        return -1;  // Not a file
+    }
+
+    uint64_t offset = fd_table[fd].offset;
+
+    if (offset >= inode.size || count == 0) {
+        return 0;  // EOF
+    }
+
+    // The byte count is returned as an int
+    uint32_t bytes_to_read = std::min<uint64_t>(std::min<uint32_t>(count, INT_MAX), inode.size - offset);
+
+    // Inline files are read out of the inode, with no block I/O. Compressed
+    // files are decoded one cluster at a time.
+    if (isInline(inode) || isCompressed(inode)) {
+        if (isInline(inode)) {
+            copyInline(inode, offset, buffer, bytes_to_read);
+        } else {
+            readCompressed(fd, inode, offset, buffer, bytes_to_read);
+        }
+        disk.getStats().add(Stats::BYTES_COPIED, bytes_to_read);
+
+        fd_table[fd].offset += bytes_to_read;
+        fd_table[fd].ra_expected = fd_table[fd].offset;
+        disk.getStats().add(Stats::BYTES_READ, bytes_to_read);
+
+        return bytes_to_read;
+    }
+
+    uint32_t block_size = super_cache.block_size;
+    uint32_t first_block = offset / block_size;
+    uint32_t last_block = (offset + bytes_to_read - 1) / block_size;
+
+    // Step 1: Translate the blocks
+    const uint32_t* disk_blocks = mapForFd(fd, inode, first_block, last_block - first_block + 1);
+
+    // Step 2: Whole blocks are read straight into the caller's buffer,
+    // partly read first/last blocks go through a bounce buffer. Holes read as
+    // zeroes without any I/O.
+    char partial[2][4096];
+    std::vector<BlockRead> requests;
+
+    for (uint32_t block_index = first_block; block_index <= last_block; ++block_index) {
+
+        uint64_t block_start = static_cast<uint64_t>(block_index) * block_size;
+        uint64_t from = std::max<uint64_t>(offset, block_start);
+        uint64_t to = std::min<uint64_t>(offset + bytes_to_read, block_start + block_size);
+
+        char* target;
+        if (to - from == block_size) {
+            target = buffer + (from - offset);
+        } else {
+            target = partial[block_index == first_block ? 0 : 1];
+        }
+
+        if (disk_blocks[block_index - first_block] == 0) {
+            std::memset(target, 0, block_size);
+        } else {
+            requests.push_back({ disk_blocks[block_index - first_block], target });
+        }
+    }
+
+    disk.readBlocks(requests);
+
+    // Step 3: Copy the wanted part of the partial blocks
+    for (uint32_t block_index : { first_block, last_block }) {
+
+        uint64_t block_start = static_cast<uint64_t>(block_index) * block_size;
+        uint64_t from = std::max<uint64_t>(offset, block_start);
+        uint64_t to = std::min<uint64_t>(offset + bytes_to_read, block_start + block_size);
+
+        if (to - from == block_size) {
+            continue;
+        }
+
+        std::memcpy(
+            buffer + (from - offset),
+            partial[block_index == first_block ? 0 : 1] + (from - block_start),
+            to - from
+        );
+        disk.getStats().add(Stats::BYTES_COPIED, to - from);
+
+        if (first_block == last_block) {
+            break;
+        }
+    }
+
+    readAhead(fd, inode, offset, bytes_to_read);
+
+    fd_table[fd].offset += bytes_to_read;
+    fd_table[fd].ra_expected = fd_table[fd].offset;
+    disk.getStats().add(Stats::BYTES_READ, bytes_to_read);
+
+    return bytes_to_read;
+}
+
+
+int FileSystem::readView(int fd, uint32_t count, FileView& view) {
+
+    if (!isMounted) {
+        throw std::runtime_error("Disk is not mounted.");
+    }
+
+    Stats::Timer timer(disk.getStats(), Stats::READ_VIEW_NS);
+
+    // The old view may lock this very file
+    view = FileView();
+
+    if (fd < 0 || fd >= MAX_OPEN_FILES) {
+        return -1;
+    }
+
+    std::unique_ptr<Operation> operation;
+    if (tails_pending.load() > 0) {
+        operation.reset(new Operation(*this));
+    }
+
+    std::lock_guard<std::mutex> file_guard(fd_table[fd].lock);
+
+    if (!fd_table[fd].in_use) {
+        return -1;
+    }
+
+    uint32_t inode_index = fd_table[fd].inode_index;
+
+    if (operation && hasTails(inode_index)) {
+        ExclusiveLock exclusive(inodeLock(inode_index));
+        Inode inode = readInode(inode_index);
+        flushTails(inode_index, inode, fd);
+    }
+
+    SharedLock inode_lock(inodeLock(inode_index));
+    Inode inode = readInode(inode_index);
+
+    if (inode.mode != 1) {
+        return -1;  // Not a file
+    }
+
+    uint64_t offset = fd_table[fd].offset;
+
+    if (offset >= inode.size || count == 0) {
+        return 0;  // EOF
+    }
+
+    uint32_t block_size = super_cache.block_size;
+    uint64_t limit = static_cast<uint64_t>(VIEW_MAX_BLOCKS) * block_size - offset % block_size;
+    uint32_t bytes_to_read = std::min<uint64_t>(std::min<uint64_t>(count, limit), inode.size - offset);
+
+    if (isInline(inode) || isCompressed(inode)) {
+        view.copied.resize(bytes_to_read);
+        if (isInline(inode)) {
+            copyInline(inode, offset, view.copied.data(), bytes_to_read);
+        } else {
+            readCompressed(fd, inode, offset, view.copied.data(), bytes_to_read);
+        }
+        view.spans.push_back({ view.copied.data(), bytes_to_read });
+        disk.getStats().add(Stats::BYTES_COPIED, bytes_to_read);
+
+        fd_table[fd].offset += bytes_to_read;
+        fd_table[fd].ra_expected = fd_table[fd].offset;
+        disk.getStats().add(Stats::BYTES_READ, bytes_to_read);
+
+        view.bytes = bytes_to_read;
+        view.lock = std::move(inode_lock);
+
+        return bytes_to_read;
+    }
+
+    uint32_t first_block = offset / block_size;
+    uint32_t last_block = (offset + bytes_to_read - 1) / block_size;
+
+    // Step 1: Pin the blocks, holes are views of a shared block of zeroes
+    const uint32_t* disk_blocks = mapForFd(fd, inode, first_block, last_block - first_block + 1);
+
+    for (uint32_t block_index = first_block; block_index <= last_block; ++block_index) {
+
+        uint64_t block_start = static_cast<uint64_t>(block_index) * block_size;
+        uint64_t from = std::max<uint64_t>(offset, block_start);
+        uint64_t to = std::min<uint64_t>(offset + bytes_to_read, block_start + block_size);
+
+        BlockView block;
+        if (disk_blocks[block_index - first_block] != 0) {
+            block = disk.viewBlock(disk_blocks[block_index - first_block]);
+        }
+
+        const char* data = (block.data() != nullptr ? block.data() : zero_block) + (from - block_start);
+
+        // Step 2: Blocks which follow each other in memory (the mapping) share a span
+        if (!view.spans.empty() && view.spans.back().data + view.spans.back().length == data) {
+            view.spans.back().length += to - from;
+        } else {
+            view.spans.push_back({ data, static_cast<uint32_t>(to - from) });
+        }
+
+        if (block.data() != nullptr) {
+            view.blocks.push_back(std::move(block));
+        }
+    }
+
+    readAhead(fd, inode, offset, bytes_to_read);
+
+    fd_table[fd].offset += bytes_to_read;
+    fd_table[fd].ra_expected = fd_table[fd].offset;
+    disk.getStats().add(Stats::BYTES_READ, bytes_to_read);
+
+    view.bytes = bytes_to_read;
+    view.lock = std::move(inode_lock);
+
+    return bytes_to_read;
+}
+
+
+int64_t FileSystem::exportFile(int fd, int host_fd, uint64_t count) {
+
+    if (!isMounted) {
+        throw std::runtime_error("Disk is not mounted.");
+    }
+
+    Stats::Timer timer(disk.getStats(), Stats::EXPORT_FILE_NS);
+
+    if (fd < 0 || fd >= MAX_OPEN_FILES) {
+        return -1;
+    }
+
+    std::unique_ptr<Operation> operation;
+    if (tails_pending.load() > 0) {
+        operation.reset(new Operation(*this));
+    }
+
+    std::lock_guard<std::mutex> file_guard(fd_table[fd].lock);
+
+    if (!fd_table[fd].in_use) {
+        return -1;
+    }
+
+    uint32_t inode_index = fd_table[fd].inode_index;
+
+    if (operation && hasTails(inode_index)) {
+        ExclusiveLock exclusive(inodeLock(inode_index));
+        Inode inode = readInode(inode_index);
+        flushTails(inode_index, inode, fd);
+    }
+
+    SharedLock inode_lock(inodeLock(inode_index));
+    Inode inode = readInode(inode_index);
+
+    if (inode.mode != 1) {
+        return -1;  // Not a file
+    }
+
+    uint64_t offset = fd_table[fd].offset;
+
+    if (offset >= inode.size || count == 0) {
+        return 0;  // EOF
+    }
+
+    uint64_t bytes_to_send = std::min<uint64_t>(count, inode.size - offset);
+
+    if (isInline(inode)) {
+        char data[INLINE_DATA_SIZE];
+        copyInline(inode, offset, data, bytes_to_send);
+        writeAll(host_fd, data, bytes_to_send);
+        disk.getStats().add(Stats::BYTES_COPIED, bytes_to_send);
+
+        fd_table[fd].offset += bytes_to_send;
+        fd_table[fd].ra_expected = fd_table[fd].offset;
+        disk.getStats().add(Stats::BYTES_READ, bytes_to_send);
+
+        return bytes_to_send;
+    }
+
+    uint32_t block_size = super_cache.block_size;
+
+    // The kernel cannot decompress, compressed files go out one decoded cluster at a time
+    if (isCompressed(inode)) {
+
+        uint64_t cluster_size = static_cast<uint64_t>(CLUSTER_BLOCKS) * block_size;
+
+        for (uint64_t done = 0; done < bytes_to_send;) {
+            uint64_t at = offset + done;
+            uint64_t n = std::min<uint64_t>(bytes_to_send - done, cluster_size - at % cluster_size);
+            writeAll(host_fd, readCluster(fd, inode, at / cluster_size) + at % cluster_size, n);
+            done += n;
+        }
+
+        disk.getStats().add(Stats::BYTES_COPIED, bytes_to_send);
+
+        fd_table[fd].offset += bytes_to_send;
+        fd_table[fd].ra_expected = fd_table[fd].offset;
+        disk.getStats().add(Stats::BYTES_READ, bytes_to_send);
+
+        return bytes_to_send;
+    }
+    uint32_t first_block = offset / block_size;
+    uint32_t last_block = (offset + bytes_to_send - 1) / block_size;
+
+    // Step 1: Translate the blocks
+    const uint32_t* disk_blocks = mapForFd(fd, inode, first_block, last_block - first_block + 1);
+
+    // Step 2: Each run of physically contiguous blocks is one copy in the
+    // kernel, each run of holes is written as zeroes
+    for (uint32_t block_index = first_block; block_index <= last_block;) {
+
+        uint32_t start = disk_blocks[block_index - first_block];
+        uint32_t run = 1;
+
+        while (block_index + run <= last_block) {
+            uint32_t next = disk_blocks[block_index + run - first_block];
+            if (start == 0 ? next != 0 : next != start + run) {
+                break;
+            }
+            ++run;
+        }
+
+        uint64_t run_start = static_cast<uint64_t>(block_index) * block_size;
+        uint64_t from = std::max<uint64_t>(offset, run_start);
+        uint64_t to = std::min<uint64_t>(offset + bytes_to_send, run_start + static_cast<uint64_t>(run) * block_size);
+
+        if (start != 0) {
+            disk.sendBlocks(host_fd, start, from - run_start, to - from);
+        } else {
+            writeZeroes(host_fd, to - from);
+        }
+
+        block_index += run;
+    }
+
+    fd_table[fd].offset += bytes_to_send;
+    fd_table[fd].ra_expected = fd_table[fd].offset;
+    disk.getStats().add(Stats::BYTES_READ, bytes_to_send);
+
+    return bytes_to_send;
+}
+
+
+int64_t FileSystem::importFile(int host_fd, int fd) {
+
+    if (!isMounted) {
+        throw std::runtime_error("Disk is not mounted.");
+    }
+
+    ::posix_fadvise(host_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // Buffer i % IMPORT_BUFFERS holds chunk i. The reader fills chunks while
+    // fewer than IMPORT_BUFFERS are waiting, an empty chunk ends the file.
+    std::vector<std::vector<char>> buffers(IMPORT_BUFFERS, std::vector<char>(IMPORT_BUFFER_SIZE));
+    std::vector<uint32_t> lengths(IMPORT_BUFFERS, 0);
+    uint64_t filled = 0;
+    uint64_t drained = 0;
+    bool stop = false;
+    int read_error = 0;
+
+    std::mutex lock;
+    std::condition_variable changed;
+
+    // Step 1: Reader, fills whole buffers unless the host file ends
+    std::thread reader([&]() {
+
+        for (uint64_t chunk = 0;; ++chunk) {
+
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                changed.wait(guard, [&]() { return stop || filled - drained < IMPORT_BUFFERS; });
+                if (stop) return;
+            }
+
+            char* buffer = buffers[chunk % IMPORT_BUFFERS].data();
+            uint32_t length = 0;
+            int error = 0;
+
+            while (length < IMPORT_BUFFER_SIZE) {
+                ssize_t got = ::read(host_fd, buffer + length, IMPORT_BUFFER_SIZE - length);
+                if (got < 0) {
+                    if (errno == EINTR) continue;
+                    error = errno;
+                    break;
+                }
+                if (got == 0) break;
+                length += got;
+            }
+
+            std::lock_guard<std::mutex> guard(lock);
+            lengths[chunk % IMPORT_BUFFERS] = length;
+            read_error = error;
+            ++filled;
+            changed.notify_all();
+
+            if (length == 0 || error != 0) return;
+        }
+    });
+
+    // Step 2: Writer, each chunk is one writeFile (whole blocks, allocated as runs)
+    int64_t total = 0;
+
+    try {
+
+        for (uint64_t chunk = 0;; ++chunk) {
+
+            uint32_t length;
+            int error;
+
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                changed.wait(guard, [&]() { return filled > chunk; });
+                length = lengths[chunk % IMPORT_BUFFERS];
+                error = read_error;
+            }
+
+            if (length > 0 && writeFile(fd, buffers[chunk % IMPORT_BUFFERS].data(), length) != static_cast<int>(length)) {
+                throw std::runtime_error("Import failed: the file could not be written");
+            }
+
+            total += length;
+
+            if (error != 0) {
+                throw std::runtime_error(std::string("read() was failed: ") + std::strerror(error));
+            }
+
+            std::lock_guard<std::mutex> guard(lock);
+            ++drained;
+            changed.notify_all();
+
+            if (length == 0) break;
+        }
+
+    } catch (...) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stop = true;
+            changed.notify_all();
+        }
+        reader.join();
+        throw;
+    }
+
+    reader.join();
+    return total;
+}
+
+
+void FileSystem::writeAt(int fd, uint32_t inode_index, Inode& inode, uint64_t offset, const char* buffer, uint32_t count) {
+
+    if (isCompressed(inode)) {
+        writeClusters(fd, inode_index, inode, offset, buffer, count);
+        return;
+    }
+
+    uint32_t block_size = super_cache.block_size;
+    uint32_t first_block = offset / block_size;
+    uint32_t last_block = (offset + count - 1) / block_size;
+    uint32_t num_blocks = last_block - first_block + 1;
+
+    std::vector<uint32_t> disk_blocks(num_blocks);
+    std::memcpy(disk_blocks.data(), mapForFd(fd, inode, first_block, num_blocks), num_blocks * sizeof(uint32_t));
+
+    // Step 1: Allocate missing blocks as contiguous runs, placed right after
+    // the block which precedes them in the file when that space is free, and
+    // in the inode's group otherwise
+    std::vector<bool> is_new(num_blocks, false);
+    std::vector<std::pair<uint32_t, uint32_t>> new_mapping;
+
+    for (uint32_t i = 0; i < num_blocks; ++i) {
+        if (disk_blocks[i] == 0) {
+            is_new[i] = true;
+            new_mapping.push_back({ first_block + i, 0 });
+        }
+    }
+
+    if (!new_mapping.empty()) {
+
+        int64_t goal = dataGoal(inode_index);
+        uint32_t first_new = new_mapping[0].first;
+
+        if (first_new > first_block) {
+            goal = disk_blocks[first_new - first_block - 1] + 1;
+        } else if (first_new > 0) {
+            uint32_t previous = 0;
+            mapBlocks(inode, first_new - 1, 1, &previous);
+            if (previous != 0) {
+                goal = previous + 1;
+            }
+        }
+
+        size_t next = 0;
+        for (const Extent& extent : allocateDataBlocks(new_mapping.size(), goal)) {
+            for (uint32_t i = 0; i < extent.length; ++i) {
+                new_mapping[next].second = extent.start + i;
+                disk_blocks[new_mapping[next].first - first_block] = extent.start + i;
+                ++next;
+            }
+        }
+
+        assignBlocks(inode, new_mapping);
+        invalidateBlockMaps(inode_index, first_new);
+    }
+
+    // Step 2: Partly written blocks keep their old bytes. Newly allocated ones,
+    // and blocks whose bytes up to the end of the file are all overwritten,
+    // start zeroed instead of being read.
+    char partial[2][4096];
+    std::vector<BlockRead> reads;
+
+    for (uint32_t block_index : { first_block, last_block }) {
+
+        uint64_t block_start = static_cast<uint64_t>(block_index) * block_size;
+        uint64_t from = std::max<uint64_t>(offset, block_start);
+        uint64_t to = std::min<uint64_t>(offset + count, block_start + block_size);
+        char* bounce = partial[block_index == first_block ? 0 : 1];
+
+        uint64_t live_end = std::min<uint64_t>(inode.size, block_start + block_size);
+        bool keeps_old = (from > block_start && live_end > block_start) || to < live_end;
+
+        if (to - from != block_size) {
+            if (is_new[block_index - first_block] || !keeps_old) {
+                std::memset(bounce, 0, block_size);
+            } else {
+                reads.push_back({ disk_blocks[block_index - first_block], bounce });
+            }
+        }
+
+        if (first_block == last_block) {
+            break;
+        }
+    }
+
+    disk.readBlocks(reads);
+
+    // Step 3: Whole blocks are written straight from the caller's buffer
+    std::vector<BlockWrite> writes;
+
+    for (uint32_t block_index = first_block; block_index <= last_block; ++block_index) {
+
+        uint64_t block_start = static_cast<uint64_t>(block_index) * block_size;
+        uint64_t from = std::max<uint64_t>(offset, block_start);
+        uint64_t to = std::min<uint64_t>(offset + count, block_start + block_size);
+
+        if (to - from == block_size) {
+            writes.push_back({ disk_blocks[block_index - first_block], buffer + (from - offset) });
+            continue;
+        }
+
+        char* bounce = partial[block_index == first_block ? 0 : 1];
+        std::memcpy(bounce + (from - block_start), buffer + (from - offset), to - from);
+        disk.getStats().add(Stats::BYTES_COPIED, to - from);
+        writes.push_back({ disk_blocks[block_index - first_block], bounce });
+    }
+
+    disk.writeBlocks(writes);
+
+}
+
+uint64_t FileSystem::writeBlocksNeeded(int fd, uint32_t count) {
+
+    std::lock_guard<std::mutex> file_guard(fd_table[fd].lock);
+
+    if (!fd_table[fd].in_use || count == 0) {
+        return 0;
+    }
+
+    uint32_t inode_index = fd_table[fd].inode_index;
+    uint64_t offset = fd_table[fd].offset;
+
+    SharedLock inode_lock(inodeLock(inode_index));
+    Inode inode = readInode(inode_index);
+
+    // A compressed cluster is stored anew as a whole before its old copy is
+    // freed, so every cluster touched may take all of its blocks
+    uint32_t block_size = super_cache.block_size;
+    uint64_t unit = isCompressed(inode) ? static_cast<uint64_t>(CLUSTER_BLOCKS) * block_size : block_size;
+    uint64_t blocks = ((offset + count - 1) / unit - offset / unit + 1) * (unit / block_size);
+
+    // Plus the pointer blocks mapping them, a chain of three at most where they start
+    return blocks + blocks / pointersPerBlock() + 3;
+}
+
+int FileSystem::writeFile(int fd, const char* buffer, uint32_t count) {
+
+    if (!isMounted) {
+        throw std::runtime_error("Disk is not mounted.");
+    }
+
+    Stats::Timer timer(disk.getStats(), Stats::WRITE_FILE_NS);
+
+    if (fd < 0 || fd >= MAX_OPEN_FILES) {
+        return -1;
+    }
+
+    // Only asked while freed blocks wait for a commit, otherwise no estimate is needed
+    uint64_t needed = pending_blocks.load(std::memory_order_relaxed) > 0 ? writeBlocksNeeded(fd, count) : 0;
+
+    Operation operation(*this, needed);
+    std::lock_guard<std::mutex> file_guard(fd_table[fd].lock);
+
+    if (!fd_table[fd].in_use) {
+        return -1;
+    }
+
+    OpenFile& file = fd_table[fd];
+    uint32_t inode_index = file.inode_index;
+    ExclusiveLock inode_lock(inodeLock(inode_index));
+    Inode inode = readInode(inode_index);
+
+    if (inode.mode != 1) {
+        return -1;  // Not a regular file
+    }
+
+    uint64_t offset = file.offset;
+    uint32_t block_size = super_cache.block_size;
+
+    // The byte count is returned as an int
+    uint64_t max_size = maxFileBlocks() * block_size;
+    count = offset >= max_size ? 0 : std::min<uint64_t>(std::min<uint32_t>(count, INT_MAX), max_size - offset);
+
+    if (count == 0) {
+        return 0;
+    }
+
+    disk.getStats().add(Stats::BYTES_WRITTEN, count);
+
+    // Step 1: Inline files take writes which end inside the inode, anything
+    // else moves their data into a block first
+    if (isInline(inode)) {
+
+        if (offset + count <= INLINE_DATA_SIZE) {
+            storeInline(inode, offset, buffer, count);
+            disk.getStats().add(Stats::BYTES_COPIED, count);
+
+            file.offset += count;
+            inode.size = std::max<uint64_t>(inode.size, offset + count);
+            writeInode(inode_index, inode);
+
+            return count;
+        }
+
+        promoteInline(fd, inode_index, inode);
+    }
+
+    // Step 2: A small write which continues this descriptor's append buffer,
+    // or starts one at the end of the file, only goes into the buffer. Any
+    // other write makes every buffered append of the file reach the disk first.
+    // For a compressed file anything short of a cluster is small, so each
+    // cluster is encoded once instead of once per write.
+    bool continues = file.has_tail && offset == file.tail_start + file.tail.size();
+    uint32_t small = isCompressed(inode) ? CLUSTER_BLOCKS * block_size : block_size;
+
+    if (!continues && tails_pending.load() > 0) {
+        flushTails(inode_index, inode, fd);
+    }
+
+    if (count < small && (continues || offset == inode.size)) {
+        appendToTail(fd, inode, buffer, count);
+        return count;
+    }
+
+    if (file.has_tail) {
+        flushTail(fd, fd, inode, false);
+    }
+
+    // Step 3: Write through
+    writeAt(fd, inode_index, inode, offset, buffer, count);
+
+    file.offset += count;
+
+    uint64_t new_end = offset + count;
+    if (new_end > inode.size) {
+        inode.size = new_end;
+    }
+
+    writeInode(inode_index, inode);
+
+    return count;
+}
+
+bool FileSystem::seekFile(int fd, uint64_t offset) {
+
+    if (!isMounted) {
+        throw std::runtime_error("Disk is not mounted.");
+    }
+
+    if (fd < 0 || fd >= MAX_OPEN_FILES) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> file_guard(fd_table[fd].lock);
+
+    if (!fd_table[fd].in_use || offset > maxFileBlocks() * super_cache.block_size) {
+        return false;
+    }
+
+    fd_table[fd].offset = offset;
+
+    return true;
+}
+
+bool FileSystem::setCompression(int fd, bool enabled) {
+
+    if (!isMounted) {
+        throw std::runtime_error("Disk is not mounted.");
+    }
+
+    if (fd < 0 || fd >= MAX_OPEN_FILES || !(super_cache.features & FS_FEATURE_COMPRESSION)) {
+        return false;
+    }
+
+    Operation operation(*this);
+    std::lock_guard<std::mutex> file_guard(fd_table[fd].lock);
+
+    if (!fd_table[fd].in_use) {
+        return false;
+    }
+
+    uint32_t inode_index = fd_table[fd].inode_index;
+    ExclusiveLock inode_lock(inodeLock(inode_index));
+    Inode inode = readInode(inode_index);
+
+    if (inode.mode != 1) {
+        return false;
+    }
+
+    // Buffered appends count, a file with bytes only in a buffer is not empty
+    if (tails_pending.load() > 0) {
+        flushTails(inode_index, inode, fd);
+    }
+
+    if (inode.size != 0) {
+        return false;
+    }
+
+    if (enabled) {
+        inode.flags |= INODE_COMPRESSED;
+    } else {
+        inode.flags &= ~INODE_COMPRESSED;
+    }
+
+    writeInode(inode_index, inode);
+
+    return true;
+}
+
+// Inline bytes [0, INLINE_HEAD) are in the block pointers, the rest in pad
+void FileSystem::copyInline(const Inode& inode, uint64_t offset, char* out, uint32_t count) {
+
+    for (uint32_t done = 0; done < count;) {
 
-    if (!isMounted) {
-        throw std::runtime_error(std::string("disk is not mounted yet. Invalid writeInode call"));
-    }
+        uint64_t at = offset + done;
+        const char* from = at < INLINE_HEAD ? reinterpret_cast<const char*>(inode.direct_blocks) + at
+                                            : reinterpret_cast<const char*>(inode.pad) + (at - INLINE_HEAD);
+        uint32_t n = std::min<uint64_t>(count - done, (at < INLINE_HEAD ? INLINE_HEAD : INLINE_DATA_SIZE) - at);
 
-    if (inode_index >= super_cache.total_inodes) {
-        throw std::invalid_argument(std::string("Invalid inode index: ") + std::to_string(inode_index));
+        std::memcpy(out + done, from, n);
+        done += n;
     }
 
-    uint32_t inode_bitmap_block = super_cache.inode_bitmap_start + (inode_index  / (super_cache.block_size * 8));
-    uint32_t inode_bitmap_bit = inode_index % (super_cache.block_size * 8);
+}
 
-    char buffer[4096];
+void FileSystem::storeInline(Inode& inode, uint64_t offset, const char* data, uint32_t count) {
 
-    disk.readBlock(inode_bitmap_block, buffer);
+    for (uint32_t done = 0; done < count;) {
 
-    if((buffer[inode_bitmap_bit / 8] & (1 << (inode_bitmap_bit % 8))) == 0) {
-        throw std::runtime_error(std::string("Invalid Inode index: Inode is unallocated - ") + std::to_string(inode_index));
+        uint64_t at = offset + done;
+        char* to = at < INLINE_HEAD ? reinterpret_cast<char*>(inode.direct_blocks) + at
+                                    : reinterpret_cast<char*>(inode.pad) + (at - INLINE_HEAD);
+        uint32_t n = std::min<uint64_t>(count - done, (at < INLINE_HEAD ? INLINE_HEAD : INLINE_DATA_SIZE) - at);
+
+        std::memcpy(to, data + done, n);
+        done += n;
     }
 
-    uint32_t inode_per_block = super_cache.block_size / sizeof(Inode);
-    uint32_t inode_block = super_cache.inode_table_start + (inode_index / inode_per_block);
-    uint32_t inode_offset = sizeof(Inode) * (inode_index % inode_per_block);
+}
+
+void FileSystem::promoteInline(int fd, uint32_t inode_index, Inode& inode) {
 
-    disk.readBlock(inode_block, buffer);
+    // Step 1: Take the bytes out, the fields go back to being block pointers
+    char data[INLINE_DATA_SIZE];
+    copyInline(inode, 0, data, inode.size);
 
-    std::memcpy(buffer + inode_offset, &inode, sizeof(Inode));
+    std::memset(inode.direct_blocks, 0, sizeof(inode.direct_blocks));
+    std::memset(inode.indirect_blocks, 0, sizeof(inode.indirect_blocks));
+    std::memset(inode.pad, 0, sizeof(inode.pad));
+    inode.flags &= ~INODE_INLINE;
+
+    // Step 2: They become the first block of the file
+    if (inode.size > 0) {
+        writeAt(fd, inode_index, inode, 0, data, inode.size);
+    }
 
-    disk.writeBlock(inode_block, buffer);
+    writeInode(inode_index, inode);
 
 }
 
-uint32_t FileSystem::allocateInode() {
+void FileSystem::zeroPartial(int fd, const Inode& inode, uint64_t from, uint64_t to) {
 
-    if (!isMounted) {
-        throw std::runtime_error(std::string("disk is not mounted yet. Invalid allocateInode call"));
+    uint32_t block_size = super_cache.block_size;
+
+    if (from >= to) {
+        return;
     }
 
-    char buffer[4096];
-    uint32_t free_block = 0;
-    uint32_t free_offset = 0;
-    bool found = false;
-    for(uint32_t block = super_cache.inode_bitmap_start; block <= super_cache.inode_bitmap_start + super_cache.inode_bitmap_count - 1; ++block) {
-        disk.readBlock(block, buffer);
-
-        for(uint32_t offset = 0; offset < 8 * super_cache.block_size; ++offset) {
-            if ((buffer[offset / 8] & (1 << (offset % 8))) == 0) {
-                uint32_t inode_index = (block - super_cache.inode_bitmap_start) * (8 * super_cache.block_size) + offset;
-                if (inode_index >= super_cache.total_inodes) {
-                    continue;
-                }
-                found = true;
-                free_block = block;
-                free_offset = offset;
-                break;
-            }
-        }
+    uint32_t disk_block = *mapForFd(fd, inode, from / block_size, 1);
 
-        if (found) break;
+    if (disk_block == 0) {
+        return;
     }
 
-    if (!found) {
-        throw std::runtime_error(std::string("No Free Inode in disk"));
-    }
+    char buffer[4096];
+    disk.readBlocks({ { disk_block, buffer } });
+    std::memset(buffer + from % block_size, 0, to - from);
+    disk.writeBlocks({ { disk_block, buffer } });
 
-    uint32_t inode_index = (free_block - super_cache.inode_bitmap_start) * (8 * super_cache.block_size) + free_offset;
+}
 
-    buffer[free_offset / 8] |= (1 << (free_offset % 8));
-    disk.writeBlock(free_block, buffer);
+const char* FileSystem::readCluster(int fd, const Inode& inode, uint64_t cluster) {
 
-    Inode inode;
-    std::memset(&inode, 0, sizeof(Inode));
-    
-    inode.ref_count = 1;
+    OpenFile& file = fd_table[fd];
 
-    writeInode(inode_index, inode);
+    if (file.cluster_index == cluster) {
+        return file.cluster.data();
+    }
 
-    return inode_index;
-}
+    uint32_t block_size = super_cache.block_size;
+    uint32_t cluster_size = CLUSTER_BLOCKS * block_size;
+    uint32_t first_block = cluster * CLUSTER_BLOCKS;
 
-uint32_t FileSystem::allocateDataBlock() {
+    file.cluster.resize(cluster_size);
+    file.cluster_index = UINT64_MAX;
+    char* data = file.cluster.data();
 
-    if (!isMounted) {
-        throw std::runtime_error(std::string("disk is not mounted yet. Invalid allocateDataBlock call"));
-    }
+    uint32_t slots[CLUSTER_BLOCKS];
+    std::memcpy(slots, mapForFd(fd, inode, first_block, CLUSTER_BLOCKS), sizeof(slots));
 
-    char buffer[4096];
+    // Step 1: A plain cluster is read straight in, holes are zeroes
+    std::vector<BlockRead> reads;
 
-    uint32_t free_block = 0;
-    uint32_t free_offset = 0;
-    bool found = false;
+    if (slots[CLUSTER_BLOCKS - 1] != COMPRESSED_CLUSTER) {
 
-    for(uint32_t block = super_cache.data_bitmap_start; block <= super_cache.data_bitmap_start + super_cache.data_bitmap_count - 1; ++block) {
-        disk.readBlock(block, buffer);
-        for(uint32_t offset = 0; offset < 8 * super_cache.block_size; ++offset) {
-            if((buffer[offset / 8] & (1 << (offset % 8))) == 0) {
-                uint32_t disk_block = (block - super_cache.data_bitmap_start) * (8 * super_cache.block_size) + offset;
-                if(disk_block >= super_cache.total_blocks) {
-                    continue;
-                }
-                free_block = block;
-                free_offset = offset;
-                found = true;
-                break;
+        for (uint32_t i = 0; i < CLUSTER_BLOCKS; ++i) {
+            if (slots[i] == 0) {
+                std::memset(data + i * block_size, 0, block_size);
+            } else {
+                reads.push_back({ slots[i], data + i * block_size });
             }
         }
-        if(found) break;
+
+        disk.readBlocks(reads);
+
+        file.cluster_index = cluster;
+        return data;
     }
 
-    if(!found) {
-        throw std::runtime_error(std::string("No Free Data Block in disk"));
+    // Step 2: A compressed one is read from its leading slots and decoded
+    uint32_t used = 0;
+    while (used < CLUSTER_BLOCKS - 1 && slots[used] != 0) {
+        ++used;
     }
 
-    uint32_t disk_block = (free_block - super_cache.data_bitmap_start) * (8 * super_cache.block_size) + free_offset;
+    std::vector<char> packed(used * block_size);
+    for (uint32_t i = 0; i < used; ++i) {
+        reads.push_back({ slots[i], packed.data() + i * block_size });
+    }
+
+    disk.readBlocks(reads);
+
+    ClusterHeader header = { 0, 0 };
+    if (used > 0) {
+        std::memcpy(&header, packed.data(), sizeof(header));
+    }
 
-    buffer[free_offset / 8] |= (1 << (free_offset % 8));
-    disk.writeBlock(free_block, buffer);
+    if (used == 0 || header.length > packed.size() - sizeof(header) || header.raw_length > cluster_size ||
+        !lzDecompress(packed.data() + sizeof(header), header.length, data, header.raw_length)) {
+        throw std::runtime_error(std::string("Compressed cluster is damaged: ") + std::to_string(cluster));
+    }
 
-    return disk_block;
+    std::memset(data + header.raw_length, 0, cluster_size - header.raw_length);
+    disk.getStats().add(Stats::CLUSTERS_DECOMPRESSED);
 
+    file.cluster_index = cluster;
+    return data;
 }
 
-void FileSystem::unmount() {
+void FileSystem::readCompressed(int fd, const Inode& inode, uint64_t offset, char* out, uint32_t count) {
 
-    if (!isMounted) {
-        throw std::runtime_error(std::string("Disk is not mounted yet. Invalid unmount call"));
-    }
+    uint64_t cluster_size = static_cast<uint64_t>(CLUSTER_BLOCKS) * super_cache.block_size;
 
-    isMounted = false;
+    for (uint32_t done = 0; done < count;) {
+
+        uint64_t at = offset + done;
+        uint32_t n = std::min<uint64_t>(count - done, cluster_size - at % cluster_size);
+
+        std::memcpy(out + done, readCluster(fd, inode, at / cluster_size) + at % cluster_size, n);
+        done += n;
+    }
 
 }
 
+void FileSystem::writeClusters(int fd, uint32_t inode_index, Inode& inode, uint64_t offset, const char* buffer, uint32_t count) {
 
-bool FileSystem::createFile(const std::string& fileName) {
+    uint64_t cluster_size = static_cast<uint64_t>(CLUSTER_BLOCKS) * super_cache.block_size;
+    std::vector<char> data;
 
-    if (!isMounted) {
-        throw std::runtime_error("Disk is not mounted.");
-    }
+    for (uint64_t cluster = offset / cluster_size; cluster * cluster_size < offset + count; ++cluster) {
 
-    if (fileName.empty() || fileName.length() > MAX_NAME_LEN) {
-        return false;
-    }
+        uint64_t cluster_start = cluster * cluster_size;
+        uint64_t from = std::max<uint64_t>(offset, cluster_start);
+        uint64_t to = std::min<uint64_t>(offset + count, cluster_start + cluster_size);
 
-    // Root inode is inode 0
-    uint32_t root_inode_index = 0;
-    Inode root = readInode(root_inode_index);
+        // Step 1: Start from the old bytes, unless every one of them up to the
+        // end of the file is overwritten
+        uint64_t live_end = std::min<uint64_t>(inode.size, cluster_start + cluster_size);
+        bool keeps_old = (from > cluster_start && live_end > cluster_start) || to < live_end;
 
-    if (root.mode != 0) {
-        throw std::runtime_error("Root inode is not a directory.");
-    }
+        data.resize(cluster_size);
 
-    char buffer[4096];
+        if (keeps_old) {
+            std::memcpy(data.data(), readCluster(fd, inode, cluster), cluster_size);
+        } else {
+            std::fill(data.begin(), data.end(), 0);
+        }
 
-    // Step 1: Check for duplicate filenames
-    uint32_t entries_per_block = super_cache.block_size / sizeof(DirEntry);
+        // Step 2: Put the new bytes in and store the whole cluster again
+        if (buffer != nullptr) {
+            std::memcpy(data.data() + (from - cluster_start), buffer + (from - offset), to - from);
+            disk.getStats().add(Stats::BYTES_COPIED, to - from);
+        } else {
+            std::memset(data.data() + (from - cluster_start), 0, to - from);
+        }
 
-    for (int i = 0; i < 12; ++i) {
+        storeCluster(fd, inode_index, inode, cluster, data);
+    }
 
-        if (root.direct_blocks[i] == 0)
-            continue;
+}
 
-        disk.readBlock(root.direct_blocks[i], buffer);
-        DirEntry* entries = reinterpret_cast<DirEntry*>(buffer);
+void FileSystem::storeCluster(int fd, uint32_t inode_index, Inode& inode, uint64_t cluster, std::vector<char>& data) {
 
-        for (uint32_t j = 0; j < entries_per_block; ++j) {
+    uint32_t block_size = super_cache.block_size;
+    uint32_t first_block = cluster * CLUSTER_BLOCKS;
 
-            if (entries[j].inode != 0) {
+    uint32_t old_slots[CLUSTER_BLOCKS];
+    std::memcpy(old_slots, mapForFd(fd, inode, first_block, CLUSTER_BLOCKS), sizeof(old_slots));
 
-                std::string existingName(entries[j].name, entries[j].name_len);
+    // Step 1: Blocks of zeroes become holes, and those at the end of the
+    // cluster are not encoded either
+    bool stored[CLUSTER_BLOCKS];
+    uint32_t stored_count = 0;
+    uint32_t raw_length = 0;
 
-                if (existingName == fileName) {
-                    return false;  // Duplicate found
-                }
-            }
+    for (uint32_t i = 0; i < CLUSTER_BLOCKS; ++i) {
+        stored[i] = std::memcmp(data.data() + i * block_size, zero_block, block_size) != 0;
+        if (stored[i]) {
+            ++stored_count;
+            raw_length = (i + 1) * block_size;
         }
     }
 
-    // Step 2: Allocate new inode
-    uint32_t new_inode_index = allocateInode();
+    // Step 2: Encode, and keep the result only if it saves a block. The
+    // codec gives up as soon as its output would not.
+    std::vector<char> packed;
+    uint32_t packed_blocks = 0;
 
-    Inode new_inode;
-    std::memset(&new_inode, 0, sizeof(Inode));
-    new_inode.mode = 1;  // file
-    new_inode.size = 0;
-    new_inode.ref_count = 1;
+    if (stored_count > 1) {
 
-    writeInode(new_inode_index, new_inode);
+        packed.resize((stored_count - 1) * block_size);
+        uint32_t length = lzCompress(data.data(), raw_length, packed.data() + sizeof(ClusterHeader), packed.size() - sizeof(ClusterHeader));
+
+        if (length > 0) {
+            ClusterHeader header = { length, raw_length };
+            std::memcpy(packed.data(), &header, sizeof(header));
+            packed_blocks = (sizeof(header) + length + block_size - 1) / block_size;
+            disk.getStats().add(Stats::CLUSTERS_COMPRESSED);
+        }
+    }
 
-    // Step 3: Add directory entry to root
-    bool inserted = false;
+    // Step 3: Write into new blocks, placed after those of the previous
+    // cluster when that space is free
+    uint32_t new_slots[CLUSTER_BLOCKS] = {};
+    uint32_t new_count = packed_blocks > 0 ? packed_blocks : stored_count;
 
-    for (int i = 0; i < 12 && !inserted; ++i) {
+    if (new_count > 0) {
 
-        // Allocate new directory block if needed
-        if (root.direct_blocks[i] == 0) {
-            uint32_t new_block = allocateDataBlock();
-            root.direct_blocks[i] = new_block;
+        int64_t goal = dataGoal(inode_index);
 
-            std::memset(buffer, 0, sizeof(buffer));
-            disk.writeBlock(new_block, buffer);
+        if (cluster > 0) {
+            const uint32_t* previous = mapForFd(fd, inode, first_block - CLUSTER_BLOCKS, CLUSTER_BLOCKS);
+            for (uint32_t i = 0; i < CLUSTER_BLOCKS; ++i) {
+                if (previous[i] != 0 && previous[i] != COMPRESSED_CLUSTER) {
+                    goal = previous[i] + 1;
+                }
+            }
         }
 
-        disk.readBlock(root.direct_blocks[i], buffer);
-        DirEntry* entries = reinterpret_cast<DirEntry*>(buffer);
+        std::vector<uint32_t> blocks;
+        for (const Extent& extent : allocateDataBlocks(new_count, goal)) {
+            for (uint32_t i = 0; i < extent.length; ++i) {
+                blocks.push_back(extent.start + i);
+            }
+        }
 
-        for (uint32_t j = 0; j < entries_per_block; ++j) {
+        std::vector<BlockWrite> writes;
 
-            if (entries[j].inode == 0) {
+        if (packed_blocks > 0) {
+            for (uint32_t i = 0; i < packed_blocks; ++i) {
+                new_slots[i] = blocks[i];
+                writes.push_back({ blocks[i], packed.data() + i * block_size });
+            }
+            new_slots[CLUSTER_BLOCKS - 1] = COMPRESSED_CLUSTER;
+        } else {
+            size_t next = 0;
+            for (uint32_t i = 0; i < CLUSTER_BLOCKS; ++i) {
+                if (stored[i]) {
+                    new_slots[i] = blocks[next++];
+                    writes.push_back({ new_slots[i], data.data() + i * block_size });
+                }
+            }
+        }
 
-                entries[j].inode = new_inode_index;
-                entries[j].name_len = fileName.length();
-                std::memset(entries[j].name, 0, MAX_NAME_LEN);
-                std::memcpy(entries[j].name, fileName.c_str(), fileName.length());
-                entries[j].pad = 0;
+        disk.writeBlocks(writes);
+    }
 
-                disk.writeBlock(root.direct_blocks[i], buffer);
+    // Step 4: Point the cluster at them; the old blocks are freed with the
+    // transaction, so until it commits the image still holds the old cluster
+    std::vector<std::pair<uint32_t, uint32_t>> mapping;
+    std::vector<uint32_t> old_blocks;
 
-                root.size += sizeof(DirEntry);
-                inserted = true;
-                break;
-            }
+    for (uint32_t i = 0; i < CLUSTER_BLOCKS; ++i) {
+        if (new_slots[i] != old_slots[i]) {
+            mapping.push_back({ first_block + i, new_slots[i] });
+        }
+        if (old_slots[i] != 0 && old_slots[i] != COMPRESSED_CLUSTER) {
+            old_blocks.push_back(old_slots[i]);
         }
     }
 
-    if (!inserted) {
-        throw std::runtime_error("Root directory is full.");
+    if (!mapping.empty()) {
+        assignBlocks(inode, mapping);
     }
 
-    // Step 4: Write updated root inode
-    writeInode(root_inode_index, root);
+    freeDataBlocks(old_blocks);
+    invalidateBlockMaps(inode_index, first_block);
 
-    return true;
-}
+    // The writer keeps the cluster decoded, the next write or read of it
+    // does not have to go back to the disk
+    fd_table[fd].cluster.swap(data);
+    fd_table[fd].cluster_index = cluster;
 
+}
 
-int FileSystem::openFile(const std::string& fileName) {
+bool FileSystem::truncateFile(int fd, uint64_t size) {
 
     if (!isMounted) {
         throw std::runtime_error("Disk is not mounted.");
     }
 
-    if (fileName.empty()) {
-        return -1;
+    if (fd < 0 || fd >= MAX_OPEN_FILES) {
+        return false;
     }
 
-    // Step 1: Search root directory (inode 0)
-    uint32_t root_inode_index = 0;
-    Inode root = readInode(root_inode_index);
+    Operation operation(*this);
+    std::lock_guard<std::mutex> file_guard(fd_table[fd].lock);
 
-    if (root.mode != 0) {
-        throw std::runtime_error("Root inode is not a directory.");
+    if (!fd_table[fd].in_use) {
+        return false;
     }
 
-    char buffer[4096];
-    uint32_t entries_per_block = super_cache.block_size / sizeof(DirEntry);
-
-    int found_inode = -1;
+    uint32_t inode_index = fd_table[fd].inode_index;
+    ExclusiveLock inode_lock(inodeLock(inode_index));
+    Inode inode = readInode(inode_index);
 
-    for (int i = 0; i < 12; ++i) {
+    uint32_t block_size = super_cache.block_size;
 
-        if (root.direct_blocks[i] == 0)
-            continue;
+    if (inode.mode != 1 || size > maxFileBlocks() * block_size) {
+        return false;
+    }
 
-        disk.readBlock(root.direct_blocks[i], buffer);
-        DirEntry* entries = reinterpret_cast<DirEntry*>(buffer);
+    // Step 1: Buffered appends belong to the old size
+    if (tails_pending.load() > 0) {
+        flushTails(inode_index, inode, fd);
+    }
 
-        for (uint32_t j = 0; j < entries_per_block; ++j) {
+    // An inline file stays inline while the new size fits, the bytes past
+    // the end are zeroed like those of a block
+    if (isInline(inode)) {
 
-            if (entries[j].inode != 0) {
+        if (size <= INLINE_DATA_SIZE) {
+            if (size < inode.size) {
+                storeInline(inode, size, zero_block, inode.size - size);
+            }
 
-                std::string existingName(entries[j].name, entries[j].name_len);
+            inode.size = size;
+            writeInode(inode_index, inode);
 
-                if (existingName == fileName) {
-                    found_inode = entries[j].inode;
-                    break;
-                }
-            }
+            return true;
         }
 
-        if (found_inode != -1)
-            break;
-    }
-
-    if (found_inode == -1) {
-        return -1;  // File not found
+        promoteInline(fd, inode_index, inode);
     }
 
-    // Step 2: Find free file descriptor slot
-    for (int fd = 0; fd < MAX_OPEN_FILES; ++fd) {
+    // Step 2: Shrinking frees every block past the new end. The bytes after
+    // it in its last block are zeroed, so they read as zeroes if the file
+    // grows again (the rest of the file past the end is holes). Compressed
+    // files do the same a whole cluster at a time.
+    if (size < inode.size) {
 
-        if (!fd_table[fd].in_use) {
+        uint32_t unit_blocks = isCompressed(inode) ? CLUSTER_BLOCKS : 1;
+        uint64_t unit = static_cast<uint64_t>(unit_blocks) * block_size;
+        uint64_t keep = (size + unit - 1) / unit * unit_blocks;
 
-            fd_table[fd].inode_index = found_inode;
-            fd_table[fd].offset = 0;
-            fd_table[fd].in_use = true;
+        freeBlockRange(inode, keep, (inode.size + unit - 1) / unit * unit_blocks);
+        invalidateBlockMaps(inode_index, keep);
 
-            return fd;
+        if (size % unit != 0 && isCompressed(inode)) {
+            writeClusters(fd, inode_index, inode, size, nullptr, keep * block_size - size);
+        } else if (size % unit != 0) {
+            zeroPartial(fd, inode, size, keep * block_size);
         }
     }
 
-    return -1;  // No free file descriptor
-}
+    // Step 3: Growing only moves the end, the new part is a hole
+    inode.size = size;
+    writeInode(inode_index, inode);
 
+    return true;
+}
 
-bool FileSystem::closeFile(int fd) {
+bool FileSystem::punchHole(int fd, uint64_t offset, uint64_t length) {
 
     if (!isMounted) {
         throw std::runtime_error("Disk is not mounted.");
@@ -466,162 +2540,206 @@ bool FileSystem::closeFile(int fd) {
         return false;
     }
 
+    Operation operation(*this);
+    std::lock_guard<std::mutex> file_guard(fd_table[fd].lock);
+
     if (!fd_table[fd].in_use) {
         return false;
     }
 
-    fd_table[fd].in_use = false;
-    fd_table[fd].offset = 0;
-    fd_table[fd].inode_index = 0;
+    uint32_t inode_index = fd_table[fd].inode_index;
+    ExclusiveLock inode_lock(inodeLock(inode_index));
+    Inode inode = readInode(inode_index);
+
+    if (inode.mode != 1) {
+        return false;
+    }
 
-    return true;
-}
+    if (tails_pending.load() > 0) {
+        flushTails(inode_index, inode, fd);
+    }
 
+    // Step 1: Nothing past the end of the file is punched, the size stays
+    uint32_t block_size = super_cache.block_size;
+    uint64_t end = length > inode.size ? inode.size : std::min<uint64_t>(offset + length, inode.size);
 
-int FileSystem::readFile(int fd, char* buffer, uint32_t count) {
+    if (offset >= end) {
+        return true;
+    }
 
-    if (!isMounted) {
-        throw std::runtime_error("Disk is not mounted.");
+    if (isInline(inode)) {
+        storeInline(inode, offset, zero_block, end - offset);
+        writeInode(inode_index, inode);
+        return true;
     }
 
-    if (fd < 0 || fd >= MAX_OPEN_FILES || !fd_table[fd].in_use) {
-        return -1;
+    // Step 2: Free the blocks which are covered completely. The last block of
+    // the file counts as covered when the range runs to the end of the file.
+    // Compressed files free whole clusters only.
+    uint32_t unit_blocks = isCompressed(inode) ? CLUSTER_BLOCKS : 1;
+    uint64_t unit = static_cast<uint64_t>(unit_blocks) * block_size;
+    uint64_t first_whole = (offset + unit - 1) / unit;
+    uint64_t end_whole = end == inode.size ? (end + unit - 1) / unit : end / unit;
+
+    if (first_whole < end_whole) {
+        freeBlockRange(inode, first_whole * unit_blocks, end_whole * unit_blocks);
+        invalidateBlockMaps(inode_index, first_whole * unit_blocks);
+        writeInode(inode_index, inode);
     }
 
-    uint32_t inode_index = fd_table[fd].inode_index;
-    Inode inode = readInode(inode_index);
+    // Step 3: Zero the partly covered blocks (clusters) at either end, or
+    // the one the range starts and ends inside
+    uint64_t head_end = std::min<uint64_t>(end, first_whole * unit);
+    uint64_t tail_start = std::max<uint64_t>(head_end, end_whole * unit);
 
-    if (inode.mode != 1) {
-        return -1;  // Not a file
+    if (isCompressed(inode)) {
+        if (offset < head_end) {
+            writeClusters(fd, inode_index, inode, offset, nullptr, head_end - offset);
+        }
+        if (tail_start < end) {
+            writeClusters(fd, inode_index, inode, tail_start, nullptr, end - tail_start);
+        }
+        writeInode(inode_index, inode);
+        return true;
     }
 
-    uint32_t offset = fd_table[fd].offset;
+    zeroPartial(fd, inode, offset, head_end);
+    zeroPartial(fd, inode, tail_start, end);
 
-    if (offset >= inode.size) {
-        return 0;  // EOF
-    }
+    return true;
+}
 
-    uint32_t bytes_available = inode.size - offset;
-    uint32_t bytes_to_read = std::min(count, bytes_available);
+void FileSystem::appendToTail(int fd, Inode& inode, const char* buffer, uint32_t count) {
 
-    uint32_t total_read = 0;
-    char blockBuffer[4096];
+    OpenFile& file = fd_table[fd];
+    uint32_t block_size = super_cache.block_size;
+    uint32_t unit = isCompressed(inode) ? CLUSTER_BLOCKS * block_size : block_size;
 
-    while (total_read < bytes_to_read) {
+    // Step 1: A new buffer starts at the block (the cluster, when compressed)
+    // holding the end of the file, with the bytes that part already has
+    if (!file.has_tail) {
 
-        uint32_t current_offset = offset + total_read;
+        file.tail_start = file.offset - file.offset % unit;
+        file.tail.reserve(TAIL_BLOCKS * block_size);
+        file.tail.resize(file.offset - file.tail_start);
 
-        uint32_t block_index = current_offset / super_cache.block_size;
-        uint32_t block_offset = current_offset % super_cache.block_size;
+        if (!file.tail.empty() && isCompressed(inode)) {
+            readCompressed(fd, inode, file.tail_start, file.tail.data(), file.tail.size());
+        } else if (!file.tail.empty()) {
 
-        if (block_index >= 12) {
-            break;  // Only supporting direct blocks for now
-        }
+            uint32_t disk_block = *mapForFd(fd, inode, file.tail_start / block_size, 1);
+            char data[4096];
 
-        uint32_t disk_block = inode.direct_blocks[block_index];
+            if (disk_block == 0) {
+                std::memset(data, 0, block_size);
+            } else {
+                disk.readBlocks({ { disk_block, data } });
+            }
 
-        if (disk_block == 0) {
-            break;
+            std::memcpy(file.tail.data(), data, file.tail.size());
         }
 
-        disk.readBlock(disk_block, blockBuffer);
-
-        uint32_t bytes_from_block =
-            std::min(
-                super_cache.block_size - block_offset,
-                bytes_to_read - total_read
-            );
+        file.has_tail.store(true, std::memory_order_release);
+        ++tails_pending;
+    }
 
-        std::memcpy(
-            buffer + total_read,
-            blockBuffer + block_offset,
-            bytes_from_block
-        );
+    // Step 2: Append, and write the buffer out once it is full
+    file.tail.insert(file.tail.end(), buffer, buffer + count);
+    file.offset += count;
+    disk.getStats().add(Stats::BYTES_COPIED, count);
 
-        total_read += bytes_from_block;
+    if (file.tail.size() >= TAIL_BLOCKS * block_size) {
+        flushTail(fd, fd, inode, true);
     }
 
-    fd_table[fd].offset += total_read;
-
-    return total_read;
 }
 
+void FileSystem::flushTail(int owner, int fd, Inode& inode, bool keep_partial) {
 
-int FileSystem::writeFile(int fd, const char* buffer, uint32_t count) {
+    OpenFile& file = fd_table[owner];
+    uint32_t block_size = super_cache.block_size;
+    uint32_t unit = isCompressed(inode) ? CLUSTER_BLOCKS * block_size : block_size;
+    uint64_t end = file.tail_start + file.tail.size();
 
-    if (!isMounted) {
-        throw std::runtime_error("Disk is not mounted.");
+    // Step 1: Whole blocks only, the bytes after the end of the file are zeroes
+    size_t whole = (file.tail.size() + block_size - 1) / block_size * block_size;
+    file.tail.resize(whole, 0);
+
+    if (whole > 0) {
+        writeAt(fd, file.inode_index, inode, file.tail_start, file.tail.data(), whole);
     }
 
-    if (fd < 0 || fd >= MAX_OPEN_FILES || !fd_table[fd].in_use) {
-        return -1;
+    if (end > inode.size) {
+        inode.size = end;
     }
 
-    uint32_t inode_index = fd_table[fd].inode_index;
-    Inode inode = readInode(inode_index);
+    writeInode(file.inode_index, inode);
 
-    if (inode.mode != 1) {
-        return -1;  // Not a regular file
+    // Step 2: The block (cluster) holding the end of the file stays buffered
+    // for the next append, so it does not have to be read back
+    if (keep_partial && end % unit != 0) {
+        file.tail.erase(file.tail.begin(), file.tail.begin() + (end - end % unit - file.tail_start));
+        file.tail.resize(end % unit);
+        file.tail_start = end - end % unit;
+        return;
     }
 
-    uint32_t offset = fd_table[fd].offset;
-    uint32_t total_written = 0;
+    file.tail.clear();
+    file.has_tail.store(false, std::memory_order_release);
+    --tails_pending;
 
-    char blockBuffer[4096];
-
-    while (total_written < count) {
+}
 
-        uint32_t current_offset = offset + total_written;
+bool FileSystem::hasTails(uint32_t inode_index) {
 
-        uint32_t block_index = current_offset / super_cache.block_size;
-        uint32_t block_offset = current_offset % super_cache.block_size;
+    if (tails_pending.load() == 0) {
+        return false;
+    }
 
-        if (block_index >= 12) {
-            break;  // Only supporting direct blocks
+    for (int x = 0; x < MAX_OPEN_FILES; ++x) {
+        if (fd_table[x].has_tail.load(std::memory_order_acquire) && fd_table[x].inode_index == inode_index) {
+            return true;
         }
+    }
 
-        // Allocate block if needed
-        if (inode.direct_blocks[block_index] == 0) {
+    return false;
+}
 
-            uint32_t new_block = allocateDataBlock();
-            inode.direct_blocks[block_index] = new_block;
+void FileSystem::flushTails(uint32_t inode_index, Inode& inode, int fd) {
 
-            // Initialize block with zeros
-            std::memset(blockBuffer, 0, super_cache.block_size);
-            disk.writeBlock(new_block, blockBuffer);
+    // Buffers are guarded by the inode lock (held exclusively here), not by
+    // their descriptor's lock, so those of other descriptors may be written too
+    for (int x = 0; x < MAX_OPEN_FILES; ++x) {
+        if (fd_table[x].has_tail.load(std::memory_order_acquire) && fd_table[x].inode_index == inode_index) {
+            flushTail(x, fd, inode, false);
         }
+    }
 
-        uint32_t disk_block = inode.direct_blocks[block_index];
+}
 
-        disk.readBlock(disk_block, blockBuffer);
+void FileSystem::flushAllTails() {
 
-        uint32_t bytes_to_block =
-            std::min(
-                super_cache.block_size - block_offset,
-                count - total_written
-            );
+    for (int fd = 0; fd < MAX_OPEN_FILES && tails_pending.load() > 0; ++fd) {
 
-        std::memcpy(
-            blockBuffer + block_offset,
-            buffer + total_written,
-            bytes_to_block
-        );
+        if (!fd_table[fd].has_tail.load(std::memory_order_acquire)) {
+            continue;
+        }
 
-        disk.writeBlock(disk_block, blockBuffer);
+        Operation operation(*this);
+        std::lock_guard<std::mutex> file_guard(fd_table[fd].lock);
 
-        total_written += bytes_to_block;
-    }
+        if (!fd_table[fd].in_use || !fd_table[fd].has_tail) {
+            continue;
+        }
 
-    fd_table[fd].offset += total_written;
+        ExclusiveLock inode_lock(inodeLock(fd_table[fd].inode_index));
+        Inode inode = readInode(fd_table[fd].inode_index);
 
-    uint32_t new_end = offset + total_written;
-    if (new_end > inode.size) {
-        inode.size = new_end;
+        if (fd_table[fd].has_tail) {
+            flushTail(fd, fd, inode, false);
+        }
     }
 
-    writeInode(inode_index, inode);
-
-    return total_written;
 }
 
 
@@ -631,158 +2749,185 @@ bool FileSystem::deleteFile(const std::string& fileName) {
         throw std::runtime_error("Disk is not mounted.");
     }
 
-    if (fileName.empty()) {
-        return false;
-    }
+    Stats::Timer timer(disk.getStats(), Stats::DELETE_FILE_NS);
 
-    uint32_t root_inode_index = 0;
-    Inode root = readInode(root_inode_index);
+    Operation operation(*this);
 
-    char buffer[4096];
-    uint32_t entries_per_block = super_cache.block_size / sizeof(DirEntry);
+    uint32_t parent_index;
+    std::string name;
+    ExclusiveLock parent_lock;
 
-    int target_block = -1;
-    int target_entry = -1;
-    uint32_t target_inode = 0;
+    if (!resolveParent(fileName, &parent_index, &name, &parent_lock, nullptr)) {
+        return false;
+    }
+
+    Inode parent = readInode(parent_index);
 
     // Step 1: Find directory entry
-    for (int i = 0; i < 12; ++i) {
+    int64_t found_inode = lookupChild(parent_index, parent, name);
 
-        if (root.direct_blocks[i] == 0)
-            continue;
+    if (found_inode < 0) {
+        return false;  // File not found
+    }
 
-        disk.readBlock(root.direct_blocks[i], buffer);
-        DirEntry* entries = reinterpret_cast<DirEntry*>(buffer);
+    uint32_t target_inode = found_inode;
+    ExclusiveLock file_lock(inodeLock(target_inode));
+    Inode inode = readInode(target_inode);
 
-        for (uint32_t j = 0; j < entries_per_block; ++j) {
+    if (inode.mode != 1) {
+        return false;  // Directories are removed with deleteDirectory
+    }
 
-            if (entries[j].inode != 0) {
+    // Step 2: Ensure file not open. openFile registers descriptors while it
+    // holds the file's lock, so none can appear while this one is held.
+    for (int shard = 0; shard < FD_SHARDS; ++shard) {
 
-                std::string existing(entries[j].name, entries[j].name_len);
+        std::lock_guard<std::mutex> guard(fd_shard_locks[shard]);
 
-                if (existing == fileName) {
-                    target_block = root.direct_blocks[i];
-                    target_entry = j;
-                    target_inode = entries[j].inode;
-                    break;
-                }
+        for (int i = shard * (MAX_OPEN_FILES / FD_SHARDS); i < (shard + 1) * (MAX_OPEN_FILES / FD_SHARDS); ++i) {
+            if (fd_table[i].in_use &&
+                fd_table[i].inode_index == target_inode) {
+                return false;
             }
         }
-
-        if (target_inode != 0)
-            break;
     }
 
-    if (target_inode == 0) {
-        return false;  // File not found
-    }
+    // Step 3: Free data blocks and indirect blocks
+    freeFileBlocks(inode);
 
-    // Step 2: Ensure file not open
-    for (int i = 0; i < MAX_OPEN_FILES; ++i) {
-        if (fd_table[i].in_use &&
-            fd_table[i].inode_index == target_inode) {
-            return false;
-        }
+    // Step 4: Free inode bitmap
+    dropInode(target_inode);
+    freeInode(target_inode);
+
+    // Step 5: Remove directory entry
+    removeEntry(parent, name);
+    cacheDentry(parent_index, name, DentryCache::NEGATIVE);
+
+    return true;
+}
+
+
+std::vector<bool> FileSystem::deleteFiles(const std::vector<std::string>& fileNames) {
+
+    if (!isMounted) {
+        throw std::runtime_error("Disk is not mounted.");
     }
 
-    Inode inode = readInode(target_inode);
+    Stats::Timer timer(disk.getStats(), Stats::DELETE_FILES_NS);
 
-    // Step 3: Free data blocks
-    for (int i = 0; i < 12; ++i) {
+    std::vector<bool> deleted(fileNames.size(), false);
 
-        if (inode.direct_blocks[i] != 0) {
+    for (const auto& batch : groupByParent(fileNames)) {
 
-            uint32_t disk_block = inode.direct_blocks[i];
+        std::vector<std::string> parent_components = splitPath(batch.first);
 
-            uint32_t bitmap_block =
-                super_cache.data_bitmap_start +
-                (disk_block / (super_cache.block_size * 8));
+        for (size_t chunk = 0; chunk < batch.second.size(); chunk += BATCH_FILES) {
 
-            uint32_t bit_offset =
-                disk_block % (super_cache.block_size * 8);
+            size_t chunk_end = std::min<size_t>(batch.second.size(), chunk + BATCH_FILES);
 
-            char bitmap_buffer[4096];
-            disk.readBlock(bitmap_block, bitmap_buffer);
+            Operation operation(*this);
 
-            bitmap_buffer[bit_offset / 8] &=
-                ~(1 << (bit_offset % 8));
+            ExclusiveLock parent_lock;
+            int64_t parent_index = walkPath(parent_components, parent_components.size(), &parent_lock, nullptr);
 
-            disk.writeBlock(bitmap_block, bitmap_buffer);
+            if (parent_index < 0) {
+                continue;
+            }
 
-            inode.direct_blocks[i] = 0;
-        }
-    }
+            Inode parent = readInode(parent_index);
 
-    // Step 4: Free inode bitmap
-    uint32_t inode_bitmap_block =
-        super_cache.inode_bitmap_start +
-        (target_inode / (super_cache.block_size * 8));
+            if (parent.mode != 0) {
+                continue;
+            }
 
-    uint32_t inode_bit_offset =
-        target_inode % (super_cache.block_size * 8);
+            // Step 1: Find the entries (inode, path index, name)
+            std::vector<std::tuple<uint32_t, size_t, std::string>> targets;
+            std::set<std::string> seen;
 
-    char inode_bitmap_buffer[4096];
-    disk.readBlock(inode_bitmap_block, inode_bitmap_buffer);
+            for (size_t k = chunk; k < chunk_end; ++k) {
 
-    inode_bitmap_buffer[inode_bit_offset / 8] &=
-        ~(1 << (inode_bit_offset % 8));
+                std::vector<std::string> components = splitPath(fileNames[batch.second[k]]);
+                if (components.empty() || !seen.insert(components.back()).second) {
+                    continue;
+                }
 
-    disk.writeBlock(inode_bitmap_block, inode_bitmap_buffer);
+                int64_t found_inode = lookupChild(parent_index, parent, components.back());
 
-    // Step 5: Remove directory entry
-    disk.readBlock(target_block, buffer);
-    DirEntry* entries = reinterpret_cast<DirEntry*>(buffer);
+                if (found_inode >= 0) {
+                    targets.emplace_back(found_inode, batch.second[k], components.back());
+                }
+            }
 
-    entries[target_entry].inode = 0;
-    entries[target_entry].name_len = 0;
-    std::memset(entries[target_entry].name, 0, MAX_NAME_LEN);
+            // Step 2: Open descriptors. openFile finds files through their
+            // directory, which is locked, so no descriptor of these files can
+            // appear now and one pass over the table covers all of them.
+            std::set<uint32_t> open_inodes;
 
-    disk.writeBlock(target_block, buffer);
+            for (int shard = 0; shard < FD_SHARDS; ++shard) {
 
-    // Step 6: Update root size
-    root.size -= sizeof(DirEntry);
-    writeInode(root_inode_index, root);
+                std::lock_guard<std::mutex> guard(fd_shard_locks[shard]);
 
-    return true;
-}
+                for (int i = shard * (MAX_OPEN_FILES / FD_SHARDS); i < (shard + 1) * (MAX_OPEN_FILES / FD_SHARDS); ++i) {
+                    if (fd_table[i].in_use) {
+                        open_inodes.insert(fd_table[i].inode_index);
+                    }
+                }
+            }
 
+            // Step 3: Free the files' blocks and entries, then their inodes together
+            std::vector<uint32_t> freed_inodes;
 
-void FileSystem::listFiles() {
+            for (const auto& target : targets) {
 
-    if (!isMounted) {
-        throw std::runtime_error("Disk is not mounted.");
-    }
+                uint32_t target_inode = std::get<0>(target);
+                ExclusiveLock file_lock(inodeLock(target_inode));
+                Inode inode = readInode(target_inode);
+
+                if (inode.mode != 1 || open_inodes.count(target_inode) != 0) {
+                    continue;  // Directories are removed with deleteDirectory, open files stay
+                }
 
-    uint32_t root_inode_index = 0;
-    Inode root = readInode(root_inode_index);
+                freeFileBlocks(inode);
+                dropInode(target_inode);
+                freed_inodes.push_back(target_inode);
 
-    if (root.mode != 0) {
-        throw std::runtime_error("Root inode is not a directory.");
+                removeEntry(parent, std::get<2>(target));
+                cacheDentry(parent_index, std::get<2>(target), DentryCache::NEGATIVE);
+
+                deleted[std::get<1>(target)] = true;
+            }
+
+            freeInodes(freed_inodes);
+        }
     }
 
-    char buffer[4096];
-    uint32_t entries_per_block = super_cache.block_size / sizeof(DirEntry);
+    return deleted;
+}
 
-    for (int i = 0; i < 12; ++i) {
 
-        if (root.direct_blocks[i] == 0)
-            continue;
+void FileSystem::listFiles(const std::string& path) {
 
-        disk.readBlock(root.direct_blocks[i], buffer);
-        DirEntry* entries = reinterpret_cast<DirEntry*>(buffer);
+    if (!isMounted) {
+        throw std::runtime_error("Disk is not mounted.");
+    }
 
-        for (uint32_t j = 0; j < entries_per_block; ++j) {
+    std::vector<std::string> components = splitPath(path);
+    SharedLock dir_lock;
+    int64_t dir_index = walkPath(components, components.size(), nullptr, &dir_lock);
 
-            if (entries[j].inode != 0) {
+    if (dir_index < 0) {
+        throw std::runtime_error("No such directory: " + path);
+    }
 
-                std::string name(entries[j].name, entries[j].name_len);
+    Inode dir = readInode(dir_index);
 
-                if (name == "." || name == "..")
-                    continue;
+    if (dir.mode != 0) {
+        throw std::runtime_error("Not a directory: " + path);
+    }
 
-                std::cout << name << "\n";
-            }
-        }
+    // Directories are listed with a trailing '/'
+    for (const DirEntry& entry : readDirectory(dir)) {
+        std::string name(entry.name, entry.name_len);
+        std::cout << name << (readInode(entry.inode).mode == 0 ? "/" : "") << "\n";
     }
 }
-
@@ -1,81 +1,444 @@
+#include <atomic>
 #include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <vector>
 #include "../disk/disk.h"
+#include "bitmap.h"
+#include "inode_cache.h"
+#include "dentry_cache.h"
 #define MAX_NAME_LEN 52
 
-// 0            -> Superblock
-// 1-2          -> Inode bitmap
-// 3-6          -> Data bitmap
-// 7-2054       -> Inode table
-// 2055-131071  -> Data block
+// The disk is split into block groups of 32768 blocks, each holding 16384
+// inodes and the data blocks for them. mkfs makes as many groups as the image
+// holds (the last one may be shorter), so G below, the number of descriptor
+// table blocks, grows with the image:
+//
+// Group 0:
+// 0                -> Superblock
+// 1 - G            -> Group descriptor table
+// G+1              -> Data bitmap of the group
+// G+2              -> Inode bitmap of the group
+// G+3 - G+514      -> Inode table of the group
+// G+515 - G+4610   -> Journal
+// G+4611 - 32767   -> Data block
+//
+// Group g > 0, relative to its first block g * 32768:
+// +0               -> Data bitmap of the group
+// +1               -> Inode bitmap of the group
+// +2-513           -> Inode table of the group
+// +514-32767       -> Data block
+//
+// Block numbers are 32 bit, so an image may hold up to 2^32 - 1 blocks (16 TiB).
 
+#define FS_VERSION 2        // Layout of this file; mount refuses any other version
+
+// Incompatible features: mount refuses an image with a bit it does not know
+#define FS_FEATURE_INLINE_DATA 0x1      // Small files live in their inode (INODE_INLINE)
+#define FS_FEATURE_COMPRESSION 0x2      // Files may keep their data compressed (INODE_COMPRESSED)
+#define FS_FEATURES_SUPPORTED (FS_FEATURE_INLINE_DATA | FS_FEATURE_COMPRESSION)
+
+// New fields go at the end, the rest of block 0 reads as zero on older images
 struct Superblock {
     uint32_t magic;
+    uint32_t version;
+    uint32_t features;
     uint32_t block_size;
-    uint32_t total_blocks;
+
+    uint64_t total_blocks;
     uint32_t total_inodes;
 
-    uint32_t data_bitmap_start;
-    uint32_t data_bitmap_count;
+    uint32_t blocks_per_group;
+    uint32_t inodes_per_group;
+    uint32_t group_count;
+    uint32_t group_desc_start;
+    uint32_t group_desc_blocks;
 
-    uint32_t inode_bitmap_start;
-    uint32_t inode_bitmap_count;
+    uint32_t journal_start;
+    uint32_t journal_count;
+
+    // Free space summary, written by sync and unmount. The counts here and in
+    // the group descriptors are only trusted when state is FS_CLEAN.
+    uint64_t free_blocks;
+    uint32_t free_inodes;
+    uint32_t state;
+};
 
-    uint32_t inode_table_start;
-    uint32_t inode_table_count;
+#define FS_DIRTY 0          // Mounted, or not unmounted cleanly
+#define FS_CLEAN 1
 
+// Size of one Group Descriptor is 32 bytes
+struct GroupDesc {
+    uint32_t block_bitmap;          // Bit i is block (group start + i)
+    uint32_t inode_bitmap;          // Bit i is inode (group * inodes_per_group + i)
+    uint32_t inode_table;
     uint32_t first_data_block;
+    uint32_t free_blocks;
+    uint32_t free_inodes;
+    uint32_t pad[2];
 };
 
-// Size of one Inode is 128 bytes
+// Answer of FileSystem::statfs(). Blocks freed by the running transaction
+// count as free, the first call which needs them commits it.
+struct FsStat {
+    uint32_t block_size;
+    uint64_t total_blocks;
+    uint64_t free_blocks;
+    uint64_t total_inodes;
+    uint64_t free_inodes;
+};
+
+// Size of one Inode is 128 bytes. An INODE_INLINE file has no blocks: its
+// bytes are kept in direct_blocks and indirect_blocks (60 bytes) and go on in
+// pad (24 bytes). An INODE_COMPRESSED file stores its data in compressed
+// clusters (see FileSystem::setCompression). Each flag is only read on images
+// with the matching feature.
 struct Inode {
     uint16_t mode; // 0 for directory, 1 for file
-    uint32_t size;
+    uint16_t flags;
+    uint64_t size;
     uint64_t timestamps[3];
     uint32_t direct_blocks[12];
-    uint32_t indirect_blocks[2];
+    uint32_t indirect_blocks[3];    // Single, double and triple indirect
     uint32_t ref_count;
-    uint32_t pad[9];
+    uint32_t pad[6];
 };
 
+#define INODE_INLINE 0x1
+#define INODE_COMPRESSED 0x2
+
 // Size of one Directory Entry is 64 bytes
 struct DirEntry {
     uint32_t inode;
     uint16_t name_len;
     char name[MAX_NAME_LEN];
-    uint32_t pad;
+    uint32_t hash;      // Hash of name, see fs/dir.cpp
 };
 
+// Run of physically contiguous blocks
+struct Extent {
+    uint32_t start;
+    uint32_t length;
+};
+
+// Part of a file inside a FileView
+struct FileSpan {
+    const char* data;
+    uint32_t length;
+};
+
+// Read only view of a file range, filled by FileSystem::readView. The spans
+// point straight into the block cache (or the image mapping) and cover the
+// range in file order; blocks next to each other in memory share a span.
+// The bytes of inline and compressed files are copied into the view instead.
+//
+// While a view is alive its blocks stay pinned and the file stays locked
+// shared, so the bytes cannot change, but nothing can write, truncate or
+// delete the file either. Destroy a view (or hand it back to readView, which
+// drops it first) before calling into the FileSystem again.
+class FileView {
+private:
+    friend class FileSystem;
+
+    std::shared_lock<std::shared_mutex> lock;           // Declared first, so blocks are unpinned before it is released
+    std::vector<BlockView> blocks;
+    std::vector<FileSpan> spans;
+    std::vector<char> copied;                           // Inline or decompressed file data
+    uint32_t bytes;
+
+public:
+    FileView() : bytes(0) {}
+    FileView(FileView&&) = default;
+    FileView& operator=(FileView&&) = default;
+
+    const std::vector<FileSpan>& getSpans() const { return spans; }
+    uint32_t size() const { return bytes; }
+};
+
+// FileSystem may be used from many threads at once. Locks are always taken in
+// this order, which rules out deadlocks:
+//
+//   commit_lock (shared by every modifying call, exclusive for a journal commit)
+//   -> OpenFile::lock of the descriptor being used
+//   -> inode locks, parent directory before child (paths are walked with lock
+//      coupling: the next directory is locked before the current one is released)
+//   -> flush_lock, pending_lock, fd table shard locks and the cache shard locks,
+//      which are never held while taking another lock of this list (except
+//      group_load_lock)
+//   -> group_load_lock, held while a group's bitmaps are read
 class FileSystem {
 private:
+    using SharedLock = std::shared_lock<std::shared_mutex>;
+    using ExclusiveLock = std::unique_lock<std::shared_mutex>;
 
     struct OpenFile {
-        uint32_t inode_index;
-        uint32_t offset;
-        bool in_use;
+        std::atomic<uint32_t> inode_index;              // Read without the shard lock by hasTails()
+        uint64_t offset;
+        std::atomic<bool> in_use;                       // Changed under the shard lock, checked under lock
+        std::vector<uint32_t> block_map;                // Translated disk blocks of the first block_map.size() file blocks
+
+        // Readahead: a read starting where the previous one ended is sequential
+        // and grows the window, any other read cancels it
+        uint64_t ra_expected;                           // Offset a sequential read starts at
+        uint32_t ra_window;                             // Blocks read ahead, 0 while access is random
+        uint32_t ra_end;                                // File block after the last one read ahead
+
+        // Append buffer. Small writes at the end of the file collect here and
+        // reach the disk as whole blocks when it fills, when the descriptor is
+        // closed, on sync, or as soon as the file is used any other way. It
+        // holds the file bytes from tail_start (block aligned) on and is
+        // guarded by the inode lock, so other descriptors of the file can
+        // flush it. At most one descriptor of a file has one at a time.
+        std::vector<char> tail;
+        uint64_t tail_start;
+        std::atomic<bool> has_tail;
+
+        // Last cluster of a compressed file decoded through this descriptor.
+        // Guarded like block_map, and dropped along with it.
+        std::vector<char> cluster;
+        uint64_t cluster_index;                         // UINT64_MAX while cluster holds nothing
+
+        std::mutex lock;                                // Serializes calls on this descriptor
     };
 
+    // The descriptor table is split into shards, each with its own lock for
+    // claiming and releasing slots. A thread starts looking in its own shard.
+    static constexpr uint32_t READAHEAD_MIN = 4;       // Blocks
+    static constexpr uint32_t READAHEAD_MAX = 64;
+    static const uint32_t TAIL_BLOCKS = 16;             // Size of an append buffer
+    static const uint32_t VIEW_MAX_BLOCKS = 256;        // Blocks one readView pins at most
     static const int MAX_OPEN_FILES = 256;
+    static const int FD_SHARDS = 16;
     OpenFile fd_table[MAX_OPEN_FILES];
+    std::mutex fd_shard_locks[FD_SHARDS];
+
+    std::mutex& fdShardLock(int fd) { return fd_shard_locks[fd / (MAX_OPEN_FILES / FD_SHARDS)]; }
+
+    // Append buffers (fs/fs.cpp). All but flushAllTails expect the inode
+    // lock to be held exclusively; fd is the caller's descriptor, whose block
+    // map is used.
+    std::atomic<uint32_t> tails_pending;                // Descriptors with an append buffer
+    void writeAt(int fd, uint32_t inode_index, Inode& inode, uint64_t offset, const char* buffer, uint32_t count);
+    void appendToTail(int fd, Inode& inode, const char* buffer, uint32_t count);
+    void flushTail(int owner, int fd, Inode& inode, bool keep_partial);
+    bool hasTails(uint32_t inode_index);
+    void flushTails(uint32_t inode_index, Inode& inode, int fd);
+    void flushAllTails();                               // Takes the locks itself
+
+    // Inline data. Files get INODE_INLINE when they are created and keep
+    // their bytes in the inode until a write or truncate goes past
+    // INLINE_DATA_SIZE; then promoteInline moves them into a block.
+    static const uint32_t INLINE_DATA_SIZE = 84;
+    bool isInline(const Inode& inode) const { return (super_cache.features & FS_FEATURE_INLINE_DATA) && (inode.flags & INODE_INLINE); }
+    static void copyInline(const Inode& inode, uint64_t offset, char* out, uint32_t count);
+    static void storeInline(Inode& inode, uint64_t offset, const char* data, uint32_t count);
+    void promoteInline(int fd, uint32_t inode_index, Inode& inode);
+
+    // Compressed files. Their data is kept in clusters of CLUSTER_BLOCKS file
+    // blocks, and the block map doubles as the cluster map: a cluster whose
+    // last slot holds COMPRESSED_CLUSTER (never a valid block number) has a
+    // ClusterHeader and the codec's output in its leading slots, any other
+    // cluster is stored as plain blocks and holes. Every write re-encodes the
+    // clusters it touches into newly allocated blocks, the old ones are freed
+    // with the transaction. The readers expect the inode lock to be held,
+    // writeClusters and storeCluster to be held exclusively.
+    static const uint32_t CLUSTER_BLOCKS = 16;
+    static const uint32_t COMPRESSED_CLUSTER = 0xFFFFFFFF;
+    struct ClusterHeader {
+        uint32_t length;                                // Bytes of codec output after the header
+        uint32_t raw_length;                            // Bytes it decodes to, the rest of the cluster is zeroes
+    };
+    bool isCompressed(const Inode& inode) const { return (super_cache.features & FS_FEATURE_COMPRESSION) && (inode.flags & INODE_COMPRESSED); }
+    const char* readCluster(int fd, const Inode& inode, uint64_t cluster);
+    void readCompressed(int fd, const Inode& inode, uint64_t offset, char* out, uint32_t count);
+    void writeClusters(int fd, uint32_t inode_index, Inode& inode, uint64_t offset, const char* buffer, uint32_t count);   // nullptr writes zeroes
+    void storeCluster(int fd, uint32_t inode_index, Inode& inode, uint64_t cluster, std::vector<char>& data);
+    uint64_t writeBlocksNeeded(int fd, uint32_t count);  // Blocks a write at the descriptor's offset may allocate
+
+    // Zeroes [from, to), which lies in one file block, unless that block is a
+    // hole. Expects the inode lock to be held exclusively.
+    void zeroPartial(int fd, const Inode& inode, uint64_t from, uint64_t to);
+
+    // Block groups. Every group has its own bitmaps, so allocations in
+    // different groups never touch the same bitmap words or blocks. A group's
+    // bitmaps are read on its first use; until then the free counts of its
+    // descriptor stand in for them, so full groups are skipped unread.
+    std::vector<GroupDesc> groups;
+    std::unique_ptr<Bitmap[]> inode_bitmaps;            // In memory copies of the allocation bitmaps, one per group
+    std::unique_ptr<Bitmap[]> data_bitmaps;
+    std::unique_ptr<std::atomic<bool>[]> group_loaded;
+    std::mutex group_load_lock;
+    std::atomic<uint32_t> next_dir_group;               // Where the search for a new directory's group starts
+
+    std::atomic<uint64_t> free_blocks;                  // Totals over all groups, kept for statfs()
+    std::atomic<uint64_t> free_inodes;
+
+    void loadGroup(uint32_t group);                     // Reads the group's bitmaps unless they are loaded
+    uint32_t groupFreeBlocks(uint32_t group) const;
+    uint32_t groupFreeInodes(uint32_t group) const;
+    void writeSummary(uint32_t state);                  // Free counts and state into superblock and changed descriptor blocks
+    void syncLocked(uint32_t state);                    // sync() with commit_lock held exclusively
+
+    uint32_t groupOfBlock(uint32_t disk_block) const { return disk_block / super_cache.blocks_per_group; }
+    uint32_t groupOfInode(uint32_t inode_index) const { return inode_index / super_cache.inodes_per_group; }
+    bool inodeAllocated(uint32_t inode_index);
+    uint32_t inodeBlock(uint32_t inode_index) const;    // Inode table block holding inode_index
+    uint32_t homeGroup() const;                         // Group the calling thread allocates in by default
+    uint32_t pickDirectoryGroup();
+    int64_t dataGoal(uint32_t inode_index) const;       // Where the first block of a file is looked for
+    void freeInode(uint32_t inode_index);
+
+    // Bulk versions for createFiles/deleteFiles: each bitmap block is written
+    // back once. allocateInodes leaves writing the new inodes to the caller.
+    std::vector<uint32_t> allocateInodes(uint32_t count, int64_t group);
+    void freeInodes(const std::vector<uint32_t>& inode_indexes);
+
+    // One reader/writer lock per inode. A group's locks are made on the first
+    // use of one of its inodes, so large images do not pay for idle groups.
+    std::unique_ptr<std::atomic<std::shared_mutex*>[]> inode_locks;
+    std::shared_mutex& inodeLock(uint32_t inode_index);
+
+    // Inode cache, sharded by inode number
+    struct InodeShard {
+        std::mutex lock;
+        InodeCache cache;
+
+        explicit InodeShard(uint32_t capacity) : cache(capacity) {}
+    };
+
+    static const uint32_t INODE_CACHE_SIZE = 4096;
+    static const uint32_t CACHE_SHARDS = 16;
+    std::unique_ptr<InodeShard> inode_shards[CACHE_SHARDS];
+
+    InodeShard& inodeShard(uint32_t inode_index) { return *inode_shards[inode_index % CACHE_SHARDS]; }
+    std::mutex flush_lock;                              // One flushInodes at a time
+    void flushInodes();                                 // Write back dirty inodes, one write per table block
+    void flushInodesLocked();                           // flushInodes with flush_lock already held
+    void evictInodes(InodeShard& shard);
+    void pinInode(uint32_t inode_index, const Inode& inode);
+    void unpinInode(uint32_t inode_index);
+    void dropInode(uint32_t inode_index);
+
+    // Name cache, sharded by directory and name
+    struct DentryShard {
+        std::mutex lock;
+        DentryCache cache;
+
+        explicit DentryShard(uint32_t capacity) : cache(capacity) {}
+    };
+
+    static const uint32_t DENTRY_CACHE_SIZE = 16384;
+    std::unique_ptr<DentryShard> dentry_shards[CACHE_SHARDS];
+
+    DentryShard& dentryShard(uint32_t dir_index, const std::string& name);
+    void cacheDentry(uint32_t dir_index, const std::string& name, int64_t inode_index);
+    void purgeDentries(uint32_t dir_index);
+
+    // Blocks freed in the running transaction. Their bits are cleared on disk
+    // in the same transaction but held in memory, and only become allocatable
+    // after it commits, so a crash cannot leave them owned by a file and
+    // already reused by another one.
+    std::mutex pending_lock;
+    std::vector<uint32_t> pending_frees;
+    std::atomic<uint64_t> pending_blocks;               // Held bits among them, counted as free by statfs()
+    void releaseFrees();
+    bool spaceShort(uint64_t blocks) const;             // Whether a commit would free space the caller needs
+    void commitJournal();                               // Called with commit_lock held exclusively
+
+    std::shared_mutex commit_lock;
+
+    // Keeps the metadata updates of one call inside a single journal transaction
+    class Operation {
+    private:
+        FileSystem& fs;
+        SharedLock lock;
+
+    public:
+        explicit Operation(FileSystem& fs_, uint64_t blocks = 0);     // blocks: how many the call may allocate
+        ~Operation();
+    };
+
+    // Block map (fs/blockmap.cpp)
+    uint32_t pointersPerBlock() const;
+    uint64_t maxFileBlocks() const;
+    void mapBlocks(const Inode& inode, uint32_t first, uint32_t count, uint32_t* out);
+    void assignBlocks(Inode& inode, const std::vector<std::pair<uint32_t, uint32_t>>& mapping);
+    void freeFileBlocks(Inode& inode);
+    void freeBlockRange(Inode& inode, uint64_t first, uint64_t end);   // File blocks [first, end), holes are skipped
+    const uint32_t* mapForFd(int fd, const Inode& inode, uint32_t first, uint32_t count);
+    void invalidateBlockMaps(uint32_t inode_index, uint32_t from);
+    void readAhead(int fd, const Inode& inode, uint64_t offset, uint32_t count);
+
+    // Hashed directories (fs/dir.cpp)
+    uint32_t dirBlock(const Inode& dir, uint32_t logical);
+    uint32_t appendDirBlock(uint32_t dir_index, Inode& dir);
+    uint32_t leafFor(const Inode& dir, uint32_t hash);
+    void doubleDirTable(uint32_t dir_index, Inode& dir);
+    void splitDirLeaf(uint32_t dir_index, Inode& dir, uint32_t hash);
+
+    // Paths (fs/path.cpp). walkPath and resolveParent return the inode they
+    // found locked in exclusive or shared (whichever lock is passed), or unlocked
+    // when neither is. lookupChild expects dir_index to be locked by the caller.
+    static std::vector<std::string> splitPath(const std::string& path);
+    int64_t lookupChild(uint32_t dir_index, const Inode& dir, const std::string& name);
+    int64_t walkPath(const std::vector<std::string>& components, size_t count, ExclusiveLock* exclusive, SharedLock* shared);
+    bool resolveParent(const std::string& path, uint32_t* parent_index, std::string* name, ExclusiveLock* exclusive, SharedLock* shared);
+
+    // Batches (createFiles/deleteFiles): indexes of paths grouped by their
+    // parent directory, and the names per journal transaction
+    static std::map<std::string, std::vector<size_t>> groupByParent(const std::vector<std::string>& paths);
+    static const uint32_t BATCH_FILES = 256;
 
 public:
     bool isMounted;
     DiskManager disk;
     Superblock super_cache;
 
-    explicit FileSystem(std::string diskImagePath) 
-        : disk(diskImagePath), isMounted(false) {
+    explicit FileSystem(std::string diskImagePath, DiskBackend backend = DiskBackend::Pread)
+        : tails_pending(0), next_dir_group(0), free_blocks(0), free_inodes(0), pending_blocks(0), isMounted(false), disk(diskImagePath, backend) {
 
         for (int i = 0; i < MAX_OPEN_FILES; ++i) {
+            fd_table[i].inode_index = 0;
             fd_table[i].in_use = false;
+            fd_table[i].has_tail = false;
+            fd_table[i].cluster_index = UINT64_MAX;
+        }
+
+        for (uint32_t i = 0; i < CACHE_SHARDS; ++i) {
+            inode_shards[i].reset(new InodeShard(INODE_CACHE_SIZE / CACHE_SHARDS));
+            dentry_shards[i].reset(new DentryShard(DENTRY_CACHE_SIZE / CACHE_SHARDS));
         }
     }
 
+    ~FileSystem();
+
     Inode readInode(uint32_t inode_index);
     void writeInode(uint32_t inode_index, Inode inode);
-    uint32_t allocateInode();
-    uint32_t allocateDataBlock();
+    uint32_t allocateInode(int64_t group = -1);         // Looks in group first, or the thread's home group
+    uint32_t allocateDataBlock(int64_t goal = -1);
+    std::vector<Extent> allocateDataBlocks(uint32_t count, int64_t goal = -1);
+    void freeDataBlocks(const std::vector<uint32_t>& blocks);
+    void loadBitmaps();                                 // Trusts the summary after a clean unmount, counts the bitmaps otherwise
+    FsStat statfs() const;
+    void sync();
     void unmount();
 
+    // Directory entries; callers write the directory inode back afterwards
+    void initDirectory(uint32_t dir_index, Inode& dir, uint32_t parent_index);
+    int64_t lookupEntry(const Inode& dir, const std::string& name);
+    bool addEntry(uint32_t dir_index, Inode& dir, const std::string& name, uint32_t inode_index);
+    int64_t removeEntry(const Inode& dir, const std::string& name);
+    std::vector<DirEntry> readDirectory(const Inode& dir);
+    uint32_t dirEntryCount(const Inode& dir);
+    uint32_t dirParent(const Inode& dir);
+
+    int64_t lookupPath(const std::string& path);        // Inode of path or -1
+    bool createDirectory(const std::string& path);
+    bool deleteDirectory(const std::string& path);
+
     bool createFile(const std::string& fileName);
 
     int openFile(const std::string& fileName);
@@ -84,11 +447,54 @@ public:
     int readFile(int fd, char* buffer, uint32_t count);
     int writeFile(int fc, const char* buffer, uint32_t count);
 
+    // Sparse files. Blocks which were never written (or were punched out) are
+    // holes: they own no disk block and read as zeroes. seekFile may move past
+    // the end of the file; a write there leaves a hole in between.
+    // truncateFile frees the blocks past the new size, punchHole frees the
+    // whole blocks in [offset, offset + length) and zeroes the rest of it.
+    bool seekFile(int fd, uint64_t offset);
+    bool truncateFile(int fd, uint64_t size);
+    bool punchHole(int fd, uint64_t offset, uint64_t length);
+
+    // Compression. Switched on for a file, its data is compressed in clusters
+    // of 64 KB, and a read decodes only the clusters it touches. A write
+    // re-encodes every cluster it touches; appends collect a whole cluster in
+    // the append buffer first, but scattered small writes pay a cluster each.
+    // Only an empty file can be switched; false otherwise, or when the image
+    // predates compression.
+    bool setCompression(int fd, bool enabled);
+
+    // Zero copy reads. readView works like readFile but fills view instead
+    // of copying (dropping what it held before), and returns at most
+    // VIEW_MAX_BLOCKS blocks worth at a time. exportFile writes up to count
+    // bytes to the host descriptor host_fd, which the kernel copies straight
+    // from the image. Both return the byte count, 0 at EOF and -1 for a bad fd.
+    int readView(int fd, uint32_t count, FileView& view);
+    int64_t exportFile(int fd, int host_fd, uint64_t count);
+
+    // Appends everything left in the host descriptor host_fd to the open file
+    // fd and returns the byte count. A second thread reads the host file into
+    // IMPORT_BUFFERS buffers while this one writes the previous ones, so the
+    // host reads overlap the image writes.
+    static const uint32_t IMPORT_BUFFER_SIZE = 4 * 1024 * 1024;
+    static const uint32_t IMPORT_BUFFERS = 4;
+    int64_t importFile(int host_fd, int fd);
+
     bool deleteFile(const std::string& fileName);
 
-    void listFiles();
+    // Many files at once. Names in the same directory are handled together:
+    // the directory is resolved and locked once, inodes are allocated or
+    // freed in bulk, and every BATCH_FILES of them are one journal
+    // transaction. Returns per path whether it was created (deleted).
+    std::vector<bool> createFiles(const std::vector<std::string>& fileNames);
+    std::vector<bool> deleteFiles(const std::vector<std::string>& fileNames);
+
+    void listFiles(const std::string& path = "/");
+
+    // Counters and latency histograms of this filesystem and its disk
+    Stats& getStats() { return disk.getStats(); }
 };
 
 void mkfs(std::string diskImagePath);
 
-FileSystem* mount(std::string diskImagePath);
+FileSystem* mount(std::string diskImagePath, DiskBackend backend = DiskBackend::Pread);
@@ -0,0 +1,148 @@
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include "fs.h"
+#include "inode_cache.h"
+
+struct InodeCache::Entry {
+    Inode inode;
+    bool dirty;
+    uint32_t pins;
+    std::list<uint32_t>::iterator pos;
+};
+
+InodeCache::InodeCache(uint32_t capacity_) : capacity(capacity_) {}
+
+InodeCache::~InodeCache() {
+
+    clear();
+
+}
+
+Inode* InodeCache::get(uint32_t inode_index) {
+
+    auto it = entries.find(inode_index);
+    if (it == entries.end()) {
+        return nullptr;
+    }
+
+    lru.splice(lru.begin(), lru, it->second->pos);
+    return &it->second->inode;
+}
+
+Inode* InodeCache::put(uint32_t inode_index, const Inode& inode) {
+
+    auto it = entries.find(inode_index);
+
+    if (it != entries.end()) {
+        it->second->inode = inode;
+        lru.splice(lru.begin(), lru, it->second->pos);
+        return &it->second->inode;
+    }
+
+    Entry* entry = new Entry;
+    entry->inode = inode;
+    entry->dirty = false;
+    entry->pins = 0;
+
+    lru.push_front(inode_index);
+    entry->pos = lru.begin();
+    entries[inode_index] = entry;
+
+    return &entry->inode;
+}
+
+void InodeCache::erase(uint32_t inode_index) {
+
+    auto it = entries.find(inode_index);
+    if (it == entries.end()) {
+        return;
+    }
+
+    lru.erase(it->second->pos);
+    delete it->second;
+    entries.erase(it);
+
+}
+
+void InodeCache::markDirty(uint32_t inode_index) {
+
+    auto it = entries.find(inode_index);
+    if (it == entries.end()) {
+        throw std::runtime_error(std::string("Inode is not cached: ") + std::to_string(inode_index));
+    }
+
+    it->second->dirty = true;
+
+}
+
+void InodeCache::markClean(uint32_t inode_index) {
+
+    auto it = entries.find(inode_index);
+    if (it != entries.end()) {
+        it->second->dirty = false;
+    }
+
+}
+
+void InodeCache::pin(uint32_t inode_index) {
+
+    auto it = entries.find(inode_index);
+    if (it == entries.end()) {
+        throw std::runtime_error(std::string("Inode is not cached: ") + std::to_string(inode_index));
+    }
+
+    ++it->second->pins;
+
+}
+
+void InodeCache::unpin(uint32_t inode_index) {
+
+    auto it = entries.find(inode_index);
+    if (it != entries.end() && it->second->pins > 0) {
+        --it->second->pins;
+    }
+
+}
+
+int64_t InodeCache::victim() const {
+
+    for (auto it = lru.rbegin(); it != lru.rend(); ++it) {
+        if (entries.at(*it)->pins == 0) {
+            return *it;
+        }
+    }
+
+    return -1;
+}
+
+bool InodeCache::isDirty(uint32_t inode_index) const {
+
+    auto it = entries.find(inode_index);
+    return it != entries.end() && it->second->dirty;
+}
+
+std::vector<uint32_t> InodeCache::dirtyInodes() const {
+
+    std::vector<uint32_t> dirty;
+
+    for (const auto& entry : entries) {
+        if (entry.second->dirty) {
+            dirty.push_back(entry.first);
+        }
+    }
+
+    std::sort(dirty.begin(), dirty.end());
+    return dirty;
+}
+
+void InodeCache::clear() {
+
+    for (auto& entry : entries) {
+        delete entry.second;
+    }
+
+    entries.clear();
+    lru.clear();
+
+}
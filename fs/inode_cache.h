@@ -0,0 +1,48 @@
+#ifndef INODE_CACHE_H
+#define INODE_CACHE_H
+
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+struct Inode;
+
+// In memory inodes keyed by inode number. Entries are dirty until FileSystem
+// writes them back; pinned entries (inodes of open files) are never evicted.
+class InodeCache {
+private:
+    struct Entry;
+
+    uint32_t capacity;
+    std::unordered_map<uint32_t, Entry*> entries;
+    std::list<uint32_t> lru;                            // Front is most recently used
+
+public:
+    explicit InodeCache(uint32_t capacity_);
+    ~InodeCache();
+
+    InodeCache(const InodeCache&) = delete;
+    InodeCache& operator=(const InodeCache&) = delete;
+
+    // Cached inode or nullptr, a hit makes the entry most recently used
+    Inode* get(uint32_t inode_index);
+    Inode* put(uint32_t inode_index, const Inode& inode);
+    void erase(uint32_t inode_index);
+
+    void markDirty(uint32_t inode_index);
+    void markClean(uint32_t inode_index);
+    void pin(uint32_t inode_index);
+    void unpin(uint32_t inode_index);
+
+    bool overCapacity() const { return entries.size() > capacity; }
+
+    // Least recently used unpinned inode, -1 if every entry is pinned
+    int64_t victim() const;
+    bool isDirty(uint32_t inode_index) const;
+
+    std::vector<uint32_t> dirtyInodes() const;          // Sorted by inode number
+    void clear();
+};
+
+#endif
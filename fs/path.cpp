@@ -0,0 +1,276 @@
+#include "fs.h"
+#include <cstring>
+#include <stdexcept>
+
+// Path resolution, mkdir and rmdir. Paths are '/' separated and always start
+// at the root directory (a leading '/' is optional); "." and ".." are resolved
+// through the directory header.
+
+std::vector<std::string> FileSystem::splitPath(const std::string& path) {
+
+    std::vector<std::string> components;
+    size_t start = 0;
+
+    while (start <= path.length()) {
+
+        size_t end = path.find('/', start);
+        if (end == std::string::npos) {
+            end = path.length();
+        }
+
+        if (end > start) {
+            components.push_back(path.substr(start, end - start));
+        }
+
+        start = end + 1;
+    }
+
+    return components;
+}
+
+FileSystem::DentryShard& FileSystem::dentryShard(uint32_t dir_index, const std::string& name) {
+
+    size_t hash = std::hash<std::string>()(name) ^ (static_cast<size_t>(dir_index) * 0x9E3779B97F4A7C15ULL);
+    return *dentry_shards[hash % CACHE_SHARDS];
+}
+
+void FileSystem::cacheDentry(uint32_t dir_index, const std::string& name, int64_t inode_index) {
+
+    DentryShard& shard = dentryShard(dir_index, name);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    shard.cache.insert(dir_index, name, inode_index);
+
+}
+
+void FileSystem::purgeDentries(uint32_t dir_index) {
+
+    for (auto& shard : dentry_shards) {
+        std::lock_guard<std::mutex> guard(shard->lock);
+        shard->cache.purgeDirectory(dir_index);
+    }
+
+}
+
+int64_t FileSystem::lookupChild(uint32_t dir_index, const Inode& dir, const std::string& name) {
+
+    int64_t inode_index;
+
+    {
+        DentryShard& shard = dentryShard(dir_index, name);
+        std::lock_guard<std::mutex> guard(shard.lock);
+
+        if (shard.cache.find(dir_index, name, &inode_index)) {
+            return inode_index;
+        }
+    }
+
+    // The directory is locked by the caller, so nobody changes the entry until it is cached
+    inode_index = lookupEntry(dir, name);
+    cacheDentry(dir_index, name, inode_index < 0 ? DentryCache::NEGATIVE : inode_index);
+
+    return inode_index;
+}
+
+int64_t FileSystem::walkPath(const std::vector<std::string>& components, size_t count, ExclusiveLock* exclusive, SharedLock* shared) {
+
+    uint32_t current = 0;   // Root inode is inode 0
+
+    // Lock coupling: the next inode is locked before the current directory is
+    // released, so nothing on the path can be removed while it is walked
+    SharedLock held;
+
+    if (count == 0 && exclusive != nullptr) {
+        *exclusive = ExclusiveLock(inodeLock(current));
+        return current;
+    }
+
+    held = SharedLock(inodeLock(current));
+
+    for (size_t i = 0; i < count; ++i) {
+
+        Inode dir = readInode(current);
+
+        if (dir.mode != 0) {
+            return -1;  // Not a directory
+        }
+
+        if (components[i] == ".") {
+            continue;
+        }
+
+        int64_t next;
+        bool coupled = true;
+
+        if (components[i] == "..") {
+            // Locking towards the root would break the lock order, so the
+            // parent is locked after the current directory is released
+            next = dirParent(dir);
+            coupled = false;
+        } else {
+            next = lookupChild(current, dir, components[i]);
+            if (next < 0) {
+                return -1;
+            }
+        }
+
+        if (next == current) {
+            continue;
+        }
+
+        if (!coupled) {
+            held.unlock();
+        }
+
+        if (i + 1 == count && exclusive != nullptr) {
+            *exclusive = ExclusiveLock(inodeLock(next));
+            return next;
+        }
+
+        held = SharedLock(inodeLock(next));
+        current = next;
+    }
+
+    // The walk ended on a directory it already holds ("." or "..")
+    if (exclusive != nullptr) {
+        held.unlock();
+        *exclusive = ExclusiveLock(inodeLock(current));
+    } else if (shared != nullptr) {
+        *shared = std::move(held);
+    }
+
+    return current;
+}
+
+int64_t FileSystem::lookupPath(const std::string& path) {
+
+    Stats::Timer timer(disk.getStats(), Stats::LOOKUP_PATH_NS);
+
+    std::vector<std::string> components = splitPath(path);
+    return walkPath(components, components.size(), nullptr, nullptr);
+}
+
+bool FileSystem::resolveParent(const std::string& path, uint32_t* parent_index, std::string* name, ExclusiveLock* exclusive, SharedLock* shared) {
+
+    std::vector<std::string> components = splitPath(path);
+
+    if (components.empty()) {
+        return false;
+    }
+
+    const std::string& last = components.back();
+
+    if (last.length() > MAX_NAME_LEN || last == "." || last == "..") {
+        return false;
+    }
+
+    int64_t parent = walkPath(components, components.size() - 1, exclusive, shared);
+    if (parent < 0) {
+        return false;
+    }
+
+    if (readInode(parent).mode != 0) {
+        return false;
+    }
+
+    *parent_index = parent;
+    *name = last;
+
+    return true;
+}
+
+bool FileSystem::createDirectory(const std::string& path) {
+
+    if (!isMounted) {
+        throw std::runtime_error("Disk is not mounted.");
+    }
+
+    Stats::Timer timer(disk.getStats(), Stats::CREATE_DIRECTORY_NS);
+
+    Operation operation(*this);
+
+    // Step 1: Find the parent directory and check for duplicates
+    uint32_t parent_index;
+    std::string name;
+    ExclusiveLock parent_lock;
+
+    if (!resolveParent(path, &parent_index, &name, &parent_lock, nullptr)) {
+        return false;
+    }
+
+    Inode parent = readInode(parent_index);
+
+    if (lookupChild(parent_index, parent, name) >= 0) {
+        return false;
+    }
+
+    // Step 2: Allocate the directory inode and lay out an empty directory
+    uint32_t dir_index = allocateInode(pickDirectoryGroup());
+
+    Inode dir;
+    std::memset(&dir, 0, sizeof(Inode));
+    dir.mode = 0;  // directory
+    dir.ref_count = 2;
+
+    initDirectory(dir_index, dir, parent_index);
+    writeInode(dir_index, dir);
+
+    // Step 3: Link it into the parent, whose '..' count goes up
+    addEntry(parent_index, parent, name, dir_index);
+    parent.ref_count += 1;
+    writeInode(parent_index, parent);
+
+    cacheDentry(parent_index, name, dir_index);
+
+    return true;
+}
+
+bool FileSystem::deleteDirectory(const std::string& path) {
+
+    if (!isMounted) {
+        throw std::runtime_error("Disk is not mounted.");
+    }
+
+    Stats::Timer timer(disk.getStats(), Stats::DELETE_DIRECTORY_NS);
+
+    Operation operation(*this);
+
+    uint32_t parent_index;
+    std::string name;
+    ExclusiveLock parent_lock;
+
+    if (!resolveParent(path, &parent_index, &name, &parent_lock, nullptr)) {
+        return false;
+    }
+
+    Inode parent = readInode(parent_index);
+
+    // Step 1: Only empty directories can be removed
+    int64_t found = lookupChild(parent_index, parent, name);
+    if (found < 0) {
+        return false;
+    }
+
+    uint32_t dir_index = found;
+    ExclusiveLock dir_lock(inodeLock(dir_index));
+    Inode dir = readInode(dir_index);
+
+    if (dir.mode != 0 || dirEntryCount(dir) != 0) {
+        return false;
+    }
+
+    // Step 2: Free its blocks and inode
+    freeFileBlocks(dir);
+
+    dropInode(dir_index);
+    freeInode(dir_index);
+
+    // Step 3: Unlink it from the parent
+    removeEntry(parent, name);
+    parent.ref_count -= 1;
+    writeInode(parent_index, parent);
+
+    cacheDentry(parent_index, name, DentryCache::NEGATIVE);
+    purgeDentries(dir_index);
+
+    return true;
+}